@@ -13,15 +13,20 @@
 
 #include <pinch/pinch.hpp>
 
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
 #include <pinch/connection.hpp>
 #include <pinch/operations.hpp>
+#include <pinch/window-tuner.hpp>
 
 namespace pinch
 {
 
-/// \brief Constant values for the packet and window size
-const uint32_t kMaxPacketSize = 0x8000, kWindowSize = 4 * kMaxPacketSize;
-
 // --------------------------------------------------------------------
 
 namespace detail
@@ -68,14 +73,65 @@ namespace detail
 		handler_work<Handler, IoExecutor> m_work;
 	};
 
+	/// \brief The data received on a channel, kept in the chunks in which it arrived
+
+	class receive_queue
+	{
+	  public:
+		bool empty() const { return m_size == 0; }
+		std::size_t size() const { return m_size; }
+
+		/// \brief Append a copy of \a size bytes at \a data
+		void append(const char *data, std::size_t size);
+
+		/// \brief Move as much data as fits into \a buffers, returns the number of bytes moved
+		template <typename MutableBufferSequence>
+		std::size_t read(const MutableBufferSequence &buffers)
+		{
+			std::size_t result = 0;
+
+			for (auto buf = boost::asio::buffer_sequence_begin(buffers);
+				 buf != boost::asio::buffer_sequence_end(buffers) and not empty();
+				 ++buf)
+			{
+				boost::asio::mutable_buffer b(*buf);
+
+				while (b.size() > 0 and not empty())
+				{
+					auto &chunk = m_chunks.front();
+
+					std::size_t n = std::min(b.size(), chunk.size() - m_offset);
+					std::memcpy(b.data(), chunk.data() + m_offset, n);
+
+					b += n;
+					result += n;
+					consume(n);
+				}
+			}
+
+			return result;
+		}
+
+		/// \brief The data as a sequence of buffers, valid until the next call to consume
+		std::vector<boost::asio::const_buffer> data() const;
+
+		/// \brief Remove the first \a size bytes
+		void consume(std::size_t size);
+
+	  private:
+		std::deque<blob> m_chunks;
+		std::size_t m_offset = 0; ///< The number of bytes consumed from the first chunk
+		std::size_t m_size = 0;
+		blob m_spare;             ///< A consumed chunk, kept to save an allocation
+	};
+
 	class read_channel_op : public operation
 	{
 	  public:
 		std::size_t m_bytes_transferred = 0;
 
-		virtual std::deque<char>::iterator
-		transfer_bytes(std::deque<char>::iterator begin,
-			std::deque<char>::iterator end) = 0;
+		/// \brief Move data from \a received into the buffers, returns the number of bytes moved
+		virtual std::size_t transfer_bytes(receive_queue &received) = 0;
 	};
 
 	template <typename Handler, typename IoExecutor,
@@ -101,32 +157,11 @@ namespace detail
 			m_work.complete(handler, handler.m_handler);
 		}
 
-		virtual std::deque<char>::iterator
-		transfer_bytes(std::deque<char>::iterator begin,
-			std::deque<char>::iterator end) override
+		virtual std::size_t transfer_bytes(receive_queue &received) override
 		{
-			std::ptrdiff_t size = boost::asio::buffer_size(m_buffers);
-			if (size > end - begin)
-				size = end - begin;
-
-			for (auto buf = boost::asio::buffer_sequence_begin(m_buffers);
-				 buf != boost::asio::buffer_sequence_end(m_buffers) and size > 0;
-				 ++buf)
-			{
-				char *dst = static_cast<char *>(buf->data());
-
-				std::size_t bsize = size;
-				if (bsize > buf->size())
-					bsize = buf->size();
-
-				size -= bsize;
-				m_bytes_transferred += bsize;
-
-				while (bsize-- > 0)
-					*dst++ = *begin++;
-			}
-
-			return begin;
+			std::size_t n = received.read(m_buffers);
+			m_bytes_transferred += n;
+			return n;
 		}
 
 	  private:
@@ -136,31 +171,99 @@ namespace detail
 		MutableBufferSequence m_buffers;
 	};
 
+	/// \brief Return the first \a max bytes of \a buffers as a list of buffers
+	template <typename ConstBufferSequence>
+	std::vector<boost::asio::const_buffer> make_buffer_list(const ConstBufferSequence &buffers,
+		std::size_t max = std::numeric_limits<std::size_t>::max())
+	{
+		std::vector<boost::asio::const_buffer> result;
+
+		for (auto b = boost::asio::buffer_sequence_begin(buffers); max > 0 and b != boost::asio::buffer_sequence_end(buffers); ++b)
+		{
+			boost::asio::const_buffer buffer(*b);
+			if (buffer.size() > max)
+				buffer = boost::asio::const_buffer(buffer.data(), max);
+
+			if (buffer.size() > 0)
+				result.push_back(buffer);
+			max -= buffer.size();
+		}
+
+		return result;
+	}
+
+	/// \brief A write is sent in as many packets as the maximum packet size
+	/// and the host window require, these can all be in flight at once.
+	///
+	/// The data is not copied, the packets reference it until they are
+	/// encrypted. Either the caller keeps the data alive until the write
+	/// completes, or m_owner does.
 	class write_channel_op : public operation
 	{
 	  public:
-		std::size_t m_bytes_transferred = 0;
-		opacket m_packet;
+		message_type m_message = msg_channel_data;
+		std::vector<boost::asio::const_buffer> m_buffers;
+		std::shared_ptr<const void> m_owner; ///< Owner of the data in m_buffers, if any
+		std::size_t m_size = 0;              ///< The total size of m_buffers
+		std::size_t m_offset = 0;            ///< The number of bytes handed to the connection
+		std::size_t m_in_flight = 0;         ///< The number of packets not written yet
+		boost::system::error_code m_ec;
+
+		/// \brief Returns true if all data was handed to the connection
+		bool all_sent() const { return m_offset == m_size; }
+
+		/// \brief Return the next \a n bytes of data, and advance m_offset
+		std::vector<boost::asio::const_buffer> next(std::size_t n)
+		{
+			std::vector<boost::asio::const_buffer> result;
+
+			m_offset += n;
+
+			while (n > 0)
+			{
+				auto b = m_buffers[m_index] + m_index_offset;
+				if (b.size() > n)
+					b = boost::asio::const_buffer(b.data(), n);
+
+				result.push_back(b);
+				n -= b.size();
+
+				m_index_offset += b.size();
+				if (m_index_offset == m_buffers[m_index].size())
+				{
+					++m_index;
+					m_index_offset = 0;
+				}
+			}
+
+			return result;
+		}
+
+	  private:
+		std::size_t m_index = 0, m_index_offset = 0; ///< The position of m_offset in m_buffers
 	};
 
 	template <typename Handler, typename IoExecutor>
 	class write_channel_handler : public write_channel_op
 	{
 	  public:
-		write_channel_handler(Handler &&h, const IoExecutor &io_ex, opacket &&packet, std::size_t bytes_transferred)
+		write_channel_handler(Handler &&h, const IoExecutor &io_ex, message_type message,
+			std::vector<boost::asio::const_buffer> &&buffers, std::shared_ptr<const void> owner)
 			: m_handler(std::forward<Handler>(h))
 			, m_io_executor(io_ex)
 			, m_work(m_handler, m_io_executor)
 		{
-			m_bytes_transferred = bytes_transferred;
-			m_packet = std::move(packet);
+			m_message = message;
+			m_buffers = std::move(buffers);
+			m_owner = std::move(owner);
+			m_size = boost::asio::buffer_size(m_buffers);
 		}
 
 		virtual void complete(const boost::system::error_code &ec = {},
 			std::size_t bytes_transferred = 0) override
 		{
 			binder<Handler, boost::system::error_code, std::size_t> handler(
-				m_handler, ec, m_bytes_transferred);
+				m_handler, ec, ec ? 0 : m_size);
 
 			m_work.complete(handler, handler.m_handler);
 		}
@@ -206,6 +309,9 @@ namespace detail
 
 } // namespace detail
 
+/// \brief The default limits for the send queue of a channel, see channel::set_send_buffer_limits
+const std::size_t kDefaultSendHighWatermark = 0x200000, kDefaultSendLowWatermark = 0x80000;
+
 // --------------------------------------------------------------------
 /// \brief channel is the base class for implementing SSH channels
 ///
@@ -278,9 +384,8 @@ class channel : public std::enable_shared_from_this<channel>
 						// fall through
 						case open_connection:
 							state = open_channel;
-							m_my_window_size = kWindowSize;
-							m_my_channel_id = s_next_channel_id++;
-							m_connection->open_channel(shared_from_this(), m_my_channel_id);
+							m_my_window_size = m_tuner.get_window_size();
+							m_connection->open_channel(shared_from_this());
 							async_wait(wait_type::open, std::move(self));
 							return;
 
@@ -300,6 +405,105 @@ class channel : public std::enable_shared_from_this<channel>
 	/// \brief Close the channel
 	void close();
 
+	/// \brief Set the maximum size of the packets the server may send on this channel
+	///
+	/// Should be called before opening the channel. The size is limited to
+	/// the maximum packet size of the connection and the window is made at
+	/// least four times as large. Larger packets reduce the per packet
+	/// overhead for bulk transfers.
+	void set_max_packet_size(uint32_t size);
+
+	/// \brief The maximum size of the packets the server may send on this channel
+	uint32_t get_max_packet_size() const { return m_max_receive_packet_size; }
+
+	/// \brief Let the receive window grow up to \a size bytes
+	///
+	/// The window starts at four times the maximum packet size and is
+	/// enlarged when the application consumes the data faster than one
+	/// window per round trip, see window_tuner. The default is taken from
+	/// the connection, see basic_connection::set_max_window_size.
+	void set_max_window_size(uint32_t size);
+
+	/// \brief The limit for the receive window size
+	uint32_t get_max_window_size() const { return m_tuner.get_max_window_size(); }
+
+	/// \brief Statistics on the data received by this channel
+	channel_stats get_stats() const { return m_tuner.get_stats(); }
+
+	/// \brief Limit the data sent on this channel to \a bytes_per_second
+	///
+	/// Zero means no limit, \a burst is the size of the token bucket. The
+	/// limits of the connection apply as well, see rate_limiter.
+	void set_send_rate_limit(double bytes_per_second, std::size_t burst = 0);
+
+	/// \brief Limit the data received on this channel to \a bytes_per_second
+	///
+	/// The server is held back by delaying window adjusts.
+	void set_receive_rate_limit(double bytes_per_second, std::size_t burst = 0);
+
+	/// \brief The limit for the data sent, zero if there is none
+	double get_send_rate_limit() const { return m_send_limit.get_rate(); }
+
+	/// \brief The limit for the data received, zero if there is none
+	double get_receive_rate_limit() const { return m_receive_limit.get_rate(); }
+
+	/// \brief Continue sending and granting window right away, called after a rate limit changed
+	void rate_limits_changed();
+
+	/// \brief The data received but not read yet, without copying it
+	///
+	/// The buffers stay valid until the next call to consume or to
+	/// async_read_some. Use consume to mark the data as read.
+	std::vector<boost::asio::const_buffer> received_data() const { return m_received.data(); }
+
+	/// \brief Remove the first \a size bytes from received_data
+	void consume(std::size_t size);
+
+	/// \brief Called with each slice of data received, or with an error when the channel is closed
+	using receive_sink_type = std::function<void(const boost::system::error_code &ec, const char *data, std::size_t size)>;
+
+	/// \brief Hand all received data to \a sink as it arrives, instead of queueing it for async_read_some
+	///
+	/// Data already queued is passed on right away. The data is credited to
+	/// the server as soon as the sink returns, the sink should do its own
+	/// flow control. Pass an empty sink to return to normal reading.
+	void set_receive_sink(receive_sink_type sink);
+
+	/// \brief Set the traffic class for the data sent on this channel
+	///
+	/// Data of interactive channels is sent before that of bulk channels,
+	/// see outbound_scheduler. The default is bulk, terminal channels are
+	/// interactive.
+	void set_traffic_class(traffic_class cls) { m_traffic_class = cls; }
+
+	/// \brief The traffic class for the data sent on this channel
+	traffic_class get_traffic_class() const { return m_traffic_class; }
+
+	/// \brief Set the share of this channel relative to the other channels in the same traffic class
+	void set_weight(uint32_t weight) { m_weight = weight; }
+
+	/// \brief The share of this channel relative to the other channels in the same traffic class
+	uint32_t get_weight() const { return m_weight; }
+
+	/// \brief Set the limits for the data queued for sending
+	///
+	/// Writes are accepted as long as less than \a high_watermark bytes are
+	/// queued. Once the queue is full, new writes wait until it has drained
+	/// to \a low_watermark bytes, so their handlers are called later. The
+	/// variants of send_data without a handler cannot wait, their callers
+	/// should use async_wait with wait_type::write, which is triggered when
+	/// the queue is at or below the low watermark.
+	void set_send_buffer_limits(std::size_t high_watermark, std::size_t low_watermark);
+
+	/// \brief The number of bytes above which writes have to wait
+	std::size_t get_send_high_watermark() const { return m_send_high_watermark; }
+
+	/// \brief The number of bytes at or below which waiting writes are accepted again
+	std::size_t get_send_low_watermark() const { return m_send_low_watermark; }
+
+	/// \brief The number of bytes accepted for sending, but not written yet
+	std::size_t get_send_queued() const { return m_send_queued; }
+
 	/// \brief local copy of the wait_type specified above
 	using wait_type = detail::channel_wait_type;
 
@@ -409,83 +613,61 @@ class channel : public std::enable_shared_from_this<channel>
 	}
 
 	/// \brief Requirement for AsyncWriteStream
+	///
+	/// Takes as much data as the host window allows, but at least one
+	/// packet's worth. The data is sent in packets of the maximum packet size
+	/// that are all in flight at the same time. The data is not copied, as
+	/// usual \a buffer should stay valid until \a handler is called.
 	template <typename Handler, typename ConstBufferSequece>
 	auto async_write_some(const ConstBufferSequece &buffer, Handler &&handler)
 	{
-		enum { start, sending };
-
-		return boost::asio::async_compose<Handler, void(boost::system::error_code, std::size_t)>(
-			[
-				me = shared_from_this(),
-				buffer,
-				state = start
-			]
-			(auto &self, const boost::system::error_code &ec = {}, std::size_t bytes_transferred = 0) mutable
-			{
-				std::size_t n = buffer.size();
-				if (n > me->m_max_send_packet_size)
-					n = me->m_max_send_packet_size;
+		std::size_t n = std::min<std::size_t>(boost::asio::buffer_size(buffer),
+			std::max(m_max_send_packet_size, m_host_window_size));
 
-				if (not ec and state == start)
-				{
-					opacket packet(msg_channel_data);
-					packet << me->m_host_channel_id << std::make_pair(static_cast<const char*>(buffer.data()), n);
-
-					state = sending;
-
-					me->async_write_packet(std::move(packet), std::move(self));
-					return;
-				}
-
-				self.complete(ec, n);
-			}, handler
-		);
+		return async_write_data(msg_channel_data, detail::make_buffer_list(buffer, n), {}, std::forward<Handler>(handler));
 	}
 
   private:
-	/// \brief Internal routine for sending packets
+	/// \brief Internal routine for sending data in \a msg packets
 	template <typename Handler>
-	auto async_write_packet(opacket &&out, Handler &&handler)
+	auto async_write_data(message_type msg, std::vector<boost::asio::const_buffer> &&buffers,
+		std::shared_ptr<const void> owner, Handler &&handler)
 	{
 		return boost::asio::async_initiate<Handler, void(boost::system::error_code,
 														std::size_t)>(
-			async_write_impl{}, handler, this, std::move(out));
+			async_write_impl{}, handler, this, msg, std::move(buffers), std::move(owner));
 	}
 
 	// --------------------------------------------------------------------
 
   public:
 
-	/// \brief To send data through the channel using SSH_MSG_CHANNEL_DATA messages
-	template <typename Data, typename Handler>
-	auto send_data(const Data &&data, message_type msg, Handler &&handler)
+	/// \brief Send all data in \a buffers using SSH_MSG_CHANNEL_DATA messages
+	///
+	/// The data is not copied but encrypted straight from \a buffers, which
+	/// should stay valid until \a handler is called.
+	template <typename ConstBufferSequence, typename Handler>
+	auto send_buffers(const ConstBufferSequence &buffers, Handler &&handler)
 	{
-		return boost::asio::async_compose<Handler, void(boost::system::error_code, std::size_t)>(
-			[
-				me = shared_from_this(),
-				data = std::move(data),
-				offset = 0ULL,
-				msg
-			]
-			(auto &self, const boost::system::error_code &ec = {}, std::size_t bytes_transferred = 0) mutable
-			{
-				std::size_t n = data.size() - offset;
-				if (n > me->m_max_send_packet_size)
-					n = me->m_max_send_packet_size;
-
-				if (not ec and n > 0)
-				{
-					opacket packet(msg);
-					packet << me->m_host_channel_id << std::make_pair(reinterpret_cast<const char*>(data.data()) + offset, n);
-					offset += n;
+		return async_write_data(msg_channel_data, detail::make_buffer_list(buffers), {}, std::forward<Handler>(handler));
+	}
 
-					me->async_write_packet(std::move(packet), std::move(self));
-					return;
-				}
+	/// \brief Send the shared \a data through the channel using \a msg messages
+	///
+	/// The data is not copied, the same data can be sent through several
+	/// channels at the same time.
+	template <typename T, typename Handler>
+	auto send_data(std::shared_ptr<T> data, message_type msg, Handler &&handler)
+	{
+		auto buffer = boost::asio::buffer(std::as_const(*data));
+		return async_write_data(msg, { buffer }, std::move(data), std::forward<Handler>(handler));
+	}
 
-				self.complete(ec, data.size());
-			}, handler
-		);
+	/// \brief To send data through the channel using SSH_MSG_CHANNEL_DATA messages
+	template <typename Data, typename Handler>
+	auto send_data(Data &&data, message_type msg, Handler &&handler)
+	{
+		return send_data(std::make_shared<const std::decay_t<Data>>(std::forward<Data>(data)), msg, std::forward<Handler>(handler));
 	}
 
 	/// \brief To send data through the channel using SSH_MSG_CHANNEL_DATA messages
@@ -505,13 +687,18 @@ class channel : public std::enable_shared_from_this<channel>
 	channel(std::shared_ptr<basic_connection> connection)
 		: m_connection(connection)
 		, m_max_send_packet_size(0)
+		, m_max_receive_packet_size(kMaxPacketSize)
+		, m_tuner(kWindowSize, connection->get_max_window_size())
 		, m_channel_open(false)
 		, m_my_channel_id(0)
 		, m_host_channel_id(0)
 		, m_my_window_size(kWindowSize)
 		, m_host_window_size(0)
 		, m_eof(false)
+		, m_send_timer(connection->get_executor())
+		, m_receive_timer(connection->get_executor())
 	{
+		set_max_packet_size(m_connection->get_max_packet_size());
 	}
 
 	virtual ~channel()
@@ -525,7 +712,14 @@ class channel : public std::enable_shared_from_this<channel>
 
 	// low level stuff
 	void send_pending(const boost::system::error_code &ec = {});
+	void packet_written(detail::write_channel_op *op, std::size_t size, const boost::system::error_code &ec);
+	void accept_write_ops();
+	void fail_write_ops(const boost::system::error_code &ec);
 	void push_received();
+	void schedule_push_received();
+	void send_window_adjust();
+	rate_limiter::duration get_rate_limit_delay(direction dir, rate_limiter::time_point now);
+	void pace(direction dir, rate_limiter::duration delay);
 	void check_wait();
 	void add_read_op(detail::read_channel_op *op);
 	void add_write_op(detail::write_channel_op* op);
@@ -541,25 +735,37 @@ class channel : public std::enable_shared_from_this<channel>
 	std::shared_ptr<basic_connection> m_connection;
 
 	uint32_t m_max_send_packet_size;
+	uint32_t m_max_receive_packet_size; ///< as advertised to the server
+	window_tuner m_tuner;               ///< sizes the window restored with window adjusts
 	bool m_channel_open = false;
 	uint32_t m_my_channel_id;
 	uint32_t m_host_channel_id;
 	uint32_t m_my_window_size;
 	uint32_t m_host_window_size;
 
-	std::deque<char> m_received;
+	detail::receive_queue m_received;
+	bool m_queued = false;         ///< set when received data was queued in m_received
+	receive_sink_type m_receive_sink; ///< see set_receive_sink
+	bool m_push_scheduled = false; ///< set while a call to push_received is pending
 	std::deque<detail::read_channel_op *> m_read_ops;
 	std::deque<detail::write_channel_op *> m_write_ops;
+	std::deque<detail::write_channel_op *> m_waiting_write_ops; ///< waiting for room in the send queue
+	std::size_t m_send_queued = 0;                              ///< bytes in m_write_ops and in flight
+	std::size_t m_send_high_watermark = kDefaultSendHighWatermark;
+	std::size_t m_send_low_watermark = kDefaultSendLowWatermark;
+	traffic_class m_traffic_class = traffic_class::bulk;
+	uint32_t m_weight = 1;
 	std::deque<detail::wait_channel_op *> m_wait_ops;
 	bool m_eof;
+	rate_limiter m_send_limit, m_receive_limit;
+	boost::asio::steady_timer m_send_timer, m_receive_timer; ///< wait for the rate limits
+	bool m_send_paced = false, m_receive_paced = false;     ///< true while a timer is waiting
 
 	message_callback_type m_banner_handler;
 	message_callback_type m_message_handler;
 	message_callback_type m_error_handler;
 
   private:
-	static uint32_t s_next_channel_id;
-
 	// --------------------------------------------------------------------
 
 	struct async_read_impl
@@ -583,14 +789,15 @@ class channel : public std::enable_shared_from_this<channel>
 	struct async_write_impl
 	{
 		template <typename Handler>
-		void operator()(Handler &&handler, channel *ch, opacket &&packet)
+		void operator()(Handler &&handler, channel *ch, message_type msg,
+			std::vector<boost::asio::const_buffer> &&buffers, std::shared_ptr<const void> owner)
 		{
 			if (not ch->is_open())
 				handler(error::make_error_code(error::connection_lost), 0);
 			else
 			{
 				ch->add_write_op(new detail::write_channel_handler(
-					std::move(handler), ch->get_executor(), std::move(packet), packet.size() - sizeof(uint32_t)));
+					std::move(handler), ch->get_executor(), msg, std::move(buffers), std::move(owner)));
 				ch->send_pending();
 			}
 		}
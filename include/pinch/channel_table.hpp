@@ -0,0 +1,82 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/// \file
+/// Definition of the channel_table class
+///
+/// Every packet for a channel carries the channel ID the client assigned
+/// to it. The channel_table uses these IDs as index in a flat vector, so
+/// finding the channel for a packet takes constant time, also with
+/// thousands of channels on a single connection.
+///
+/// Slots are reused once a channel is closed. To prevent a late packet for
+/// a closed channel from reaching the next channel in the same slot, the
+/// ID also contains a generation number that is incremented each time a
+/// slot is released.
+
+#include <pinch/pinch.hpp>
+
+#include <memory>
+#include <vector>
+
+namespace pinch
+{
+
+class channel;
+using channel_ptr = std::shared_ptr<channel>;
+
+// --------------------------------------------------------------------
+
+/// \brief The channels of a connection, indexed by channel ID
+
+class channel_table
+{
+  public:
+	/// \brief Add \a ch to the table, returns the new channel ID, never zero
+	uint32_t insert(channel_ptr ch);
+
+	/// \brief Remove the channel with ID \a id, returns false if there was none
+	bool erase(uint32_t id);
+
+	/// \brief Return the channel with ID \a id, or an empty pointer if there is none
+	channel_ptr find(uint32_t id) const;
+
+	/// \brief The number of channels in the table
+	std::size_t size() const { return m_size; }
+
+	bool empty() const { return m_size == 0; }
+
+	/// \brief Return a copy of the list of channels, safe to use while channels are closed
+	std::vector<channel_ptr> channels() const;
+
+	/// \brief Call \a f for each channel, \a f should not add or remove channels
+	template <typename F>
+	void for_each(F &&f) const
+	{
+		for (auto &slot : m_slots)
+		{
+			if (slot.m_channel)
+				f(slot.m_channel);
+		}
+	}
+
+  private:
+	static constexpr uint32_t kIndexBits = 20, kIndexMask = (1U << kIndexBits) - 1;
+	static constexpr uint32_t kGenerationMask = (1U << (32 - kIndexBits)) - 1;
+
+	struct slot
+	{
+		channel_ptr m_channel;
+		uint32_t m_generation = 1;
+	};
+
+	std::vector<slot> m_slots;
+	std::vector<uint32_t> m_free; ///< indices of empty slots
+	std::size_t m_size = 0;
+};
+
+} // namespace pinch
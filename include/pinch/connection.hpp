@@ -8,9 +8,14 @@
 /// \file
 /// definition of the connection classes
 
+#include <atomic>
 #include <chrono>
+#include <concepts>
 #include <deque>
 #include <memory>
+#include <optional>
+#include <stdexcept>
+#include <vector>
 
 #if __cpp_impl_coroutine
 #include <coroutine>
@@ -21,19 +26,22 @@
 #include <boost/asio/spawn.hpp>
 #endif
 
+#include <pinch/channel_table.hpp>
+#include <pinch/connector.hpp>
 #include <pinch/crypto-engine.hpp>
 #include <pinch/error.hpp>
 #include <pinch/known_hosts.hpp>
 #include <pinch/operations.hpp>
 #include <pinch/pinch.hpp>
+#include <pinch/rate_limiter.hpp>
+#include <pinch/scheduler.hpp>
+#include <pinch/timer_wheel.hpp>
+#include <pinch/window-tuner.hpp>
 #include <pinch/ssh_agent.hpp>
 
 namespace pinch
 {
 
-class channel;
-using channel_ptr = std::shared_ptr<channel>;
-
 // --------------------------------------------------------------------
 
 class basic_connection;
@@ -135,6 +143,37 @@ namespace detail
 
 	// --------------------------------------------------------------------
 
+	/// \brief A read from or write to the next layer of a connection
+
+	class io_connection_op : public operation
+	{
+	};
+
+	template <typename Handler, typename IoExecutor>
+	class io_connection_handler : public io_connection_op
+	{
+	  public:
+		io_connection_handler(Handler &&h, const IoExecutor &io_ex)
+			: m_handler(std::forward<Handler>(h))
+			, m_io_executor(io_ex)
+			, m_work(m_handler, m_io_executor)
+		{
+		}
+
+		void complete(const boost::system::error_code &ec = {}, std::size_t bytes_transferred = 0) override
+		{
+			binder<Handler, boost::system::error_code, std::size_t> handler(m_handler, ec, bytes_transferred);
+			m_work.complete(handler, handler.m_handler);
+		}
+
+	  private:
+		Handler m_handler;
+		IoExecutor m_io_executor;
+		handler_work<Handler, IoExecutor> m_work;
+	};
+
+	// --------------------------------------------------------------------
+
 	/// \brief enum used in connection::async_wait
 	enum class connection_wait_type
 	{
@@ -186,10 +225,10 @@ namespace detail
 /// A connection has a `next layer` that implements a boost stream, it is over
 /// this next layer that connection send and retrieves its data.
 ///
-/// There are two implementations of this base class: connection and proxied_connection.
-/// The first uses a tcp::socket as next layer, the second a channel. That way
-/// you can stack connections on each other allowing one to hop from one server to
-/// another.
+/// There are two implementations of this base class: basic_stream_connection and
+/// proxied_connection. The first uses a stream as next layer, connection is the
+/// version using a tcp::socket. The second uses a channel. That way you can stack
+/// connections on each other allowing one to hop from one server to another.
 
 class basic_connection : public std::enable_shared_from_this<basic_connection>
 {
@@ -208,6 +247,8 @@ class basic_connection : public std::enable_shared_from_this<basic_connection>
 		, m_io_context(io_context)
 		, m_strand(m_io_context.get_executor())
 		, m_keep_alive_timer(m_io_context)
+		, m_idle_timer(m_io_context)
+		, m_handshake_timer(m_io_context)
 		, m_callback_executor(io_context.get_executor())
 	{
 	}
@@ -269,12 +310,49 @@ class basic_connection : public std::enable_shared_from_this<basic_connection>
 	/// Internally, connection keeps track of when the last I/O took
 	/// place and if this call is made within the kKeepAliveInterval
 	/// nothing will happen.
+	///
+	/// May be called from any thread, the timer is set by the thread
+	/// running the io_context.
 	void keep_alive(std::chrono::seconds interval = std::chrono::seconds(5), uint32_t max_timeouts = 3);
 
+	/// \brief Close the connection once it has had no open channels for \a timeout, zero means never
+	///
+	/// Takes effect the next time the connection is authenticated, or right
+	/// away when it is already. May be called from any thread.
+	void set_idle_timeout(std::chrono::seconds timeout);
+
+	/// \brief Fail opening the connection when it is not authenticated within \a timeout, zero means no limit
+	void set_handshake_timeout(std::chrono::seconds timeout) { m_handshake_timeout = timeout; }
+
   protected:
 	/// \brief Return true if the next layer is open.
 	virtual bool next_layer_is_open() const = 0;
 
+	/// \brief The number of bytes that can be read from the next layer right away, if known
+	virtual std::size_t next_layer_available() { return 0; }
+
+	/// \brief Read some data from the next layer into \a buffer, completing \a op when done
+	virtual void read_next_layer(boost::asio::mutable_buffer buffer, std::unique_ptr<detail::io_connection_op> op) = 0;
+
+	/// \brief Write all data in \a buffers to the next layer, completing \a op when done
+	virtual void write_next_layer(std::vector<boost::asio::const_buffer> &&buffers, std::unique_ptr<detail::io_connection_op> op) = 0;
+
+	/// \brief Wait until the next layer can be read from or written to, completing \a op when done
+	virtual void wait_next_layer(std::unique_ptr<detail::wait_connection_op> op) = 0;
+
+	/// \brief Have the next layer pass its data to received_direct, returns false if it cannot
+	///
+	/// Called once the connection is authenticated, before the read loop
+	/// starts. When this returns true, the read loop no longer calls
+	/// read_next_layer.
+	virtual bool start_direct_read() { return false; }
+
+	/// \brief Append \a size bytes at \a data to the received data and process them
+	///
+	/// For next layers that deliver data by themselves, see start_direct_read.
+	/// An error in \a ec closes the connection.
+	void received_direct(const boost::system::error_code &ec, const char *data, std::size_t size);
+
 	/// \brief Asynchronously open the next layer.
 	///
 	/// \param handler The completion handler, should be of form
@@ -316,26 +394,70 @@ class basic_connection : public std::enable_shared_from_this<basic_connection>
 		enum
 		{
 			start,
+			encrypting,
 			writing
 		};
 
-		auto buffer = m_crypto_engine.get_next_request(std::move(p));
+		// taken before the packet is moved, the order in which the captures
+		// below are initialized is unspecified
+		const std::size_t size = p.size();
+		const bool control = not p.empty() and p.data()[0] != msg_channel_data and p.data()[0] != msg_channel_extended_data;
+
+		m_write_backlog += size;
 
 		return boost::asio::async_compose<Handler, void(boost::system::error_code, std::size_t)>(
 			[
-				buffer = std::move(buffer),
+				size,
+				control,
+				queued = std::chrono::steady_clock::now(),
+				packet = std::move(p),
+				data = std::shared_ptr<blob>(),
 				conn = this->shared_from_this(),
 				state = start
 			]
 			(auto &self, const boost::system::error_code &ec = {}, std::size_t bytes_transferred = 0) mutable
 			{
 				if (not ec and state == start)
+				{
+					auto &encoder = conn->m_crypto_engine.encoder();
+
+					if (not encoder.pipelined())
+					{
+						state = writing;
+						std::shared_ptr<boost::asio::streambuf> request = encoder.get_next_request(std::move(packet));
+						conn->queue_write({ request, request->data(), make_write_handler(std::move(self)), control, queued });
+						return;
+					}
+
+					// the packet is encrypted asynchronously, continue writing
+					// from our own executor once the pipeline is done with it
+					state = encrypting;
+					data = std::make_shared<blob>();
+
+					auto op = std::make_shared<std::decay_t<decltype(self)>>(std::move(self));
+					encoder.async_get_next_request(std::move(packet),
+						[op, data, conn](blob &&result)
+						{
+							*data = std::move(result);
+							boost::asio::post(conn->get_executor(), [op]() { (*op)(); });
+						});
+					return;
+				}
+
+				if (not ec and state == encrypting)
 				{
 					state = writing;
-					boost::asio::async_write(*conn, *buffer, std::move(self));
+					conn->queue_write({ data, boost::asio::buffer(*data), make_write_handler(std::move(self)), control, queued });
 					return;
 				}
 
+				// the packet is on its way, prepare keystream for the next one
+				if (not ec)
+					conn->m_crypto_engine.encoder().prefetch();
+
+				conn->m_write_backlog -= size;
+				conn->release_scheduled();
+
 				self.complete(ec, bytes_transferred);
 			},
 			handler, *this);
@@ -389,6 +511,146 @@ class basic_connection : public std::enable_shared_from_this<basic_connection>
 	/// and will provide a full SOCKS5 server implementation.
 	void forward_socks5(uint16_t local_port);
 
+	/// \brief Use \a pipeline for signing and encrypting outgoing packets and
+	/// decrypting and verifying incomming packets.
+	///
+	/// This only has effect for ciphers in CTR mode and without compression.
+	/// The pipeline may be shared by several connections. Pass an empty
+	/// pointer to stop using a pipeline.
+	void set_crypto_pipeline(std::shared_ptr<crypto_pipeline> pipeline);
+
+	/// \brief Generate up to \a size bytes of CTR keystream ahead of the data
+	///
+	/// The keystream is generated when the connection is idle, taking the
+	/// AES work off the path of interactive traffic. Should be called
+	/// before opening the connection.
+	void set_keystream_cache(std::size_t size)
+	{
+		m_crypto_engine.set_keystream_cache(size);
+	}
+
+	/// \brief Accept incomming packets of up to \a size bytes, at most kMaxPacketSizeLimit
+	///
+	/// Channels created afterwards advertise this as their maximum packet
+	/// size, see channel::set_max_packet_size. Packets of kMaxPacketSize
+	/// bytes are always accepted.
+	void set_max_packet_size(uint32_t size);
+
+	/// \brief The maximum packet size for new channels
+	uint32_t get_max_packet_size() const { return m_max_packet_size; }
+
+	/// \brief Let the receive windows of new channels grow up to \a size bytes
+	///
+	/// On links with a large bandwidth delay product the default window of
+	/// kWindowSize bytes limits the throughput of a channel. The windows
+	/// grow automatically when needed, up to this size. See also
+	/// channel::set_max_window_size.
+	void set_max_window_size(uint32_t size) { m_max_window_size = size; }
+
+	/// \brief The limit for the receive window size of new channels
+	uint32_t get_max_window_size() const { return m_max_window_size; }
+
+	/// \brief Set when the channels of this connection send window adjusts
+	///
+	/// The window adjusts for all channels that are due while processing
+	/// the received data are written to the socket together.
+	void set_window_adjust_policy(const window_adjust_policy &policy) { m_window_adjust_policy = policy; }
+
+	/// \brief When the channels of this connection send window adjusts
+	const window_adjust_policy &get_window_adjust_policy() const { return m_window_adjust_policy; }
+
+	/// \brief Queue a channel data packet of \a size bytes for channel \a channel_id
+	///
+	/// The packet is taken from the queue by the outbound_scheduler when
+	/// it is its turn and \a release is then called to write it. If the
+	/// channel or connection closes before that, release is called with an
+	/// error instead.
+	void schedule_write(uint32_t channel_id, traffic_class cls, uint32_t weight, std::size_t size,
+		outbound_scheduler::release_type &&release)
+	{
+		m_scheduler.push(channel_id, cls, weight, size, std::move(release));
+		release_scheduled();
+	}
+
+	/// \brief Write the channel message \a out, in order with the data of channel \a channel_id
+	///
+	/// Channel requests and the closing of a channel must not overtake data
+	/// that was accepted for that channel earlier. The message is written
+	/// right away when no data is waiting in the outbound_scheduler, it is
+	/// queued behind that data otherwise.
+	void write_channel_message(uint32_t channel_id, opacket &&out);
+
+	/// \brief Take scheduled channel data only while less than \a size bytes wait to be written
+	///
+	/// Smaller values give control messages and interactive channels lower
+	/// latency, larger values may be needed to keep a fast link busy.
+	void set_write_backlog(std::size_t size) { m_max_write_backlog = size; }
+
+	/// \brief The statistics for the outgoing traffic in class \a cls
+	const traffic_stats &get_traffic_stats(traffic_class cls) const { return m_scheduler.get_stats(cls); }
+
+	/// \brief Process at most \a packets packets or \a bytes bytes of received data in one go
+	///
+	/// When the budget is used up, processing continues after other work
+	/// queued in the io_context had its turn. That way a busy connection
+	/// cannot starve the other connections that share its thread. Zero means
+	/// no limit.
+	void set_read_budget(std::size_t packets, std::size_t bytes)
+	{
+		m_read_budget_packets = packets;
+		m_read_budget_bytes = bytes;
+	}
+
+	/// \brief Read from the next layer in blocks of \a size bytes
+	///
+	/// If \a use_available is true and the next layer is a socket, a larger
+	/// block is read when the socket reports more data is available.
+	void set_read_size(std::size_t size, bool use_available = false)
+	{
+		m_read_size = std::max<std::size_t>(size, 1);
+		m_read_size_from_socket = use_available;
+	}
+
+	/// \brief Limit the channel data sent on this connection to \a bytes_per_second
+	///
+	/// Zero means no limit, \a burst is the size of the token bucket. See
+	/// rate_limiter. Limits can also be set per channel and for a group of
+	/// connections, all limits that apply are enforced.
+	void set_send_rate_limit(double bytes_per_second, std::size_t burst = 0);
+
+	/// \brief Limit the channel data received on this connection to \a bytes_per_second
+	///
+	/// This is done by holding back window adjusts.
+	void set_receive_rate_limit(double bytes_per_second, std::size_t burst = 0);
+
+	/// \brief Also apply the limits in \a group, which may be shared by several connections
+	void set_rate_limit_group(std::shared_ptr<rate_limit_group> group);
+
+	/// \brief Wake up the channels waiting for a rate limit, to be called after the limits changed
+	void rate_limits_changed();
+
+	/// \brief How long to wait before channel data may be sent (c2s) or window may be granted (s2c)
+	rate_limiter::duration get_rate_limit_delay(direction dir, rate_limiter::time_point now);
+
+	/// \brief Account for \a bytes of channel data sent (c2s) or received (s2c)
+	void consume_rate_limit(direction dir, std::size_t bytes, rate_limiter::time_point now);
+
+	/// \brief Use \a profile for the algorithms proposed in key exchanges
+	///
+	/// Without a profile of its own the connection uses
+	/// crypto_profile::default_profile(). Should be called before opening
+	/// the connection, a new profile is used at the next rekey otherwise.
+	void set_crypto_profile(const crypto_profile &profile)
+	{
+		m_crypto_profile = profile;
+	}
+
+	/// \brief Return the profile used for key exchanges
+	const crypto_profile &get_crypto_profile() const
+	{
+		return m_crypto_profile ? *m_crypto_profile : crypto_profile::default_profile();
+	}
+
 	/// \brief Return the connection parameters in a string for direction \a dir
 	std::string get_connection_parameters(direction dir) const
 	{
@@ -594,8 +856,8 @@ class basic_connection : public std::enable_shared_from_this<basic_connection>
 		m_provide_credentials_handler = handler;
 	}
 
-	/// \brief Open channel \a ch with channel ID \a id
-	void open_channel(channel_ptr ch, uint32_t id);
+	/// \brief Open channel \a ch, assigning it a channel ID if it has none
+	void open_channel(channel_ptr ch);
 
 	/// \brief Close channel \a ch with channel ID \a id
 	void close_channel(channel_ptr ch, uint32_t id);
@@ -603,6 +865,15 @@ class basic_connection : public std::enable_shared_from_this<basic_connection>
 	/// \brief Are there any channels still open?
 	bool has_open_channels();
 
+	/// \brief Thread safe variant of is_open
+	///
+	/// Returns the state as it was after the connection last opened, closed
+	/// or changed the state of a channel. Can be called from any thread.
+	bool is_open_snapshot() const { return m_open_snapshot; }
+
+	/// \brief Thread safe variant of has_open_channels, see is_open_snapshot
+	bool has_open_channels_snapshot() const { return m_channels_open_snapshot; }
+
   protected:
 	/// \brief Open the next layer with \a op as completion operation
 	virtual void open_next_layer(std::unique_ptr<detail::wait_connection_op> op) = 0;
@@ -637,6 +908,34 @@ class basic_connection : public std::enable_shared_from_this<basic_connection>
 	/// \brief A banner might arrive during the handshake phase, communicate it over the opening channels
 	void handle_banner(const std::string &message, const std::string &lang);
 
+	/// \brief An encrypted packet waiting to be written to the socket
+	struct pending_write
+	{
+		std::shared_ptr<void> m_data; ///< Owner of the buffer
+		boost::asio::const_buffer m_buffer;
+		std::function<void(const boost::system::error_code &, std::size_t)> m_handler;
+		bool m_control;                                ///< Not channel data
+		std::chrono::steady_clock::time_point m_queued; ///< When async_write was called
+	};
+
+	/// \brief Wrap the composed operation \a self in a copyable write handler
+	template <typename Self>
+	static std::function<void(const boost::system::error_code &, std::size_t)> make_write_handler(Self &&self)
+	{
+		auto op = std::make_shared<std::decay_t<Self>>(std::move(self));
+		return [op](const boost::system::error_code &ec, std::size_t bytes_transferred)
+		{ (*op)(ec, bytes_transferred); };
+	}
+
+	/// \brief Write \a w after the packets already queued, only one write is outstanding at a time
+	void queue_write(pending_write &&w);
+
+	/// \brief Start writing the packets in the queue, if any, in a single write
+	void write_next();
+
+	/// \brief Take packets from the scheduler as long as the backlog allows it
+	void release_scheduled();
+
 	// --------------------------------------------------------------------
 
 	std::string m_user;           ///< The username
@@ -664,12 +963,33 @@ class basic_connection : public std::enable_shared_from_this<basic_connection>
 	using time_point_type = std::chrono::time_point<std::chrono::steady_clock>;
 
 	time_point_type m_last_io;                                          ///< The last time we had an I/O
-	std::chrono::seconds m_keep_alive_interval;                         ///< How often should we send keep alive packets (in seconds)?
-	boost::asio::steady_timer m_keep_alive_timer;                       ///< The timer used for keep alive
-	void keep_alive_time_out(const boost::system::error_code &ec = {}); ///< Callback for the keep alive timer
+	std::chrono::seconds m_keep_alive_interval{};                       ///< How often should we send keep alive packets (in seconds)?
+	timer_wheel::timer m_keep_alive_timer;                              ///< The timer used for keep alive
+	void keep_alive_time_out();                                         ///< Callback for the keep alive timer
 	uint32_t m_keep_alive_timeouts = 0;									///< The current number of timeouts
 	uint32_t m_max_keep_alive_timeouts = 3;								///< The maximum number of timeouts before we disconnect
 
+	std::chrono::seconds m_idle_timeout{};      ///< see set_idle_timeout
+	time_point_type m_idle_since;               ///< when the last channel was closed
+	timer_wheel::timer m_idle_timer;            ///< checks the idle timeout
+	void idle_time_out();                       ///< Callback for the idle timer
+	std::chrono::seconds m_handshake_timeout{}; ///< see set_handshake_timeout
+	timer_wheel::timer m_handshake_timer;       ///< fails a handshake that takes too long
+	void handshake_time_out();                  ///< Callback for the handshake timer
+
+	/// \brief A handler for the timers above that calls \a callback, unless the connection is gone by then
+	///
+	/// The connection may be destroyed on another thread while the handler
+	/// is about to be called, it therefore holds only a weak pointer.
+	timer_wheel::handler_type timer_handler(void (basic_connection::*callback)())
+	{
+		return [self = weak_from_this(), callback]()
+		{
+			if (auto conn = self.lock())
+				(conn.get()->*callback)();
+		};
+	}
+
 	blob m_private_key_hash;           ///< The private key used to authenticate
 	boost::asio::streambuf m_response; ///< Buffer for incomming response data
 
@@ -680,12 +1000,40 @@ class basic_connection : public std::enable_shared_from_this<basic_connection>
 	/// \brief The executor for the handlers above
 	callback_executor_type m_callback_executor;
 
-	std::list<channel_ptr> m_channels;                       ///< The currently registered channels
+	channel_table m_channels;                                ///< The currently registered channels
 	std::shared_ptr<port_forward_listener> m_port_forwarder; ///< The port forwarder
 
 	std::deque<detail::wait_connection_op *> m_waiting_ops; ///< what is waiting
 	std::unique_ptr<key_exchange> m_kex;                    ///< for rekeying
 
+	std::shared_ptr<crypto_pipeline> m_crypto_pipeline; ///< optional crypto offloading
+	std::optional<crypto_profile> m_crypto_profile;     ///< algorithms for this connection only
+	uint32_t m_max_packet_size = kMaxPacketSize;        ///< for incomming packets
+	uint32_t m_max_window_size = kDefaultMaxWindowSize; ///< for new channels
+	window_adjust_policy m_window_adjust_policy;        ///< for all channels
+	rate_limiter m_send_limit, m_receive_limit;         ///< for all channels
+	std::shared_ptr<rate_limit_group> m_rate_limit_group;
+
+	outbound_scheduler m_scheduler;             ///< for outgoing channel data
+	std::deque<pending_write> m_write_queue;    ///< encrypted packets, in order
+	bool m_writing = false;                     ///< true while writing the first packets in m_write_queue
+	bool m_corked = false;                      ///< true while processing received packets, writes are held
+	std::size_t m_write_backlog = 0;            ///< bytes passed to async_write but not written yet
+	std::size_t m_max_write_backlog = 0x20000;  ///< see set_write_backlog
+
+	std::size_t m_read_budget_packets = 64;      ///< see set_read_budget
+	std::size_t m_read_budget_bytes = 0x100000;  ///< see set_read_budget
+	std::size_t m_read_size = 0x10000;           ///< see set_read_size
+	bool m_read_size_from_socket = false;        ///< see set_read_size
+	bool m_direct_read = false;                  ///< see start_direct_read
+	bool m_read_scheduled = false;               ///< set while a call to read_loop is posted
+
+	/// \brief Store the current is_open and has_open_channels for the snapshot accessors
+	void update_state_snapshot();
+
+	std::atomic<bool> m_open_snapshot{ false };          ///< see is_open_snapshot
+	std::atomic<bool> m_channels_open_snapshot{ false }; ///< see has_open_channels_snapshot
+
 	// --------------------------------------------------------------------
 
 	/// \brief Helper class for opening the next layer
@@ -732,6 +1080,18 @@ class basic_connection : public std::enable_shared_from_this<basic_connection>
 	/// \brief The 'main loop' for reading incoming data
 	void read_loop(boost::system::error_code ec = {}, std::size_t bytes_transferred = 0);
 
+	/// \brief Post a call to read_loop, if there is none pending
+	void schedule_read_loop();
+
+	/// \brief Process the packets that are available in m_response
+	///
+	/// Returns false if the read budget was used up before all packets
+	/// were processed.
+	bool process_received();
+
+	/// \brief Process packets decrypted by the crypto pipeline
+	void process_pipelined();
+
 	/// \brief The actual opening code
 	void do_open(std::unique_ptr<detail::open_connection_op> op);
 
@@ -745,32 +1105,34 @@ class basic_connection : public std::enable_shared_from_this<basic_connection>
 
 // --------------------------------------------------------------------
 
-/// \brief An implementation of a basic connection using a tcp::socket as next layer
+/// \brief An implementation of basic_connection over a stream
 ///
-/// This class implements a regular SSH connection over a TCP socket.
-
-class connection : public basic_connection
+/// The stream should meet the requirements for AsyncReadStream and
+/// AsyncWriteStream. All reading and writing goes straight to the stream.
+/// Streams that are connected already, like one end of a socketpair, a
+/// Unix domain socket or a descriptor, can be passed to the constructor.
+/// That allows running a connection without TCP, e.g. in tests.
+
+template <typename Stream>
+class basic_stream_connection : public basic_connection
 {
   public:
 	/// \brief Constructor
 	///
-	/// Creates a connection, but does not open it. You need to call async_open for that.
-	///
-	/// \param io_context	The io_context to use for the socket
+	/// \param io_context	The io_context used by \a stream
+	/// \param stream		The stream to use, usually connected already
 	/// \param user			The username to use when authenticating
-	/// \param host			The hostname or ip address of the server to connect to
-	/// \param port			The port number to connect to
-
-	connection(boost::asio::io_context &io_context, const std::string &user, const std::string &host,
-		uint16_t port = 22)
+	/// \param host			The name of the server, used to check its host key
+	/// \param port			The port number on the server
+	basic_stream_connection(boost::asio::io_context &io_context, Stream &&stream,
+		const std::string &user, const std::string &host, uint16_t port = 22)
 		: basic_connection(io_context, user, host, port)
-		, m_io_context(io_context)
-		, m_next_layer(m_io_context)
+		, m_next_layer(std::move(stream))
 	{
 	}
 
 	/// \brief The type of the next layer.
-	using next_layer_type = boost::asio::ip::tcp::socket;
+	using next_layer_type = Stream;
 
 	/// \brief Access to the next layer
 	const next_layer_type &next_layer() const { return m_next_layer; }
@@ -778,40 +1140,213 @@ class connection : public basic_connection
 	/// \brief Access to the next layer
 	next_layer_type &next_layer() { return m_next_layer; }
 
-	/// \brief Access to the lowest layer, should always be a tcp::socket
+	/// \brief Access to the lowest layer, throws if the stream is not a tcp::socket
 	const lowest_layer_type &lowest_layer() const override
 	{
-		return m_next_layer.lowest_layer();
+		return const_cast<basic_stream_connection *>(this)->lowest_layer();
 	}
 
-	/// \brief Access to the lowest layer, should always be a tcp::socket
+	/// \brief Access to the lowest layer, throws if the stream is not a tcp::socket
 	lowest_layer_type &lowest_layer() override
 	{
-		return m_next_layer.lowest_layer();
+		if constexpr (requires(Stream &s) { { s.lowest_layer() } -> std::same_as<lowest_layer_type &>; })
+			return m_next_layer.lowest_layer();
+		else
+			throw std::logic_error("The next layer of this connection is not a TCP socket");
 	}
 
-	/// \brief Close the connection and the socket
+	/// \brief Close the connection and the stream
 	virtual void close() override
 	{
 		basic_connection::close();
 
-		m_next_layer.close();
+		if constexpr (requires(Stream &s, boost::system::error_code &ec) { s.close(ec); })
+		{
+			boost::system::error_code ec;
+			m_next_layer.close(ec);
+		}
 	}
 
-	/// \brief Is the socket open?
+	/// \brief Is the stream open?
 	virtual bool next_layer_is_open() const override
 	{
-		return m_next_layer.is_open();
+		if constexpr (requires(const Stream &s) { { s.is_open() } -> std::convertible_to<bool>; })
+			return m_next_layer.is_open();
+		else
+			return true;
+	}
+
+  protected:
+	/// \brief The number of bytes that can be read from the stream right away, if it can tell
+	virtual std::size_t next_layer_available() override
+	{
+		if constexpr (requires(Stream &s, boost::system::error_code &ec) { s.available(ec); })
+		{
+			boost::system::error_code ec;
+			std::size_t result = m_next_layer.available(ec);
+			return ec ? 0 : result;
+		}
+		else
+			return 0;
+	}
+
+	/// \brief The stream should be connected already, fails if it is not open
+	virtual void open_next_layer(std::unique_ptr<detail::wait_connection_op> op) override
+	{
+		if (next_layer_is_open())
+			op->complete({});
+		else
+			op->complete(boost::asio::error::not_connected);
+	}
+
+	virtual void read_next_layer(boost::asio::mutable_buffer buffer, std::unique_ptr<detail::io_connection_op> op) override
+	{
+		m_next_layer.async_read_some(buffer,
+			[op = std::move(op)](const boost::system::error_code &ec, std::size_t bytes_transferred)
+			{ op->complete(ec, bytes_transferred); });
+	}
+
+	virtual void write_next_layer(std::vector<boost::asio::const_buffer> &&buffers, std::unique_ptr<detail::io_connection_op> op) override
+	{
+		boost::asio::async_write(m_next_layer, std::move(buffers),
+			[op = std::move(op)](const boost::system::error_code &ec, std::size_t bytes_transferred)
+			{ op->complete(ec, bytes_transferred); });
+	}
+
+	/// \brief Waits on sockets, other streams are always ready
+	virtual void wait_next_layer(std::unique_ptr<detail::wait_connection_op> op) override
+	{
+		if constexpr (requires(Stream &s) { s.async_wait(boost::asio::socket_base::wait_read, [](boost::system::error_code) {}); })
+		{
+			m_next_layer.async_wait(op->m_type == wait_type::read ? boost::asio::socket_base::wait_read : boost::asio::socket_base::wait_write,
+				[op = std::move(op)](const boost::system::error_code &ec)
+				{ op->complete(ec); });
+		}
+		else
+			boost::asio::post(get_executor(), [op = std::move(op)]()
+				{ op->complete(); });
 	}
 
+	Stream m_next_layer;
+};
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+/// \brief A connection over a Unix domain socket, e.g. one end of a socketpair
+using local_connection = basic_stream_connection<boost::asio::local::stream_protocol::socket>;
+#endif
+
+// --------------------------------------------------------------------
+
+/// \brief Options for the TCP socket of a connection
+///
+/// TCP_QUICKACK and TCP Fast Open are only available on Linux and are
+/// ignored elsewhere. Errors setting options are ignored as well.
+///
+/// The kernel leaves quick ack mode again by itself, TCP_QUICKACK is
+/// therefore set again after every read from the socket.
+struct socket_options
+{
+	bool m_no_delay = true;        ///< TCP_NODELAY, do not hold back small packets
+	int m_receive_buffer_size = 0; ///< SO_RCVBUF in bytes, zero keeps the system default
+	int m_send_buffer_size = 0;    ///< SO_SNDBUF in bytes, zero keeps the system default
+	bool m_quick_ack = false;      ///< TCP_QUICKACK, acknowledge received data right away
+	bool m_fast_open = false;      ///< TCP_FASTOPEN_CONNECT, send data in the SYN of a new connection
+};
+
+/// \brief A boolean option at the TCP level, for use with set_option
+///
+/// Asio only defines TCP_NODELAY, this is for the others, like TCP_QUICKACK.
+template <int Name>
+class tcp_boolean_option
+{
+  public:
+	explicit tcp_boolean_option(bool value)
+		: m_value(value ? 1 : 0)
+	{
+	}
+
+	template <typename Protocol>
+	int level(const Protocol &) const { return IPPROTO_TCP; }
+
+	template <typename Protocol>
+	int name(const Protocol &) const { return Name; }
+
+	template <typename Protocol>
+	const int *data(const Protocol &) const { return &m_value; }
+
+	template <typename Protocol>
+	std::size_t size(const Protocol &) const { return sizeof(m_value); }
+
   private:
-	/// \brief Asynchronously open the socket, notifying \a op when done
+	int m_value;
+};
+
+/// \brief An implementation of a basic connection using a tcp::socket as next layer
+///
+/// This class implements a regular SSH connection over a TCP socket.
+
+class connection : public basic_stream_connection<boost::asio::ip::tcp::socket>
+{
+  public:
+	/// \brief Constructor
+	///
+	/// Creates a connection, but does not open it. You need to call async_open for that.
+	///
+	/// \param io_context	The io_context to use for the socket
+	/// \param user			The username to use when authenticating
+	/// \param host			The hostname or ip address of the server to connect to
+	/// \param port			The port number to connect to
+
+	connection(boost::asio::io_context &io_context, const std::string &user, const std::string &host,
+		uint16_t port = 22)
+		: basic_stream_connection(io_context, boost::asio::ip::tcp::socket(io_context), user, host, port)
+	{
+	}
+
+	/// \brief Set the options for the socket
+	///
+	/// The options are used when the socket is opened, or right away if it
+	/// is open already. m_fast_open only has effect when opening.
+	void set_socket_options(const socket_options &options);
+
+	/// \brief The options for the socket
+	const socket_options &get_socket_options() const { return m_socket_options; }
+
+	/// \brief Set the timing for connecting, used the next time the connection is opened
+	void set_connect_options(const connect_options &options) { m_connect_options = options; }
+
+	/// \brief The timing for connecting
+	const connect_options &get_connect_options() const { return m_connect_options; }
+
+	/// \brief Look up the host in \a cache, which may be shared with other connections
+	void set_resolver_cache(std::shared_ptr<resolver_cache> cache) { m_resolver_cache = std::move(cache); }
+
+	/// \brief The resolver cache used, if any
+	std::shared_ptr<resolver_cache> get_resolver_cache() const { return m_resolver_cache; }
+
+	/// \brief Close the connection, this also cancels connecting
+	virtual void close() override;
+
+  protected:
+	/// \brief Read from the socket, setting TCP_QUICKACK again afterwards if requested
+	virtual void read_next_layer(boost::asio::mutable_buffer buffer, std::unique_ptr<detail::io_connection_op> op) override;
+
+  private:
+	/// \brief Asynchronously resolve the host and connect the socket, notifying \a op when done
 	void open_next_layer(std::unique_ptr<detail::wait_connection_op> op) override;
 
+	/// \brief Apply the socket options to \a socket that should be set before connecting, or those set after
+	void apply_socket_options(boost::asio::ip::tcp::socket &socket, bool connected) const;
+
+	/// \brief Set TCP_QUICKACK on the socket, when requested and available
+	void apply_quick_ack();
+
 	friend async_open_next_layer_impl;
 
-	boost::asio::io_context &m_io_context;     ///< The IO Context we use
-	boost::asio::ip::tcp::socket m_next_layer; ///< The TCP socket
+	socket_options m_socket_options;
+	connect_options m_connect_options;
+	std::shared_ptr<resolver_cache> m_resolver_cache;
+	std::shared_ptr<tcp_connector> m_connector; ///< set while connecting
 };
 
 // --------------------------------------------------------------------
@@ -876,8 +1411,15 @@ class proxied_connection : public basic_connection
 	/// \brief Is the proxy channel open?
 	virtual bool next_layer_is_open() const override;
 
+  protected:
+	virtual void read_next_layer(boost::asio::mutable_buffer buffer, std::unique_ptr<detail::io_connection_op> op) override;
+	virtual void write_next_layer(std::vector<boost::asio::const_buffer> &&buffers, std::unique_ptr<detail::io_connection_op> op) override;
+	virtual void wait_next_layer(std::unique_ptr<detail::wait_connection_op> op) override;
+
+	/// \brief Have the proxy channel append its data to the receive buffer directly
+	virtual bool start_direct_read() override;
+
   private:
-	friend async_wait_impl;
 	friend async_open_next_layer_impl;
 
 	/// \brief The actual wait implementation.
@@ -913,21 +1455,20 @@ void basic_connection::async_read_impl::operator()(
 	Handler &&handler, basic_connection *conn,
 	const MutableBufferSequence &buffers)
 {
-	// I don't like this approach very much, but I see no other alternative.
-
-	auto c = dynamic_cast<connection *>(conn);
-	if (c)
-		boost::asio::async_read(c->next_layer(), buffers,
-			boost::asio::transfer_at_least(1),
-			std::move(handler));
-	else
+	// like async_read_some on a socket, read into the first buffer that is not empty
+	boost::asio::mutable_buffer buffer;
+	for (auto b = boost::asio::buffer_sequence_begin(buffers); b != boost::asio::buffer_sequence_end(buffers); ++b)
 	{
-		auto pc = dynamic_cast<proxied_connection *>(conn);
-		if (pc)
-			boost::asio::async_read(pc->next_layer(), buffers,
-				boost::asio::transfer_at_least(1),
-				std::move(handler));
+		if (b->size() > 0)
+		{
+			buffer = *b;
+			break;
+		}
 	}
+
+	conn->read_next_layer(buffer,
+		std::unique_ptr<detail::io_connection_op>(
+			new detail::io_connection_handler(std::move(handler), conn->get_executor())));
 }
 
 template <typename Handler, typename ConstBufferSequence>
@@ -935,15 +1476,10 @@ void basic_connection::async_write_impl::operator()(
 	Handler &&handler, basic_connection *conn,
 	const ConstBufferSequence &buffers)
 {
-	auto c = dynamic_cast<connection *>(conn);
-	if (c)
-		boost::asio::async_write(c->next_layer(), buffers, std::move(handler));
-	else
-	{
-		auto pc = dynamic_cast<proxied_connection *>(conn);
-		if (pc)
-			boost::asio::async_write(pc->next_layer(), buffers, std::move(handler));
-	}
+	conn->write_next_layer(
+		std::vector<boost::asio::const_buffer>(boost::asio::buffer_sequence_begin(buffers), boost::asio::buffer_sequence_end(buffers)),
+		std::unique_ptr<detail::io_connection_op>(
+			new detail::io_connection_handler(std::move(handler), conn->get_executor())));
 }
 
 template <typename Handler>
@@ -951,11 +1487,6 @@ void basic_connection::async_wait_impl::operator()(
 	Handler &&handler, basic_connection *conn,
 	basic_connection::wait_type type)
 {
-	auto c = dynamic_cast<connection *>(conn);
-	auto pc = dynamic_cast<proxied_connection *>(conn);
-
-	assert(!c != !pc);
-
 	switch (type)
 	{
 		case wait_type::open:
@@ -964,23 +1495,9 @@ void basic_connection::async_wait_impl::operator()(
 			break;
 
 		case wait_type::read:
-			if (c)
-				c->next_layer().async_wait(boost::asio::socket_base::wait_read,
-					std::move(handler));
-			else
-				pc->do_wait(std::unique_ptr<detail::wait_connection_op>(
-					new detail::wait_connection_handler(std::move(handler),
-						pc->get_executor(), type)));
-			break;
-
 		case wait_type::write:
-			if (c)
-				c->next_layer().async_wait(boost::asio::socket_base::wait_write,
-					std::move(handler));
-			else
-				pc->do_wait(std::unique_ptr<detail::wait_connection_op>(
-					new detail::wait_connection_handler(std::move(handler),
-						pc->get_executor(), type)));
+			conn->wait_next_layer(std::unique_ptr<detail::wait_connection_op>(
+				new detail::wait_connection_handler(std::move(handler), conn->get_executor(), type)));
 			break;
 	}
 }
@@ -12,10 +12,17 @@
 /// limited. Each connection is stored and can be reused.
 ///
 /// Connections are uniquely defined by their user/host/port combination.
+///
+/// A connection_pool can also be built on top of an engine, in that case
+/// new connections are spread over the shards of the engine and the pool
+/// may be used from any thread.
 
 #include <pinch/pinch.hpp>
 
+#include <mutex>
+
 #include <pinch/channel.hpp>
+#include <pinch/engine.hpp>
 
 namespace pinch
 {
@@ -34,6 +41,15 @@ class connection_pool
 	/// \param io_context	The boost io_context to use
 	connection_pool(boost::asio::io_context &io_context);
 
+	/// \brief constructor for a shard-aware pool
+	///
+	/// New connections are created in the least loaded shard of \a engine.
+	/// A connection is bound to its shard, all calls to it should be made
+	/// using the connection's executor.
+	///
+	/// \param engine	The engine to use
+	connection_pool(engine &engine);
+
 	/// \brief destructor
 	~connection_pool();
 
@@ -78,6 +94,23 @@ class connection_pool
 	/// \brief Are there any channels still open?
 	bool has_open_channels();
 
+	/// \brief Limit the channel data sent by all connections in this pool together
+	///
+	/// Zero means no limit, \a burst is the size of the token bucket, see
+	/// rate_limiter. May be changed at any time.
+	void set_send_rate_limit(double bytes_per_second, std::size_t burst = 0);
+
+	/// \brief Limit the channel data received by all connections in this pool together
+	void set_receive_rate_limit(double bytes_per_second, std::size_t burst = 0);
+
+	/// \brief Use \a cache for the host lookups of new connections, an empty pointer turns caching off
+	///
+	/// The pool creates a cache of its own by default.
+	void set_resolver_cache(std::shared_ptr<resolver_cache> cache);
+
+	/// \brief The resolver cache used for new connections
+	std::shared_ptr<resolver_cache> get_resolver_cache();
+
   private:
 	connection_pool(const connection_pool &);
 	connection_pool &operator=(const connection_pool &);
@@ -110,9 +143,22 @@ class connection_pool
 
 	using proxy_list = std::list<proxy>;
 
-	boost::asio::io_context &m_io_context;
+	/// \brief The actual implementation of get, m_mutex should be locked
+	std::shared_ptr<basic_connection> get_connection(const std::string &user, const std::string &host, uint16_t port);
+
+	/// \brief Add \a connection to the pool, m_mutex should be locked
+	void add_entry(const std::string &user, const std::string &host, uint16_t port, std::shared_ptr<basic_connection> connection);
+
+	/// \brief Let all connections know the group limits changed, m_mutex should be locked
+	void rate_limits_changed();
+
+	boost::asio::io_context *m_io_context = nullptr;
+	engine *m_engine = nullptr;
+	std::mutex m_mutex;
 	entry_list m_entries;
 	proxy_list m_proxies;
+	std::shared_ptr<rate_limit_group> m_rate_limit_group; ///< created when the first limit is set
+	std::shared_ptr<resolver_cache> m_resolver_cache;     ///< shared by the connections
 };
 
 } // namespace pinch
@@ -0,0 +1,127 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/// \file
+/// Definition of the tcp_connector class
+///
+/// A host name often resolves to several addresses, IPv6 and IPv4. Trying
+/// these one after the other means a dead address costs a full TCP connect
+/// timeout before the next one is tried.
+///
+/// The tcp_connector implements Happy Eyeballs, as described in RFC 8305.
+/// The addresses are sorted so the address families alternate, starting
+/// with the family of the first address returned by the resolver. A new
+/// attempt is started each time the connection attempt delay passes without
+/// a connection, or right away when an attempt fails. The first attempt to
+/// succeed wins, the others are cancelled.
+
+#include <pinch/pinch.hpp>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <pinch/resolver_cache.hpp>
+
+namespace pinch
+{
+
+// --------------------------------------------------------------------
+
+/// \brief The timing of a tcp_connector, a duration of zero means no limit
+
+struct connect_options
+{
+	std::chrono::milliseconds m_attempt_delay{ 250 }; ///< Time before the next address is tried, the Connection Attempt Delay of RFC 8305
+	std::chrono::milliseconds m_attempt_timeout{ 0 }; ///< Time a single attempt may take
+	std::chrono::milliseconds m_timeout{ 0 };         ///< Time resolving and connecting may take together
+};
+
+// --------------------------------------------------------------------
+
+/// \brief Resolves a host and connects a socket to the first address that answers
+///
+/// A tcp_connector can be used only once. It keeps itself alive until the
+/// handler is called, the handler is always called through the executor.
+/// Host names are looked up in \a cache when one is specified.
+
+class tcp_connector : public std::enable_shared_from_this<tcp_connector>
+{
+  public:
+	using executor_type = boost::asio::any_io_executor;
+	using socket_type = boost::asio::ip::tcp::socket;
+	using endpoint_type = boost::asio::ip::tcp::endpoint;
+
+	/// \brief Called with the connected socket, or with an error
+	using handler_type = std::function<void(const boost::system::error_code &ec, socket_type &&socket)>;
+
+	/// \brief Called for each socket after it is opened and before it connects, to set options
+	using prepare_type = std::function<void(socket_type &socket)>;
+
+	tcp_connector(const executor_type &executor, const connect_options &options = {},
+		std::shared_ptr<resolver_cache> cache = {});
+
+	tcp_connector(const tcp_connector &) = delete;
+	tcp_connector &operator=(const tcp_connector &) = delete;
+
+	/// \brief Resolve \a host asynchronously and connect to \a port on one of its addresses
+	void async_connect(const std::string &host, uint16_t port, prepare_type prepare, handler_type handler);
+
+	/// \brief Connect to one of \a endpoints
+	void async_connect(const std::vector<endpoint_type> &endpoints, prepare_type prepare, handler_type handler);
+
+	/// \brief Stop resolving and connecting, the handler is called with operation_aborted
+	void cancel();
+
+	/// \brief Sort \a endpoints so the address families alternate, keeping the order within a family
+	static std::vector<endpoint_type> interleave(const std::vector<endpoint_type> &endpoints);
+
+  private:
+	struct attempt
+	{
+		attempt(const executor_type &executor)
+			: m_socket(executor)
+			, m_timer(executor)
+		{
+		}
+
+		socket_type m_socket;
+		boost::asio::steady_timer m_timer; ///< for the attempt timeout
+		bool m_timed_out = false;
+	};
+
+	void start_timeout();
+	void resolved(const boost::system::error_code &ec, const std::vector<endpoint_type> &endpoints);
+	void connect(const std::vector<endpoint_type> &endpoints);
+	void start_next();
+	void attempt_done(std::size_t index, boost::system::error_code ec);
+	void finish(const boost::system::error_code &ec, socket_type &&socket);
+
+	executor_type m_executor;
+	connect_options m_options;
+	std::shared_ptr<resolver_cache> m_cache;
+	boost::asio::ip::tcp::resolver m_resolver;
+	boost::asio::steady_timer m_delay_timer;   ///< for the attempt delay
+	boost::asio::steady_timer m_timeout_timer; ///< for the total timeout
+
+	prepare_type m_prepare;
+	handler_type m_handler;
+
+	std::vector<endpoint_type> m_endpoints;
+	std::vector<std::unique_ptr<attempt>> m_attempts; ///< in the order of m_endpoints
+	std::size_t m_active = 0;                          ///< attempts still connecting
+	uint32_t m_generation = 0;                         ///< invalidates a pending attempt delay
+	boost::system::error_code m_last_error;
+	bool m_finished = false;
+};
+
+} // namespace pinch
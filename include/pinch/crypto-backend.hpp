@@ -0,0 +1,144 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/// \file
+/// Definition of the crypto_backend class
+///
+/// The symmetric algorithms, the ciphers and MACs that process every byte
+/// sent or received, are provided by a crypto_backend. There is one based
+/// on Crypto++ and, when configured with PINCH_WITH_OPENSSL, one based on
+/// OpenSSL's libcrypto. Which one is used by default is chosen with the
+/// CMake variable PINCH_CRYPTO_BACKEND.
+///
+/// Each backend has a table of algorithm descriptors, built at compile
+/// time. Applications can add algorithms of their own with
+/// crypto_backend::register_cipher and crypto_backend::register_mac, these
+/// are then available in all backends.
+///
+/// Key exchange and host key verification always use Crypto++.
+
+#include <pinch/pinch.hpp>
+
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pinch
+{
+
+// --------------------------------------------------------------------
+
+/// \brief A cipher as provided by a crypto_backend
+
+class stream_cipher
+{
+  public:
+	virtual ~stream_cipher() = default;
+
+	/// \brief Encrypt or decrypt \a len bytes from \a in into \a out, \a in may be equal to \a out
+	virtual void process(const uint8_t *in, std::size_t len, uint8_t *out) = 0;
+
+	/// \brief Position the key stream at byte \a offset, only for random access ciphers
+	virtual void seek(uint64_t offset);
+};
+
+/// \brief The description of a cipher
+struct cipher_descriptor
+{
+	std::string_view m_name; ///< The SSH name, should be a string literal
+	std::size_t m_key_size, m_iv_size;
+	std::size_t m_block_size; ///< The cipher's block size, also for CTR mode
+	bool m_random_access;     ///< True if the key stream can be positioned using seek (CTR mode)
+
+	/// Create an instance with key \a key and initialisation vector \a iv
+	std::unique_ptr<stream_cipher> (*m_create)(bool encrypt, const uint8_t *key, const uint8_t *iv);
+};
+
+// --------------------------------------------------------------------
+
+/// \brief A message authentication code as provided by a crypto_backend
+
+class message_authenticator
+{
+  public:
+	virtual ~message_authenticator() = default;
+
+	virtual void update(const uint8_t *data, std::size_t len) = 0;
+
+	/// \brief Write the digest for the data so far to \a digest and restart
+	virtual void final(uint8_t *digest) = 0;
+
+	/// \brief Compare the digest for the data so far with \a signature and restart
+	virtual bool verify(const uint8_t *signature) = 0;
+
+	virtual std::size_t digest_size() const = 0;
+};
+
+/// \brief The description of a message authentication code
+struct mac_descriptor
+{
+	std::string_view m_name; ///< The SSH name, should be a string literal
+	std::size_t m_key_size, m_digest_size;
+
+	/// Create an instance with key \a key
+	std::unique_ptr<message_authenticator> (*m_create)(const uint8_t *key);
+};
+
+// --------------------------------------------------------------------
+
+/// \brief A set of implementations of the symmetric algorithms
+
+class crypto_backend
+{
+  public:
+	virtual ~crypto_backend() = default;
+
+	/// \brief The name of this backend, e.g. "cryptopp" or "openssl"
+	virtual std::string name() const = 0;
+
+	/// \brief The ciphers implemented by this backend
+	virtual std::span<const cipher_descriptor> ciphers() const = 0;
+
+	/// \brief The MACs implemented by this backend
+	virtual std::span<const mac_descriptor> macs() const = 0;
+
+	/// \brief Return the cipher called \a name, or nullptr if it is not known
+	///
+	/// Registered algorithms take precedence over the backend's own.
+	const cipher_descriptor *find_cipher(std::string_view name) const;
+
+	/// \brief Return the MAC called \a name, or nullptr if it is not known
+	const mac_descriptor *find_mac(std::string_view name) const;
+
+	/// \brief Return the ciphers in the comma separated list \a names that are known, in the same order
+	std::string supported_ciphers(const std::string &names) const;
+
+	/// \brief Return the MACs in the comma separated list \a names that are known, in the same order
+	std::string supported_macs(const std::string &names) const;
+
+	/// \brief Add cipher \a cipher to all backends, replacing an existing one with the same name
+	///
+	/// Descriptors are never changed once registered, a replaced one stays
+	/// valid for the connections that already use it.
+	static void register_cipher(const cipher_descriptor &cipher);
+
+	/// \brief Add MAC \a mac to all backends, replacing an existing one with the same name, see register_cipher
+	static void register_mac(const mac_descriptor &mac);
+
+	/// \brief The backend configured as default
+	static const crypto_backend &instance();
+
+	/// \brief Return the backend called \a name, or nullptr if it was not built
+	static const crypto_backend *get(const std::string &name);
+
+	/// \brief The names of the backends that were built
+	static std::vector<std::string> available();
+};
+
+} // namespace pinch
@@ -7,15 +7,21 @@
 
 /// \file This file contains the definition of the crypto engine class
 
+#include <atomic>
+#include <functional>
+#include <limits>
+
 #include <boost/asio/streambuf.hpp>
 
+#include <pinch/crypto-backend.hpp>
+#include <pinch/crypto-pipeline.hpp>
 #include <pinch/key_exchange.hpp>
 #include <pinch/packet.hpp>
 
 namespace pinch
 {
 
-class crypto_engine;
+class crypto_encoder;
 
 // --------------------------------------------------------------------
 
@@ -33,17 +39,37 @@ class TransformData
 
 	void clear();
 
-	explicit operator bool() { return m_impl != nullptr; }
+	explicit operator bool() const { return m_impl != nullptr; }
 
-	void reset_encryptor(const std::string &name, const uint8_t *key, const uint8_t *iv);
-	void reset_decryptor(const std::string &name, const uint8_t *key, const uint8_t *iv);
+	void reset_encryptor(const std::string &name, const uint8_t *key, const uint8_t *iv,
+		const crypto_backend &backend = crypto_backend::instance());
+	void reset_decryptor(const std::string &name, const uint8_t *key, const uint8_t *iv,
+		const crypto_backend &backend = crypto_backend::instance());
 
 	void process(const uint8_t *in, std::size_t len, uint8_t *out);
 	std::size_t get_block_size() const;
 
-  private:
-	friend class crypto_engine;
+	/// \brief Return true if the key stream can be positioned using seek (CTR mode)
+	bool is_random_access() const;
+
+	/// \brief Position the key stream at byte \a offset
+	void seek(uint64_t offset);
+
+	/// \brief Generate up to \a size bytes of keystream ahead of the data (CTR mode only)
+	///
+	/// Processing data then is a simple XOR with the cached keystream. Use
+	/// prefetch to fill the cache when there is nothing else to do. A size
+	/// of zero turns the cache off again, keystream that was generated
+	/// already is used up before the cipher is used directly.
+	void set_keystream_cache(std::size_t size);
+
+	/// \brief Fill the keystream cache, generating at most \a max_bytes
+	void prefetch(std::size_t max_bytes = std::numeric_limits<std::size_t>::max());
 
+	/// \brief The number of bytes of keystream generated ahead of the data
+	std::size_t get_keystream_available() const;
+
+  private:
 	struct TransformDataImpl *m_impl = nullptr;
 };
 
@@ -63,28 +89,190 @@ class MessageAuthenticationCode
 
 	void clear();
 
-	explicit operator bool() { return m_impl != nullptr; }
+	explicit operator bool() const { return m_impl != nullptr; }
 
-	void reset(const std::string& name, const uint8_t *iv);
+	void reset(const std::string& name, const uint8_t *iv,
+		const crypto_backend &backend = crypto_backend::instance());
 
 	void update(const uint8_t *data, std::size_t len);
 	bool verify(const uint8_t *signature);
 
+	/// \brief Write the digest for the data so far to \a digest and restart
+	void final(uint8_t *digest);
+
 	std::size_t get_digest_size() const;
 
   private:
-	friend class crypto_engine;
-
 	struct MessageAuthenticationCodeImpl *m_impl = nullptr;
 };
 
+// --------------------------------------------------------------------
+
+/// \brief The algorithms and key material for a single direction
+///
+/// Filled in by the crypto_engine from a key exchange and handed over to
+/// the crypto_decoder or crypto_encoder owning that direction.
+struct crypto_keys
+{
+	std::string m_enc, m_ver, m_cmp;
+	blob m_key, m_iv, m_mac_key;
+	bool m_authenticated = false;
+};
+
+/// \brief Base class for the two halves of the crypto engine
+///
+/// Each direction has its own cipher, MAC, compression and sequence number
+/// and all of this is only touched by the thread doing the I/O in that
+/// direction. The only calls that may come from another thread are newkeys
+/// and enable_compression, these are handed over without locking and take
+/// effect at the next packet boundary.
+
+class crypto_direction
+{
+  public:
+	crypto_direction(const crypto_direction &) = delete;
+	crypto_direction &operator=(const crypto_direction &) = delete;
+
+	/// \brief Use \a keys starting with the next packet, may be called from any thread
+	void newkeys(std::unique_ptr<crypto_keys> keys);
+
+	/// \brief If compression is zlib@openssh.com, start using compression
+	/// from the next packet on, may be called from any thread
+	void enable_compression();
+
+	/// \brief Reset all, should only be called when no I/O is pending
+	void reset();
+
+	/// \brief Return true if a crypto pipeline is in use
+	bool pipelined() const { return m_lane != nullptr; }
+
+	/// \brief Generate up to \a size bytes of CTR keystream ahead of the data,
+	/// should be called before connecting or from the owning thread
+	void set_keystream_cache(std::size_t size);
+
+	/// \brief Fill the keystream cache, to be called by the owner when idle
+	void prefetch();
+
+  protected:
+	crypto_direction(bool outgoing);
+	~crypto_direction();
+
+	/// \brief Pick up new keys and pending compression, called by the owner at a packet boundary
+	void update();
+
+	/// \brief Return true if the current keys allow handing packets to the pipeline
+	bool can_offload() const;
+
+	bool m_outgoing;
+	std::size_t m_blocksize = 8;
+	uint32_t m_seq_nr = 0;
+	uint64_t m_offset = 0; ///< key stream offset for the current keys
+	std::size_t m_keystream_cache = 0;
+
+	std::shared_ptr<const crypto_keys> m_keys;
+
+	TransformData m_cipher;
+	MessageAuthenticationCode m_mac;
+
+	std::unique_ptr<compression_helper> m_compressor;
+	bool m_delay_compressor = false;
+
+	std::shared_ptr<crypto_pipeline> m_pipeline;
+	std::shared_ptr<crypto_pipeline::lane> m_lane;
+
+  private:
+	std::atomic<crypto_keys *> m_pending_keys = nullptr;
+	std::atomic<bool> m_pending_compression = false;
+};
+
+/// \brief Private implementation
+struct crypto_ready_queue;
+
+/// \brief The receiving half, decrypts, verifies and decompresses incomming packets
+
+class crypto_decoder : public crypto_direction
+{
+  public:
+	crypto_decoder()
+		: crypto_direction(false)
+	{
+	}
+
+	/// \brief Return the next packet extracted from \a buffer
+	///
+	/// Will return an empty pointer in case the packet is not complete yet
+	/// and needs more input.
+	std::unique_ptr<ipacket> get_next_packet(boost::asio::streambuf &buffer, boost::system::error_code &ec);
+
+	/// \brief Use \a pipeline to decrypt and verify packets
+	///
+	/// Packets are then completed asynchronously, \a notify is called from
+	/// a worker thread whenever get_next_packet has something new to return.
+	/// Should only be called at a packet boundary.
+	void set_pipeline(std::shared_ptr<crypto_pipeline> pipeline, std::function<void()> notify);
+
+	/// \brief Accept packets of up to \a size bytes, the default is kMaxPacketSize
+	void set_max_packet_size(uint32_t size) { m_max_packet_size = size; }
+
+	/// \brief The maximum size of incomming packets
+	uint32_t get_max_packet_size() const { return m_max_packet_size; }
+
+	void reset();
+
+  private:
+	/// \brief Fetch the next block of data
+	blob get_next_block(boost::asio::streambuf &buffer, bool empty);
+
+	/// \brief Hand all complete packets in \a buffer over to the pipeline
+	void offload(boost::asio::streambuf &buffer);
+
+	/// \brief Return the next packet completed by the pipeline
+	std::unique_ptr<ipacket> pop_ready(boost::system::error_code &ec);
+
+	std::unique_ptr<ipacket> m_packet;
+
+	blob m_header;
+	std::size_t m_packet_size = 0;
+	uint32_t m_max_packet_size = kMaxPacketSize;
+	bool m_stalled = false;
+	std::shared_ptr<crypto_ready_queue> m_ready;
+};
+
+/// \brief The sending half, compresses, signs and encrypts outgoing packets
+
+class crypto_encoder : public crypto_direction
+{
+  public:
+	crypto_encoder()
+		: crypto_direction(true)
+	{
+	}
+
+	/// \brief Package the packet in \a p as a streambuf
+	std::unique_ptr<boost::asio::streambuf> get_next_request(opacket &&p);
+
+	using request_handler = std::function<void(blob &&)>;
+
+	/// \brief Package the packet in \a p and pass the result to \a handler
+	///
+	/// Without a pipeline the handler is called before this call returns,
+	/// otherwise it may be called from one of the pipeline's threads. In both
+	/// cases handlers are called in the order the packets were passed in.
+	void async_get_next_request(opacket &&p, request_handler handler);
+
+	/// \brief Use \a pipeline to sign and encrypt packets
+	void set_pipeline(std::shared_ptr<crypto_pipeline> pipeline);
+};
+
 /// --------------------------------------------------------------------
 /// \brief the crypto_engine class
 ///
 /// Helper class for encrypting/decrypting and signing/verifying outgoing
 /// and incomming messages.
 ///
-/// Keeps track of packet numbers and encapsulates the crypto logic.
+/// Keeps track of packet numbers and encapsulates the crypto logic. The
+/// receiving and sending direction are completely independent, so reading
+/// and writing may be done concurrently by two different threads.
 
 class crypto_engine
 {
@@ -104,7 +292,8 @@ class crypto_engine
 
 	/// \brief Start using the new keys in \a kex.
 	///
-	/// The key exchange has finished and kex contains the new keys.
+	/// The key exchange has finished and kex contains the new keys. Both
+	/// directions switch to the new keys at their next packet.
 	///
 	/// \param kex				The key exchange object containing the new keys
 	/// \param authenticated	The connection has already been authenticated (rekey event)
@@ -114,6 +303,9 @@ class crypto_engine
 	/// \brief If compression is zlib@openssh.com, start using compression from now on
 	void enable_compression();
 
+	/// \brief Use a keystream cache of \a size bytes in both directions, see TransformData::set_keystream_cache
+	void set_keystream_cache(std::size_t size);
+
 	/// \brief Reset all
 	void reset();
 
@@ -121,34 +313,30 @@ class crypto_engine
 	///
 	/// Will return an empty pointer in case the packet is not complete yet
 	/// and needs more input.
-	std::unique_ptr<ipacket> get_next_packet(boost::asio::streambuf &buffer, boost::system::error_code &ec);
+	std::unique_ptr<ipacket> get_next_packet(boost::asio::streambuf &buffer, boost::system::error_code &ec)
+	{
+		return m_decoder.get_next_packet(buffer, ec);
+	}
 
 	/// \brief Package the packet in \a p as a streambuf
-	std::unique_ptr<boost::asio::streambuf> get_next_request(opacket &&p);
+	std::unique_ptr<boost::asio::streambuf> get_next_request(opacket &&p)
+	{
+		return m_encoder.get_next_request(std::move(p));
+	}
 
-  private:
-	/// \brief Fetch the next block of data
-	blob get_next_block(boost::asio::streambuf &buffer, bool empty);
+	/// \brief The receiving half
+	crypto_decoder &decoder() { return m_decoder; }
 
-	std::size_t m_iblocksize = 8, m_oblocksize = 8;
-	uint32_t m_in_seq_nr = 0, m_out_seq_nr = 0;
+	/// \brief The sending half
+	crypto_encoder &encoder() { return m_encoder; }
 
+  private:
 	std::string m_alg_kex,
 		m_alg_enc_c2s, m_alg_ver_c2s, m_alg_cmp_c2s,
 		m_alg_enc_s2c, m_alg_ver_s2c, m_alg_cmp_s2c;
 
-	TransformData m_decryptor;
-	TransformData m_encryptor;
-	MessageAuthenticationCode m_signer;
-	MessageAuthenticationCode m_verifier;
-
-	std::unique_ptr<compression_helper> m_compressor;
-	std::unique_ptr<compression_helper> m_decompressor;
-	bool m_delay_compressor, m_delay_decompressor;
-
-	std::unique_ptr<ipacket> m_packet;
-
-	std::mutex m_in_mutex, m_out_mutex;
+	crypto_decoder m_decoder;
+	crypto_encoder m_encoder;
 };
 
 } // namespace pinch
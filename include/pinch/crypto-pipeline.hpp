@@ -0,0 +1,117 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/// \file
+/// Definition of the crypto_pipeline class
+///
+/// The crypto pipeline moves the expensive part of packet protection, the
+/// MAC and the cipher, to a set of worker threads. This only works for
+/// ciphers that allow random access into the key stream (CTR mode), each
+/// packet is then assigned its sequence number and key stream offset up
+/// front and can be processed independently of the others.
+///
+/// Results are handed back in the order in which they were submitted, per
+/// lane. A crypto_encoder and a crypto_decoder each use their own lane.
+
+#include <pinch/pinch.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pinch
+{
+
+struct crypto_keys;
+
+// --------------------------------------------------------------------
+
+/// \brief A pool of worker threads doing the MAC and cipher work for packets
+
+class crypto_pipeline
+{
+  public:
+	/// \brief What a worker should do with a job
+	enum class job_type
+	{
+		none,    ///< nothing, the job was processed inline already
+		encrypt, ///< sign and then encrypt
+		decrypt  ///< decrypt and then verify
+	};
+
+	/// \brief A single packet
+	struct job
+	{
+		job_type m_type = job_type::none;
+		std::shared_ptr<const crypto_keys> m_keys;
+
+		uint32_t m_seq_nr = 0;
+		uint64_t m_offset = 0; ///< The key stream offset of the first byte of the packet
+		std::size_t m_skip = 0; ///< The number of leading bytes that are already decrypted
+
+		/// For encrypt: the plain text packet, on return the cipher text followed by the MAC.
+		/// For decrypt: the packet followed by the MAC, on return the plain text packet.
+		blob m_data;
+		bool m_verified = true;
+
+		/// Called in submission order, from one of the worker threads or the submitting thread
+		std::function<void(job &&)> m_handler;
+	};
+
+	/// \brief An ordered stream of jobs
+	class lane;
+
+	/// \brief constructor
+	///
+	/// \param workers	The number of worker threads, zero means one per core
+	crypto_pipeline(std::size_t workers = 0);
+
+	/// \brief destructor, jobs that have not been processed yet are dropped
+	~crypto_pipeline();
+
+	crypto_pipeline(const crypto_pipeline &) = delete;
+	crypto_pipeline &operator=(const crypto_pipeline &) = delete;
+
+	/// \brief The number of worker threads
+	std::size_t size() const { return m_threads.size(); }
+
+	/// \brief Create a new lane
+	std::shared_ptr<lane> make_lane();
+
+	/// \brief Submit \a j in lane \a l
+	void submit(const std::shared_ptr<lane> &l, job &&j);
+
+  private:
+	struct worker;
+
+	void run(worker &w);
+	void complete(const std::shared_ptr<lane> &l, uint64_t ticket, job &&j);
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::deque<std::tuple<std::shared_ptr<lane>, uint64_t, job>> m_queue;
+	std::vector<std::thread> m_threads;
+	bool m_stop = false;
+};
+
+// --------------------------------------------------------------------
+
+class crypto_pipeline::lane
+{
+  private:
+	friend class crypto_pipeline;
+
+	uint64_t m_next_ticket = 0, m_next_delivery = 0;
+	std::map<uint64_t, job> m_done;
+	bool m_delivering = false;
+};
+
+} // namespace pinch
@@ -0,0 +1,139 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/// \file
+/// Definition of the engine class
+///
+/// An engine owns a number of io_contexts, called shards, each of them
+/// run by its own thread. Connections are created on the shard that has
+/// the least connections at that moment and stay there for their whole
+/// lifetime. That way the state of a connection is only ever touched by
+/// a single thread.
+
+#include <pinch/pinch.hpp>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+
+namespace pinch
+{
+
+class basic_connection;
+
+/// \brief The engine class, a set of io_contexts with one thread each
+
+class engine
+{
+  public:
+	/// \brief constructor
+	///
+	/// \param shards		The number of io_contexts to create, zero means one per core
+	/// \param pin_threads	If true, the thread running shard N is pinned to core N
+	engine(std::size_t shards = 0, bool pin_threads = false);
+
+	/// \brief destructor, will stop and join the threads
+	~engine();
+
+	engine(const engine &) = delete;
+	engine &operator=(const engine &) = delete;
+
+	/// \brief Start the threads running the io_contexts
+	void start();
+
+	/// \brief Stop the io_contexts and wait for the threads to finish
+	void stop();
+
+	/// \brief The number of shards
+	std::size_t size() const { return m_shards.size(); }
+
+	/// \brief Return the io_context for shard \a shard
+	boost::asio::io_context &get_io_context(std::size_t shard)
+	{
+		return m_shards.at(shard)->m_io_context;
+	}
+
+	/// \brief Return the number of connections living in shard \a shard
+	std::size_t load(std::size_t shard) const
+	{
+		return m_shards.at(shard)->m_load;
+	}
+
+	/// \brief Return the index of the shard with the least connections
+	std::size_t least_loaded_shard() const;
+
+	/// \brief Return the index of the shard \a conn lives in, or size() if
+	/// the connection is not owned by this engine.
+	std::size_t shard_of(basic_connection &conn) const;
+
+	/// \brief Create a new connection of type \a T on the least loaded shard
+	///
+	/// The type T should have a constructor taking an io_context as first
+	/// argument followed by \a args. The load of the shard is decremented
+	/// again when the last reference to the connection is released.
+	template <typename T, typename... Args>
+	std::shared_ptr<T> make_connection(Args &&...args)
+	{
+		auto s = m_shards[least_loaded_shard()];
+
+		return counted(s, new T(s->m_io_context, std::forward<Args>(args)...));
+	}
+
+	/// \brief Create a new connection of type \a T that lives in the shard of \a conn
+	///
+	/// For connections that run on top of another one, like a
+	/// proxied_connection and its proxy. The type T should have a constructor
+	/// taking \a args. The connection counts in the load of the shard of
+	/// \a conn, if that is one of ours.
+	template <typename T, typename... Args>
+	std::shared_ptr<T> make_connection_in_shard_of(basic_connection &conn, Args &&...args)
+	{
+		std::unique_ptr<T> result(new T(std::forward<Args>(args)...));
+
+		auto shard = shard_of(conn);
+		if (shard == m_shards.size())
+			return std::shared_ptr<T>(result.release());
+
+		return counted(m_shards[shard], result.release());
+	}
+
+  private:
+	struct shard;
+
+	/// \brief Count \a conn in the load of \a s until the last reference to it is released
+	template <typename T>
+	static std::shared_ptr<T> counted(std::shared_ptr<shard> s, T *conn)
+	{
+		std::unique_ptr<T> guard(conn);
+
+		++s->m_load;
+
+		return std::shared_ptr<T>(guard.release(), [s](T *conn)
+			{
+				delete conn;
+				--s->m_load; });
+	}
+
+	/// \brief A single shard, shared with the connections living in it so
+	/// the io_context outlives them.
+	struct shard
+	{
+		boost::asio::io_context m_io_context{1};
+		boost::asio::executor_work_guard<boost::asio::io_context::executor_type> m_work{m_io_context.get_executor()};
+		std::atomic<std::size_t> m_load{0};
+		std::thread m_thread;
+	};
+
+	std::vector<std::shared_ptr<shard>> m_shards;
+	bool m_pin_threads;
+};
+
+} // namespace pinch
@@ -101,7 +101,8 @@ namespace error
 		no_more_auth_methods_available,
 		illegal_user_name,
 
-		keep_alive_timeout
+		keep_alive_timeout,
+		idle_timeout
 	};
 
 	boost::system::error_category &ssh_category();
@@ -25,6 +25,42 @@ extern const std::string
 /// \brief Return the first common protocol for \a server and \a client
 std::string choose_protocol(const std::string &server, const std::string &client);
 
+/// \brief The number of servers whose preferred algorithms are remembered, see key_exchange::remember_server
+const std::size_t kMaxRememberedServers = 1024;
+
+// --------------------------------------------------------------------
+
+/// \brief The algorithms to propose during key exchange, ordered by preference
+///
+/// A profile can be set per connection. Connections that have no profile
+/// of their own use the default profile, which is modified by
+/// key_exchange::set_algorithm.
+
+struct crypto_profile
+{
+	std::string m_kex = kKeyExchangeAlgorithms;
+	std::string m_server_host_key = kServerHostKeyAlgorithms;
+	std::string m_enc_c2s = kEncryptionAlgorithms, m_enc_s2c = kEncryptionAlgorithms;
+	std::string m_ver_c2s = kMacAlgorithms, m_ver_s2c = kMacAlgorithms;
+	std::string m_cmp_c2s = kCompressionAlgorithms, m_cmp_s2c = kCompressionAlgorithms;
+
+	/// The group sizes requested in diffie-hellman-group-exchange
+	uint32_t m_min_group_size = 1024, m_preferred_group_size = 2048, m_max_group_size = 8192;
+
+	/// \brief Set the preferred algorithms for \a alg in direction \a dir
+	void set_algorithm(algorithm alg, direction dir, const std::string &preferred);
+
+	/// \brief Return the profile used by connections without a profile of their own
+	static crypto_profile &default_profile();
+
+	/// \brief Return a profile with the ciphers and MACs ordered by their speed on this machine
+	///
+	/// The ranking is done with a short benchmark the first time this
+	/// routine is called, the result is cached. CTR mode ciphers are always
+	/// preferred over CBC mode and 3des-cbc always comes last.
+	static crypto_profile automatic();
+};
+
 // --------------------------------------------------------------------
 
 struct key_exchange_impl;
@@ -33,7 +69,7 @@ struct key_exchange_impl;
 class key_exchange
 {
   public:
-	/// \brief Set a preferred algorithm
+	/// \brief Set a preferred algorithm in the default profile
 	///
 	/// This method should obviously be called before connecting.
 	///
@@ -45,13 +81,16 @@ class key_exchange
 	/// \brief Constructor for a new connection
 	///
 	/// \param host_version The version string provided by the host
-	key_exchange(const std::string &host_version);
+	/// \param profile		The algorithms to propose
+	key_exchange(const std::string &host_version, const crypto_profile &profile = crypto_profile::default_profile());
 
 	/// \brief Constructor for a rekey event
 	///
 	/// \param host_version The version string provided by the host
 	/// \param session_id	The session ID created in the initial key exchange
-	key_exchange(const std::string &host_version, const blob &session_id);
+	/// \param profile		The algorithms to propose
+	key_exchange(const std::string &host_version, const blob &session_id,
+		const crypto_profile &profile = crypto_profile::default_profile());
 
 	/// \brief destructor
 	~key_exchange();
@@ -60,7 +99,19 @@ class key_exchange
 	key_exchange &operator=(const key_exchange &) = delete;
 
 	/// \brief Return a packet with msg_kexinit and our preferred algo's
-	opacket init();
+	///
+	/// \param guess	Set first_kex_packet_follows, the packet returned by
+	///					first_kex_packet should be sent right after this one
+	opacket init(bool guess = false);
+
+	/// \brief Return the first packet of our preferred key exchange algorithm
+	///
+	/// This is the guess announced in init(true), see RFC 4253 section 7.
+	/// Returns an empty packet when init was called without guess.
+	opacket first_kex_packet();
+
+	/// \brief Set the version string of the host, in case it was not known at construction
+	void set_host_version(const std::string &host_version) { m_host_version = host_version; }
 
 	/// \brief Process a message during key exchange
 	///
@@ -102,6 +153,23 @@ class key_exchange
 	/// \brief Return the public key for the host
 	const blob& get_host_key() const { return m_host_key; }
 
+	/// \brief Return the profile used in this key exchange
+	const crypto_profile &get_profile() const { return m_profile; }
+
+	/// \brief Is guessing the first kex packet for \a server likely to pay off?
+	///
+	/// The guess is right when the server prefers the same kex and host key
+	/// algorithm as \a profile. This returns true when a previous key exchange
+	/// with \a server, as recorded by remember_server, showed it does.
+	static bool guess_likely(const std::string &server, const crypto_profile &profile);
+
+	/// \brief Record the preferred algorithms of the host for guess_likely
+	///
+	/// Should be called after the kexinit of the host was processed. At most
+	/// kMaxRememberedServers servers are remembered, the oldest is forgotten
+	/// first.
+	void remember_server(const std::string &server) const;
+
   protected:
 	friend struct key_exchange_impl;
 
@@ -113,20 +181,16 @@ class key_exchange
 
 	key_exchange_impl *m_impl = nullptr;
 
+	crypto_profile m_profile;
 	std::string m_host_version;
 	blob m_session_id;
 	blob m_host_payload, m_my_payload;
-	bool m_first_kex_packet_follows;
-	
+	bool m_guessed = false;             ///< our first kex packet was sent along with our kexinit
+	bool m_ignore_next_packet = false;  ///< the host sent a wrong guess
+	std::string m_server_preferred;     ///< the first kex and host key algorithm of the host
+
 	std::string m_pk_type;
 	blob m_host_key;
-
-	// --------------------------------------------------------------------
-
-	static std::string
-		s_alg_kex,
-		s_alg_enc_s2c, s_alg_enc_c2s, s_alg_ver_s2c, s_alg_ver_c2s, s_alg_cmp_s2c, s_alg_cmp_c2s,
-		s_server_host_key;
 };
 
 } // namespace pinch
@@ -9,6 +9,11 @@
 
 #include <pinch/pinch.hpp>
 
+#include <cassert>
+#include <memory>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
 #include <boost/system/error_code.hpp>
 
 namespace CryptoPP
@@ -22,6 +27,16 @@ struct z_stream_s;
 namespace pinch
 {
 
+/// \brief The default maximum packet size, every implementation must support
+/// this, and the largest maximum packet size that can be configured
+const uint32_t kMaxPacketSize = 0x8000, kMaxPacketSizeLimit = 0x40000;
+
+/// \brief The default window size, the window is at least four times the maximum packet size
+const uint32_t kWindowSize = 4 * kMaxPacketSize;
+
+/// \brief The default limit up to which a channel's receive window may grow
+const uint32_t kDefaultMaxWindowSize = 0x400000;
+
 /// forward declarations
 class ipacket;
 class opacket;
@@ -174,20 +189,46 @@ class opacket
 	/// \brief Write the contents of the packet to \a os padded to \a blocksize
 	void write(std::ostream &os, int blocksize) const;
 
-	/// \brief View the contents of this packet
-	operator blob() const { return m_data; }
+	/// \brief View the contents of this packet, including referenced data
+	operator blob() const;
 
-	/// \brief The contents of the packet as a std::string_view
+	/// \brief The contents of the packet as a std::string_view, without referenced data
 	operator std::string_view() const { return std::string_view(reinterpret_cast<const char *>(m_data.data()), m_data.size()); }
 
 	/// \brief Return if this packet contains any sensible data
 	bool empty() const { return m_data.empty() or static_cast<message_type>(m_data[0]) == msg_undefined; }
 
-	/// \brief Access to the underlying data
+	/// \brief Access to the underlying data, without referenced data
 	const uint8_t* data() const { return m_data.data(); }
 
-	/// \brief Return the size of the data contained in this packet
-	std::size_t size() const { return m_data.size(); }
+	/// \brief Return the size of the data contained in this packet, including referenced data
+	std::size_t size() const { return m_data.size() + m_referenced_size; }
+
+	/// \brief Store the data in \a buffers as a string, without copying it
+	///
+	/// The data is read from \a buffers only when the packet is written, so
+	/// it is encrypted straight from the caller's memory. The memory must stay
+	/// valid until then, \a owner is kept with the packet for that purpose.
+	/// Nothing can be stored in the packet after this.
+	template <typename ConstBufferSequence>
+	opacket &reference(const ConstBufferSequence &buffers, std::shared_ptr<const void> owner = {})
+	{
+		assert(m_referenced.empty());
+
+		std::size_t size = boost::asio::buffer_size(buffers);
+		operator<<(static_cast<uint32_t>(size));
+
+		for (auto b = boost::asio::buffer_sequence_begin(buffers); b != boost::asio::buffer_sequence_end(buffers); ++b)
+		{
+			if (b->size() > 0)
+				m_referenced.emplace_back(*b);
+		}
+
+		m_referenced_size = size;
+		m_owner = std::move(owner);
+
+		return *this;
+	}
 
 	/// \brief Return true if the packet is not empty
 	explicit operator bool() const { return not empty(); }
@@ -221,7 +262,14 @@ class opacket
 	}
 
   protected:
+	/// \brief Copy the referenced data into m_data
+	void flatten();
+
 	blob m_data;
+
+	std::vector<boost::asio::const_buffer> m_referenced;
+	std::size_t m_referenced_size = 0;
+	std::shared_ptr<const void> m_owner; ///< keeps the referenced data alive
 };
 
 struct skip_string_t
@@ -296,7 +344,10 @@ class ipacket
 	uint32_t size() const { return m_length; }
 
 	/// \brief Append the contents of \a block to this packet
-	void append(const blob &block);
+	///
+	/// Throws packet_exception if the length of the packet exceeds \a max_packet_size
+	/// plus some room for padding.
+	void append(const blob &block, uint32_t max_packet_size = kMaxPacketSize);
 
 	/// \brief Append the raw data \a data with size \a size to this packet
 	std::size_t read(const char *data, std::size_t size);
@@ -0,0 +1,86 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/// \file
+/// Definition of the rate_limiter class
+///
+/// Without limits a single bulk transfer can take all of the bandwidth of
+/// an uplink that is shared with other users. A rate_limiter is a token
+/// bucket, it fills at a fixed rate up to a burst size and data may only be
+/// sent while there are tokens in the bucket.
+///
+/// Limits can be set on a channel, on a connection and on a group of
+/// connections, like those of a connection_pool. Data is sent in packets,
+/// a packet may be sent as long as none of the buckets that apply is empty,
+/// it is then taken from all of them. This may leave a bucket in debt, the
+/// next packet then waits until the debt is paid off. That way the buckets
+/// need not be locked together, which is important for groups that are
+/// shared by connections in different threads.
+///
+/// Limiting the data received works by holding back window adjusts, the
+/// server cannot send more than the window allows.
+
+#include <pinch/pinch.hpp>
+
+#include <chrono>
+#include <mutex>
+
+namespace pinch
+{
+
+// --------------------------------------------------------------------
+
+/// \brief A token bucket limiting a data rate, may be shared between threads
+
+class rate_limiter
+{
+  public:
+	using clock_type = std::chrono::steady_clock;
+	using time_point = clock_type::time_point;
+	using duration = clock_type::duration;
+
+	rate_limiter() = default;
+	rate_limiter(const rate_limiter &) = delete;
+	rate_limiter &operator=(const rate_limiter &) = delete;
+
+	/// \brief Set the rate to \a bytes_per_second, zero means no limit
+	///
+	/// \param bytes_per_second	The long term rate
+	/// \param burst			The size of the bucket, zero means a tenth of a second's worth
+	void set_rate(double bytes_per_second, std::size_t burst = 0);
+
+	/// \brief The rate in bytes per second, zero if there is no limit
+	double get_rate() const;
+
+	/// \brief The size of the bucket
+	std::size_t get_burst() const;
+
+	/// \brief Returns how long to wait before data may be sent, zero if it may be sent right away
+	duration delay(time_point now = clock_type::now());
+
+	/// \brief Take \a bytes from the bucket, the bucket may go into debt
+	void consume(std::size_t bytes, time_point now = clock_type::now());
+
+  private:
+	/// \brief Fill the bucket for the time passed since the last call, m_mutex should be locked
+	void refill(time_point now);
+
+	mutable std::mutex m_mutex;
+	double m_rate = 0;
+	double m_burst = 0;
+	double m_tokens = 0;
+	time_point m_last;
+};
+
+/// \brief The limits for the data sent and received by a group of connections
+struct rate_limit_group
+{
+	rate_limiter m_send;
+	rate_limiter m_receive;
+};
+
+} // namespace pinch
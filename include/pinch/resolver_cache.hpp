@@ -0,0 +1,147 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/// \file
+/// Definition of the resolver_cache class
+///
+/// Each connection resolves the name of its host when it is opened. A
+/// program that connects to many hosts, or reconnects often, spends a lot
+/// of time waiting for the same answers. A resolver_cache keeps the results
+/// for a while, failures included, and can be shared by many connections,
+/// also when these run in different threads.
+///
+/// The system resolver does not report the time to live of its answers,
+/// the cache therefore uses fixed times, one for results and a shorter one
+/// for failures. An entry that is used shortly before it expires is resolved
+/// again in the background, so frequently used names never have to wait.
+/// Concurrent lookups for a name that is not in the cache share a single
+/// query.
+///
+/// Since a query may be shared by callers running in different io_contexts,
+/// queries do not run in any of these. The cache has an io_context of its
+/// own, run by a thread that is started for the first query. Results are
+/// delivered through the executor of each caller.
+
+#include <pinch/pinch.hpp>
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+namespace pinch
+{
+
+// --------------------------------------------------------------------
+
+/// \brief Counters for a resolver_cache
+
+struct resolver_cache_stats
+{
+	uint64_t m_hits = 0;          ///< Lookups answered from the cache, failures included
+	uint64_t m_negative_hits = 0; ///< Lookups answered with a cached failure
+	uint64_t m_misses = 0;        ///< Lookups that had to wait for the resolver
+	uint64_t m_refreshes = 0;     ///< Entries resolved again in the background
+	std::size_t m_entries = 0;    ///< The number of names in the cache
+};
+
+// --------------------------------------------------------------------
+
+/// \brief A thread safe cache for host name lookups
+
+class resolver_cache : public std::enable_shared_from_this<resolver_cache>
+{
+  public:
+	using clock_type = std::chrono::steady_clock;
+	using time_point = clock_type::time_point;
+	using duration = clock_type::duration;
+	using executor_type = boost::asio::any_io_executor;
+	using endpoint_type = boost::asio::ip::tcp::endpoint;
+
+	/// \brief Called with the addresses for a name, or with the error the resolver returned
+	using handler_type = std::function<void(const boost::system::error_code &ec, const std::vector<endpoint_type> &endpoints)>;
+
+	/// \brief Constructor
+	///
+	/// \param ttl			How long a result is kept
+	/// \param negative_ttl	How long a failure is kept
+	resolver_cache(duration ttl = std::chrono::seconds(60), duration negative_ttl = std::chrono::seconds(5));
+
+	/// \brief destructor, stops the queries still running and their thread
+	~resolver_cache();
+
+	resolver_cache(const resolver_cache &) = delete;
+	resolver_cache &operator=(const resolver_cache &) = delete;
+
+	/// \brief Set how long results and failures are kept, applies to new entries
+	void set_ttl(duration ttl, duration negative_ttl);
+
+	/// \brief Resolve entries again in the background when they are used less than \a refresh_ahead before they expire
+	///
+	/// Zero turns background refreshing off. The default is a sixth of the ttl.
+	void set_refresh_ahead(duration refresh_ahead);
+
+	/// \brief Look up \a host and \a port, calling \a handler through \a executor
+	///
+	/// The handler is always called through the executor, also when the
+	/// answer is in the cache. The query itself runs in the cache's own
+	/// io_context, other callers waiting for the same name therefore do
+	/// not depend on \a executor.
+	void async_resolve(const executor_type &executor, const std::string &host, uint16_t port, handler_type handler);
+
+	/// \brief Remove all entries, queries in progress still deliver their result
+	void clear();
+
+	/// \brief The counters so far
+	resolver_cache_stats get_stats() const;
+
+  private:
+	struct waiter
+	{
+		executor_type m_executor;
+		handler_type m_handler;
+	};
+
+	struct entry
+	{
+		boost::system::error_code m_ec;
+		std::vector<endpoint_type> m_endpoints;
+		time_point m_expires;
+		bool m_valid = false;       ///< false until the first query finished
+		bool m_querying = false;    ///< true while a query is running
+		std::vector<waiter> m_waiters; ///< waiting for the first query
+	};
+
+	/// \brief Start a query for \a key, m_mutex should be locked
+	void start_query(const std::string &key, const std::string &host, uint16_t port);
+
+	/// \brief Store the result of a query and notify the waiters
+	void query_done(const std::string &key, const boost::system::error_code &ec, std::vector<endpoint_type> &&endpoints);
+
+	/// \brief Remove expired entries, m_mutex should be locked
+	void prune(time_point now);
+
+	mutable std::mutex m_mutex;
+	duration m_ttl, m_negative_ttl, m_refresh_ahead;
+	std::unordered_map<std::string, entry> m_entries;
+	std::size_t m_prune_size = 1024; ///< prune when the cache grows beyond this
+	resolver_cache_stats m_stats;
+
+	boost::asio::io_context m_io_context; ///< runs the queries
+	boost::asio::executor_work_guard<boost::asio::io_context::executor_type> m_work{ m_io_context.get_executor() };
+	std::thread m_thread; ///< runs m_io_context, started for the first query
+};
+
+} // namespace pinch
@@ -0,0 +1,161 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/// \file
+/// Definition of the outbound_scheduler class
+///
+/// All channels of a connection share a single socket. Without scheduling
+/// a bulk transfer on one channel fills the socket buffers and a keystroke
+/// in a terminal channel has to wait until all of that data is written.
+///
+/// Channel data is therefore queued in an outbound_scheduler. The connection
+/// only takes the next packet from the scheduler when the amount of data
+/// waiting to be written to the socket is small. Packets are taken in order
+/// of traffic class, and within a class in deficit round robin order over
+/// the channels, taking the channel weights into account. Messages for the
+/// connection as a whole, like window adjusts, key exchange and keep alive
+/// packets, are never queued and always go first. Channel requests and the
+/// closing of a channel do not overtake that channel's data, they are queued
+/// behind it when there is data waiting.
+
+#include <pinch/pinch.hpp>
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+
+#include <boost/system/error_code.hpp>
+
+namespace pinch
+{
+
+// --------------------------------------------------------------------
+
+/// \brief The traffic classes, in order of priority
+
+enum class traffic_class
+{
+	control,     ///< Messages that are not channel data, these are never queued
+	interactive, ///< Channel data that should not wait, like terminal sessions
+	bulk         ///< Channel data for transfers, like SFTP and port forwarding
+};
+
+/// \brief The number of traffic classes
+const std::size_t kTrafficClassCount = 3;
+
+/// \brief Statistics for a traffic class
+///
+/// For channel data the delay is the time a packet spent in the
+/// outbound_scheduler, for control messages it is the time between the
+/// call to async_write and the moment the packet is handed to the socket.
+struct traffic_stats
+{
+	uint64_t m_packets = 0;
+	uint64_t m_bytes = 0;
+	std::chrono::steady_clock::duration m_total_delay{};
+	std::chrono::steady_clock::duration m_max_delay{};
+
+	/// \brief The average queueing delay
+	std::chrono::steady_clock::duration average_delay() const
+	{
+		using duration = std::chrono::steady_clock::duration;
+		return m_packets ? duration(m_total_delay / static_cast<duration::rep>(m_packets)) : duration{};
+	}
+
+	/// \brief Account for a packet of \a bytes that waited \a delay
+	void add(std::size_t bytes, std::chrono::steady_clock::duration delay)
+	{
+		++m_packets;
+		m_bytes += bytes;
+		m_total_delay += delay;
+		if (m_max_delay < delay)
+			m_max_delay = delay;
+	}
+};
+
+// --------------------------------------------------------------------
+
+/// \brief Deficit round robin scheduler for outgoing channel data
+
+class outbound_scheduler
+{
+  public:
+	using time_point = std::chrono::steady_clock::time_point;
+
+	/// \brief Called when a packet is released, or with an error when it is cancelled
+	using release_type = std::function<void(const boost::system::error_code &)>;
+
+	/// \brief Queue a packet of \a size bytes for flow \a flow
+	///
+	/// \param flow		The flow, a channel ID
+	/// \param cls		The traffic class, control is treated as interactive
+	/// \param weight	The share of the flow in its class, relative to the other flows
+	/// \param size		The size of the packet
+	/// \param release	Called when it is the packet's turn
+	void push(uint32_t flow, traffic_class cls, uint32_t weight, std::size_t size, release_type &&release);
+
+	/// \brief Queue a packet of \a size bytes behind the packets already waiting for flow \a flow
+	///
+	/// The flow keeps its class and weight. Returns false, leaving \a release
+	/// untouched, when nothing is waiting for \a flow. The packet can then be
+	/// written right away without overtaking any of the flow's data.
+	bool push_behind(uint32_t flow, std::size_t size, release_type &&release);
+
+	/// \brief Release the next packet, returns false if there is none
+	///
+	/// The release function is called after the packet is removed from the
+	/// queue, so it may push new packets.
+	bool release_next();
+
+	/// \brief Cancel all packets for flow \a flow, calling their release function with \a ec
+	///
+	/// Packets accepted for a flow should be written, even when the channel
+	/// closes. This is for when they can no longer be written at all.
+	void cancel(uint32_t flow, const boost::system::error_code &ec);
+
+	/// \brief Cancel all packets
+	void cancel_all(const boost::system::error_code &ec);
+
+	bool empty() const { return m_size == 0; }
+
+	/// \brief The statistics for traffic class \a cls
+	const traffic_stats &get_stats(traffic_class cls) const { return m_stats[static_cast<std::size_t>(cls)]; }
+
+	/// \brief Account for a control packet of \a bytes that waited \a delay
+	void add_control(std::size_t bytes, std::chrono::steady_clock::duration delay)
+	{
+		m_stats[static_cast<std::size_t>(traffic_class::control)].add(bytes, delay);
+	}
+
+  private:
+	struct item
+	{
+		std::size_t m_size;
+		time_point m_queued;
+		release_type m_release;
+	};
+
+	struct flow
+	{
+		std::deque<item> m_items;
+		std::size_t m_deficit = 0;
+		uint32_t m_weight = 1;
+		traffic_class m_class;
+	};
+
+	/// The quantum added to a flow's deficit per round, times its weight
+	static constexpr std::size_t kQuantum = 0x8000;
+
+	std::unordered_map<uint32_t, flow> m_flows;
+	std::array<std::deque<uint32_t>, kTrafficClassCount> m_active; ///< flows with packets, per class
+	std::array<traffic_stats, kTrafficClassCount> m_stats;
+	std::size_t m_size = 0;
+};
+
+} // namespace pinch
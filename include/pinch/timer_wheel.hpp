@@ -0,0 +1,152 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/// \file
+/// Definition of the timer_wheel class
+///
+/// Every connection needs a few timers: keep alive, idle timeout and a
+/// deadline for the handshake. These are coarse and almost never expire,
+/// yet with an asio timer each of them is an entry in the timer heap of
+/// the io_context that has to be moved around on every change.
+///
+/// The timer_wheel is a hierarchical timing wheel, one per io_context, that
+/// runs these timers off a single asio timer. Timers are kept in intrusive
+/// lists, setting and cancelling them takes constant time. The resolution is
+/// kTimerWheelResolution, a timer never fires early but may fire up to one
+/// tick late.
+///
+/// Handlers are called from the thread running the io_context. Timers may
+/// be set, cancelled and destroyed from any thread, the wheel protects its
+/// lists with a mutex. A timer that is destroyed while its handler is about
+/// to be called on another thread cannot stop that handler though, handlers
+/// should therefore not hold raw pointers to the owner of the timer.
+
+#include <pinch/pinch.hpp>
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace pinch
+{
+
+/// \brief The time between two ticks of a timer_wheel
+const std::chrono::milliseconds kTimerWheelResolution(100);
+
+// --------------------------------------------------------------------
+
+/// \brief A hierarchical timing wheel for the coarse timers of an io_context
+///
+/// Obtain the wheel for an io_context with
+/// boost::asio::use_service<timer_wheel>(io_context).
+
+class timer_wheel : public boost::asio::io_context::service
+{
+  public:
+	using clock_type = std::chrono::steady_clock;
+	using time_point = clock_type::time_point;
+	using duration = clock_type::duration;
+	using handler_type = std::function<void()>;
+
+	static boost::asio::io_context::id id;
+
+	explicit timer_wheel(boost::asio::io_context &io_context);
+
+	timer_wheel(const timer_wheel &) = delete;
+	timer_wheel &operator=(const timer_wheel &) = delete;
+
+	/// \brief A timer in a timer_wheel, the timer is cancelled when it is destroyed
+	class timer
+	{
+	  public:
+		explicit timer(timer_wheel &wheel)
+			: m_wheel(&wheel)
+		{
+		}
+
+		explicit timer(boost::asio::io_context &io_context)
+			: timer(boost::asio::use_service<timer_wheel>(io_context))
+		{
+		}
+
+		~timer() { cancel(); }
+
+		timer(const timer &) = delete;
+		timer &operator=(const timer &) = delete;
+
+		/// \brief Call \a handler at \a time, replacing the pending handler if any
+		void expires_at(time_point time, handler_type handler);
+
+		/// \brief Call \a handler after \a interval, replacing the pending handler if any
+		void expires_after(duration interval, handler_type handler)
+		{
+			expires_at(clock_type::now() + interval, std::move(handler));
+		}
+
+		/// \brief Cancel the timer, the handler is not called unless it was already being called
+		void cancel();
+
+		/// \brief Is the timer waiting to fire?
+		bool pending() const;
+
+	  private:
+		friend class timer_wheel;
+
+		timer_wheel *m_wheel;
+		timer **m_head = nullptr; ///< the list this timer is in, nullptr if none
+		timer *m_prev = nullptr;
+		timer *m_next = nullptr;
+		uint64_t m_tick = 0;
+		handler_type m_handler;
+	};
+
+	/// \brief The number of pending timers
+	std::size_t size() const;
+
+  private:
+	static constexpr std::size_t kLevels = 4, kBits = 6, kSlots = 1 << kBits;
+	static constexpr uint64_t kMask = kSlots - 1, kMaxDelta = (uint64_t(1) << (kBits * kLevels)) - 1;
+
+	virtual void shutdown() override;
+
+	/// \brief Set \a t to call \a handler at \a time, replacing its pending handler
+	void add(timer *t, time_point time, handler_type handler);
+
+	/// \brief Cancel \a t, if it is pending
+	void remove(timer *t);
+
+	/// \brief Take \a t out of its list, m_mutex should be locked
+	void unlink(timer *t);
+
+	/// \brief Put \a t in the slot for its tick, relative to m_now
+	void place(timer *t);
+
+	/// \brief Move the timers in \a slot of \a level to the lower levels
+	void cascade(std::size_t level, std::size_t slot);
+
+	/// \brief Process tick \a tick, the next one after m_now, \a lock is released while calling handlers
+	void advance(uint64_t tick, std::unique_lock<std::mutex> &lock);
+
+	void start_ticking();
+	void tick(const boost::system::error_code &ec);
+
+	static uint64_t to_tick(time_point time, bool round_up);
+
+	mutable std::mutex m_mutex; ///< protects everything below, and the list members of the timers
+	std::array<std::array<timer *, kSlots>, kLevels> m_slots{};
+	uint64_t m_now = 0; ///< the last tick processed
+	std::size_t m_size = 0;
+	bool m_ticking = false;
+	bool m_shutdown = false;
+	boost::asio::steady_timer m_tick_timer;
+};
+
+} // namespace pinch
@@ -0,0 +1,155 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/// \file
+/// Definition of the window_tuner class
+///
+/// A channel can receive at most one window of data per round trip. With
+/// a fixed window of kWindowSize bytes that limits a channel to about
+/// 3 MB/s on a link with a round trip time of 40 ms, no matter how fast
+/// the link itself is.
+///
+/// The window_tuner measures the round trip time and the rate at which
+/// the application consumes the data. When the application consumes more
+/// than half a window per round trip, the window is the limiting factor
+/// and it is doubled, up to a configurable maximum. A slow consumer does
+/// not cause the window to grow.
+
+#include <pinch/pinch.hpp>
+
+#include <chrono>
+
+#include <pinch/packet.hpp>
+
+namespace pinch
+{
+
+// --------------------------------------------------------------------
+
+/// \brief Statistics on the receiving side of a channel
+
+struct channel_stats
+{
+	uint64_t m_bytes_received = 0;  ///< Payload received from the server
+	uint64_t m_bytes_consumed = 0;  ///< Payload consumed by the application
+	uint32_t m_window_size = 0;     ///< The current receive window size
+	uint32_t m_max_window_size = 0; ///< The limit for the receive window size
+	uint32_t m_window_adjusts = 0;  ///< The number of window adjust messages sent
+	uint32_t m_window_grows = 0;    ///< The number of times the window was enlarged
+
+	std::chrono::steady_clock::duration m_rtt{}; ///< The smallest round trip time measured, zero if unknown
+	double m_drain_rate = 0;                     ///< Bytes per second consumed during the last round trip
+};
+
+// --------------------------------------------------------------------
+
+/// \brief When a channel sends window adjusts
+///
+/// An adjust is sent once the credit that can be returned to the server
+/// is at least \a m_threshold times the window size and at least
+/// \a m_min_increment bytes. Higher values mean fewer adjust packets, at
+/// the cost of a smaller effective window.
+struct window_adjust_policy
+{
+	double m_threshold = 0.5;     ///< Fraction of the window, between zero and one
+	uint32_t m_min_increment = 0; ///< Minimum credit in bytes, limited to the window size
+
+	/// \brief The minimum credit to send for a window of \a window_size bytes
+	uint32_t min_credit(uint32_t window_size) const
+	{
+		auto result = static_cast<uint32_t>(window_size * m_threshold);
+		if (result < m_min_increment)
+			result = m_min_increment;
+		if (result > window_size)
+			result = window_size;
+		return result;
+	}
+
+	/// \brief The credit to send for a window of \a window_size bytes, zero if it is too early
+	///
+	/// \param window_size	The window size the channel wants to offer
+	/// \param outstanding	The window still granted to the server plus the data not consumed yet
+	uint32_t credit(uint32_t window_size, std::size_t outstanding) const
+	{
+		if (outstanding >= window_size)
+			return 0;
+
+		auto result = static_cast<uint32_t>(window_size - outstanding);
+		return result >= min_credit(window_size) ? result : 0;
+	}
+};
+
+// --------------------------------------------------------------------
+
+/// \brief Sizes the receive window of a channel to the bandwidth delay product
+///
+/// All members take the current time as argument, that way the tuner can
+/// also be driven by a simulated clock.
+
+class window_tuner
+{
+  public:
+	using clock_type = std::chrono::steady_clock;
+	using time_point = clock_type::time_point;
+	using duration = clock_type::duration;
+
+	window_tuner(uint32_t window_size = kWindowSize, uint32_t max_window_size = kDefaultMaxWindowSize);
+
+	/// \brief Set the initial window size, should only be called before the window is advertised
+	void set_window_size(uint32_t size);
+
+	/// \brief The current window size
+	uint32_t get_window_size() const { return m_window_size; }
+
+	/// \brief Set the limit for the window size, the window never shrinks below the initial size
+	void set_max_window_size(uint32_t size);
+
+	/// \brief The limit for the window size
+	uint32_t get_max_window_size() const { return m_max_window_size; }
+
+	/// \brief Account for \a bytes of payload received at time \a now
+	void received(std::size_t bytes, time_point now = clock_type::now());
+
+	/// \brief Account for \a bytes of payload consumed by the application at time \a now
+	///
+	/// This is where the window is enlarged when needed.
+	void consumed(std::size_t bytes, time_point now = clock_type::now());
+
+	/// \brief Account for a window adjust of \a credit bytes sent at time \a now
+	void adjust_sent(uint32_t credit, time_point now = clock_type::now());
+
+	/// \brief The statistics collected so far
+	channel_stats get_stats() const;
+
+  private:
+	uint32_t m_initial_window_size;
+	uint32_t m_window_size;
+	uint32_t m_max_window_size;
+
+	uint64_t m_received = 0;
+	uint64_t m_consumed = 0;
+	uint64_t m_credit; ///< The total window granted to the server
+
+	// An RTT measurement starts when a window adjust is sent. The first byte
+	// beyond the window granted before could only be sent after the adjust
+	// was received, its arrival ends the measurement.
+	bool m_probing = false;
+	uint64_t m_probe_edge = 0;
+	time_point m_probe_start;
+	duration m_rtt{};
+
+	// the drain rate is measured over periods of one round trip
+	bool m_period_started = false;
+	time_point m_period_start;
+	uint64_t m_period_bytes = 0;
+	double m_drain_rate = 0;
+
+	uint32_t m_adjusts = 0;
+	uint32_t m_grows = 0;
+};
+
+} // namespace pinch
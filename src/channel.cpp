@@ -10,11 +10,79 @@
 namespace pinch
 {
 
-uint32_t channel::s_next_channel_id = 1;
+// --------------------------------------------------------------------
+
+void detail::receive_queue::append(const char *data, std::size_t size)
+{
+	if (size == 0)
+		return;
+
+	blob chunk;
+	std::swap(chunk, m_spare);
+	chunk.assign(data, data + size);
+
+	m_chunks.emplace_back(std::move(chunk));
+	m_size += size;
+}
+
+std::vector<boost::asio::const_buffer> detail::receive_queue::data() const
+{
+	std::vector<boost::asio::const_buffer> result;
+	result.reserve(m_chunks.size());
+
+	std::size_t offset = m_offset;
+	for (auto &chunk : m_chunks)
+	{
+		result.emplace_back(chunk.data() + offset, chunk.size() - offset);
+		offset = 0;
+	}
+
+	return result;
+}
+
+void detail::receive_queue::consume(std::size_t size)
+{
+	size = std::min(size, m_size);
+	m_size -= size;
+
+	while (size > 0)
+	{
+		auto &chunk = m_chunks.front();
+
+		std::size_t n = std::min(size, chunk.size() - m_offset);
+		m_offset += n;
+		size -= n;
+
+		if (m_offset == chunk.size())
+		{
+			m_spare = std::move(chunk);
+			m_chunks.pop_front();
+			m_offset = 0;
+		}
+	}
+}
+
+// --------------------------------------------------------------------
 
 void channel::fill_open_opacket(opacket &out)
 {
-	out << channel_type() << m_my_channel_id << kWindowSize << kMaxPacketSize;
+	out << channel_type() << m_my_channel_id << m_tuner.get_window_size() << m_max_receive_packet_size;
+}
+
+void channel::set_max_packet_size(uint32_t size)
+{
+	m_max_receive_packet_size = std::min(size, m_connection->get_max_packet_size());
+
+	if (not m_channel_open)
+	{
+		m_tuner.set_window_size(std::max(kWindowSize, 4 * m_max_receive_packet_size));
+		m_my_window_size = m_tuner.get_window_size();
+	}
+}
+
+void channel::set_max_window_size(uint32_t size)
+{
+	m_tuner.set_max_window_size(size);
 }
 
 void channel::open()
@@ -24,9 +92,6 @@ void channel::open()
 
 void channel::opened()
 {
-	if (m_my_channel_id == 0)
-		m_my_channel_id = s_next_channel_id++;
-
 	check_wait();
 }
 
@@ -46,12 +111,14 @@ void channel::closed()
 	}
 	m_read_ops.clear();
 
-	for (auto op : m_write_ops)
-	{
-		op->complete(error::make_error_code(error::channel_closed));
-		delete op;
-	}
-	m_write_ops.clear();
+	if (m_receive_sink)
+		m_receive_sink(error::make_error_code(error::channel_closed), nullptr, 0);
+
+	fail_write_ops(error::make_error_code(error::channel_closed));
+
+	m_send_timer.cancel();
+	m_receive_timer.cancel();
+	m_send_paced = m_receive_paced = false;
 
 	for (auto op : m_wait_ops)
 	{
@@ -104,7 +171,7 @@ void channel::open_pty(uint32_t width, uint32_t height,
 			<< "MIT-MAGIC-COOKIE-1"
 			<< "0000000000000000"
 			<< uint32_t(0);
-		m_connection->async_write(std::move(out));
+		m_connection->write_channel_message(m_my_channel_id, std::move(out));
 	}
 
 	if (forward_agent)
@@ -115,7 +182,7 @@ void channel::open_pty(uint32_t width, uint32_t height,
 		out << m_host_channel_id
 			<< "auth-agent-req@openssh.com"
 			<< false;
-		m_connection->async_write(std::move(out));
+		m_connection->write_channel_message(m_my_channel_id, std::move(out));
 	}
 
 	for (const auto &[name, value] : env)
@@ -126,7 +193,7 @@ void channel::open_pty(uint32_t width, uint32_t height,
 			<< false
 			<< name
 			<< value;
-		m_connection->async_write(std::move(out));
+		m_connection->write_channel_message(m_my_channel_id, std::move(out));
 	}
 
 	opacket out(msg_channel_request);
@@ -137,7 +204,7 @@ void channel::open_pty(uint32_t width, uint32_t height,
 		<< width << height
 		<< uint32_t(0) << uint32_t(0)
 		<< "";
-	m_connection->async_write(std::move(out));
+	m_connection->write_channel_message(m_my_channel_id, std::move(out));
 }
 
 void channel::send_request_and_command(const std::string &request, const std::string &command)
@@ -148,7 +215,7 @@ void channel::send_request_and_command(const std::string &request, const std::st
 		<< true;
 	if (not command.empty())
 		out << command;
-	m_connection->async_write(std::move(out));
+	m_connection->write_channel_message(m_my_channel_id, std::move(out));
 }
 
 void channel::send_signal(const std::string &signal)
@@ -158,7 +225,7 @@ void channel::send_signal(const std::string &signal)
 		<< "signal"
 		<< false
 		<< signal;
-	m_connection->async_write(std::move(out));
+	m_connection->write_channel_message(m_my_channel_id, std::move(out));
 }
 
 void channel::process(ipacket &in)
@@ -211,7 +278,16 @@ void channel::process(ipacket &in)
 				std::pair<const char *, size_t> data;
 				in >> data;
 				m_my_window_size -= data.second;
+				m_tuner.received(data.second);
+				m_connection->consume_rate_limit(direction::s2c, data.second, rate_limiter::clock_type::now());
+				m_receive_limit.consume(data.second);
+
+				m_queued = false;
 				receive_data(data.first, data.second);
+
+				// data not queued was handled by a derived class right away
+				if (not m_queued)
+					m_tuner.consumed(data.second);
 			}
 			break;
 
@@ -222,7 +298,11 @@ void channel::process(ipacket &in)
 				std::pair<const char *, size_t> data;
 				in >> type >> data;
 				m_my_window_size -= data.second;
+				m_tuner.received(data.second);
+				m_connection->consume_rate_limit(direction::s2c, data.second, rate_limiter::clock_type::now());
+				m_receive_limit.consume(data.second);
 				receive_extended_data(data.first, data.second, type);
+				m_tuner.consumed(data.second);
 			}
 			break;
 
@@ -254,10 +334,35 @@ void channel::process(ipacket &in)
 			;
 	}
 
-	if (m_channel_open and m_my_window_size < kWindowSize - 2 * kMaxPacketSize)
+	send_window_adjust();
+}
+
+void channel::send_window_adjust()
+{
+	// Only data consumed by the application is credited, data still waiting
+	// in m_received is not. That way m_received never holds more than one
+	// window and a slow reader slows down the server. When the credit is
+	// sent is determined by the connection's window_adjust_policy, the window
+	// may have grown in the mean time.
+	uint32_t adjust = m_connection->get_window_adjust_policy().credit(
+		m_tuner.get_window_size(), m_my_window_size + m_received.size());
+
+	if (m_channel_open and adjust > 0)
 	{
-		uint32_t adjust = kWindowSize - m_my_window_size;
+		// a receive rate limit holds back the credit until the data received
+		// so far has been paid for
+		if (m_receive_paced)
+			return;
+
+		auto delay = get_rate_limit_delay(direction::s2c, rate_limiter::clock_type::now());
+		if (delay.count() > 0)
+		{
+			pace(direction::s2c, delay);
+			return;
+		}
+
 		m_my_window_size += adjust;
+		m_tuner.adjust_sent(adjust);
 
 		opacket out(msg_channel_window_adjust);
 		out << m_host_channel_id << adjust;
@@ -265,6 +370,73 @@ void channel::process(ipacket &in)
 	}
 }
 
+rate_limiter::duration channel::get_rate_limit_delay(direction dir, rate_limiter::time_point now)
+{
+	auto &limit = dir == direction::c2s ? m_send_limit : m_receive_limit;
+	return std::max(limit.delay(now), m_connection->get_rate_limit_delay(dir, now));
+}
+
+void channel::pace(direction dir, rate_limiter::duration delay)
+{
+	auto &timer = dir == direction::c2s ? m_send_timer : m_receive_timer;
+	auto &paced = dir == direction::c2s ? m_send_paced : m_receive_paced;
+
+	paced = true;
+
+	timer.expires_after(delay);
+	timer.async_wait([me = shared_from_this(), dir](const boost::system::error_code &ec)
+		{
+			// cancelled, rate_limits_changed or closed took over
+			if (ec == boost::asio::error::operation_aborted)
+				return;
+
+			if (dir == direction::c2s)
+			{
+				me->m_send_paced = false;
+				if (me->is_open())
+					me->send_pending();
+			}
+			else
+			{
+				me->m_receive_paced = false;
+				if (me->is_open())
+					me->send_window_adjust();
+			} });
+}
+
+void channel::set_send_rate_limit(double bytes_per_second, std::size_t burst)
+{
+	m_send_limit.set_rate(bytes_per_second, burst);
+	rate_limits_changed();
+}
+
+void channel::set_receive_rate_limit(double bytes_per_second, std::size_t burst)
+{
+	m_receive_limit.set_rate(bytes_per_second, burst);
+	rate_limits_changed();
+}
+
+void channel::rate_limits_changed()
+{
+	if (m_send_paced)
+	{
+		m_send_timer.cancel();
+		m_send_paced = false;
+	}
+
+	if (m_receive_paced)
+	{
+		m_receive_timer.cancel();
+		m_receive_paced = false;
+	}
+
+	if (is_open())
+	{
+		send_pending();
+		send_window_adjust();
+	}
+}
+
 void channel::banner(const std::string &msg, const std::string &lang)
 {
 	if (m_banner_handler)
@@ -289,8 +461,15 @@ void channel::handle_channel_request(const std::string &request, ipacket &in, op
 
 void channel::receive_data(const char *data, size_t size)
 {
-	m_received.insert(m_received.end(), data, data + size);
-	get_executor().execute([this]() { push_received(); });
+	if (m_receive_sink)
+	{
+		m_receive_sink({}, data, size);
+		return;
+	}
+
+	m_received.append(data, size);
+	m_queued = true;
+	schedule_push_received();
 }
 
 void channel::receive_extended_data(const char *data, size_t size, uint32_t type)
@@ -301,53 +480,212 @@ void channel::send_pending(const boost::system::error_code &ec)
 {
 	if (ec)
 	{
-		while (not m_write_ops.empty())
-		{
-			auto op = m_write_ops.front();
-			m_write_ops.pop_front();
-			op->complete(ec);
-			delete op;
-		}
-
+		fail_write_ops(ec);
 		close();
 		return;
 	}
 
-	if (not m_write_ops.empty())
+	// Hand out packets as long as the host window allows. A write is split
+	// at the maximum packet size and at the end of the window, the packets
+	// are all in flight at the same time.
+	while (not m_write_ops.empty())
 	{
 		auto op = m_write_ops.front();
 
-		std::size_t size = op->m_packet.size() - 9;
-		if (size <= m_host_window_size)
+		std::size_t n = op->m_size - op->m_offset;
+		if (n > m_max_send_packet_size)
+			n = m_max_send_packet_size;
+		if (n > m_host_window_size)
+			n = m_host_window_size;
+
+		if (n == 0 and op->m_size > 0)
+			break;
+
+		if (m_send_paced)
+			break;
+
+		auto now = rate_limiter::clock_type::now();
+		auto delay = get_rate_limit_delay(direction::c2s, now);
+		if (delay.count() > 0)
 		{
+			pace(direction::c2s, delay);
+			break;
+		}
+
+		m_send_limit.consume(n, now);
+		m_connection->consume_rate_limit(direction::c2s, n, now);
+
+		// the payload is referenced, it is copied only when encrypted
+		opacket out(op->m_message);
+		out << m_host_channel_id;
+		out.reference(op->next(n), op->m_owner);
+
+		++op->m_in_flight;
+		m_host_window_size -= n;
+
+		if (op->all_sent())
 			m_write_ops.pop_front();
 
-			m_host_window_size -= size;
+		std::size_t size = out.size();
 
-			m_connection->async_write(std::move(op->m_packet),
-				[
-					this, op = std::unique_ptr<detail::write_channel_op>(op)
-				]
-				(const boost::system::error_code &ec, std::size_t bytes_transferred)
+		m_connection->schedule_write(m_my_channel_id, m_traffic_class, m_weight, size,
+			[me = shared_from_this(), op, n, out = std::move(out)](const boost::system::error_code &ec) mutable
+			{
+				// cancelled by the scheduler, the channel is closing already
+				if (ec)
 				{
-					op->complete(ec, bytes_transferred);
-					this->send_pending(ec);
-				});
-		}
+					me->packet_written(op, n, ec);
+					return;
+				}
+
+				me->m_connection->async_write(std::move(out),
+					[me, op, n](const boost::system::error_code &ec, std::size_t bytes_transferred)
+					{
+						me->packet_written(op, n, ec);
+
+						if (ec)
+							me->send_pending(ec);
+					});
+			});
 	}
 
 	check_wait();
 }
 
+void channel::packet_written(detail::write_channel_op *op, std::size_t size, const boost::system::error_code &ec)
+{
+	if (ec and not op->m_ec)
+		op->m_ec = ec;
+
+	m_send_queued -= size;
+
+	if (--op->m_in_flight == 0 and op->all_sent())
+	{
+		op->complete(op->m_ec);
+		delete op;
+	}
+
+	if (not ec and is_open())
+	{
+		if (not m_waiting_write_ops.empty() and m_send_queued <= m_send_low_watermark)
+		{
+			accept_write_ops();
+			send_pending();
+		}
+		else
+			check_wait();
+	}
+}
+
+void channel::fail_write_ops(const boost::system::error_code &ec)
+{
+	for (auto op : m_write_ops)
+	{
+		m_send_queued -= op->m_size - op->m_offset;
+
+		if (op->m_in_flight > 0)
+		{
+			// the last packet that is written completes the op
+			op->m_ec = ec;
+			op->m_offset = op->m_size;
+		}
+		else
+		{
+			op->complete(ec);
+			delete op;
+		}
+	}
+
+	m_write_ops.clear();
+
+	for (auto op : m_waiting_write_ops)
+	{
+		op->complete(ec);
+		delete op;
+	}
+
+	m_waiting_write_ops.clear();
+}
+
+void channel::accept_write_ops()
+{
+	while (not m_waiting_write_ops.empty() and m_send_queued < m_send_high_watermark)
+	{
+		auto op = m_waiting_write_ops.front();
+		m_waiting_write_ops.pop_front();
+
+		m_send_queued += op->m_size;
+		m_write_ops.push_back(op);
+	}
+}
+
+void channel::set_send_buffer_limits(std::size_t high_watermark, std::size_t low_watermark)
+{
+	if (low_watermark > high_watermark)
+		low_watermark = high_watermark;
+
+	m_send_high_watermark = high_watermark;
+	m_send_low_watermark = low_watermark;
+
+	if (is_open() and not m_waiting_write_ops.empty() and m_send_queued <= m_send_low_watermark)
+	{
+		accept_write_ops();
+		send_pending();
+	}
+}
+
 void channel::add_read_op(detail::read_channel_op *handler)
 {
 	m_read_ops.push_back(handler);
-	get_executor().execute([this]() { push_received(); });
+	schedule_push_received();
 }
 
 void channel::add_write_op(detail::write_channel_op* op)
 {
-	m_write_ops.push_back(op);
+	// writes are accepted in order, once one has to wait all following do too
+	m_waiting_write_ops.push_back(op);
+	accept_write_ops();
+}
+
+void channel::schedule_push_received()
+{
+	// A single push_received handles all data received in the mean time.
+	// It has to be posted, not executed, otherwise it would run right away
+	// when called from the connection's thread and nothing is batched.
+	if (not m_push_scheduled)
+	{
+		m_push_scheduled = true;
+		boost::asio::post(get_executor(), [self = shared_from_this()]()
+			{
+				self->m_push_scheduled = false;
+				self->push_received(); });
+	}
+}
+
+void channel::consume(std::size_t size)
+{
+	size = std::min(size, m_received.size());
+
+	m_received.consume(size);
+	m_tuner.consumed(size);
+
+	send_window_adjust();
+
+	if (m_received.empty() and m_eof)
+		close();
+}
+
+void channel::set_receive_sink(receive_sink_type sink)
+{
+	m_receive_sink = std::move(sink);
+
+	if (m_receive_sink and not m_received.empty())
+	{
+		for (auto &b : m_received.data())
+			m_receive_sink({}, static_cast<const char *>(b.data()), b.size());
+
+		consume(m_received.size());
+	}
 }
 
 void channel::push_received()
@@ -357,13 +695,14 @@ void channel::push_received()
 		auto handler = m_read_ops.front();
 		m_read_ops.pop_front();
 
-		auto b = handler->transfer_bytes(m_received.begin(), m_received.end());
-		m_received.erase(m_received.begin(), b);
+		m_tuner.consumed(handler->transfer_bytes(m_received));
 
 		handler->complete();
 		delete handler;
 	}
 
+	send_window_adjust();
+
 	if (m_received.empty() and m_eof)
 		close();
 
@@ -399,7 +738,8 @@ void channel::check_wait()
 				break;
 
 			case wait_type::write:
-				if (is_open() and m_host_window_size > 0)
+				if (is_open() and m_host_window_size > 0 and
+					m_waiting_write_ops.empty() and m_send_queued <= m_send_low_watermark)
 				{
 					m_wait_ops.erase(std::find(m_wait_ops.begin(), m_wait_ops.end(), op));
 
@@ -0,0 +1,89 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <pinch/pinch.hpp>
+
+#include <stdexcept>
+
+#include <pinch/channel_table.hpp>
+
+namespace pinch
+{
+
+// The lower kIndexBits of a channel ID are the index of the slot, the upper
+// bits are the generation of the slot. Generations start at one, so the ID
+// is never zero, zero means no ID assigned.
+
+uint32_t channel_table::insert(channel_ptr ch)
+{
+	uint32_t index;
+
+	if (not m_free.empty())
+	{
+		index = m_free.back();
+		m_free.pop_back();
+	}
+	else
+	{
+		if (m_slots.size() > kIndexMask)
+			throw std::runtime_error("Too many channels");
+
+		index = static_cast<uint32_t>(m_slots.size());
+		m_slots.emplace_back();
+	}
+
+	auto &slot = m_slots[index];
+	slot.m_channel = std::move(ch);
+	++m_size;
+
+	return (slot.m_generation << kIndexBits) | index;
+}
+
+bool channel_table::erase(uint32_t id)
+{
+	uint32_t index = id & kIndexMask;
+
+	if (index >= m_slots.size())
+		return false;
+
+	auto &slot = m_slots[index];
+	if (not slot.m_channel or slot.m_generation != id >> kIndexBits)
+		return false;
+
+	slot.m_channel.reset();
+
+	// skip generation zero when wrapping around
+	slot.m_generation = (slot.m_generation + 1) & kGenerationMask;
+	if (slot.m_generation == 0)
+		slot.m_generation = 1;
+
+	m_free.push_back(index);
+	--m_size;
+
+	return true;
+}
+
+channel_ptr channel_table::find(uint32_t id) const
+{
+	uint32_t index = id & kIndexMask;
+
+	if (index < m_slots.size() and m_slots[index].m_generation == id >> kIndexBits)
+		return m_slots[index].m_channel;
+
+	return {};
+}
+
+std::vector<channel_ptr> channel_table::channels() const
+{
+	std::vector<channel_ptr> result;
+	result.reserve(m_size);
+
+	for_each([&result](const channel_ptr &ch)
+		{ result.push_back(ch); });
+
+	return result;
+}
+
+} // namespace pinch
@@ -39,11 +39,23 @@ void basic_connection::userauth_success(const std::string &host_version, const b
 
 	m_crypto_engine.enable_compression();
 
+	// incomming packets can only be handled asynchronously once the handshake is done
+	if (m_crypto_pipeline)
+	{
+		std::weak_ptr<basic_connection> self(shared_from_this());
+
+		m_crypto_engine.decoder().set_pipeline(m_crypto_pipeline, [self]()
+			{
+				if (auto conn = self.lock(); conn)
+					boost::asio::post(conn->get_executor(), [conn]() { conn->process_pipelined(); }); });
+	}
+
 	m_host_version = host_version;
 	m_session_id = session_id;
 	m_private_key_hash = pk_hash;
 
 	// start the read loop
+	m_direct_read = start_direct_read();
 	read_loop();
 
 	// tell all the waiting ops
@@ -60,17 +72,25 @@ void basic_connection::userauth_success(const std::string &host_version, const b
 		delete op;
 	}
 
+	m_handshake_timer.cancel();
+
 	// start keep alive timer, if needed
 	m_last_io = std::chrono::steady_clock::now();
 	if (m_keep_alive_interval > std::chrono::seconds(0))
 		keep_alive_time_out();
+
+	m_idle_since = m_last_io;
+	if (m_idle_timeout > std::chrono::seconds(0))
+		idle_time_out();
+
+	update_state_snapshot();
 }
 
 void basic_connection::handle_error(const boost::system::error_code &ec)
 {
 	if (ec)
 	{
-		for (auto ch : m_channels)
+		for (auto ch : m_channels.channels())
 			ch->error(ec.message(), "");
 
 		close();
@@ -80,24 +100,31 @@ void basic_connection::handle_error(const boost::system::error_code &ec)
 void basic_connection::close()
 {
 	m_auth_state = none;
+	m_direct_read = false;
 	m_private_key_hash.clear();
 	m_session_id.clear();
 	m_crypto_engine.reset();
 
-	m_keep_alive_timer.expires_at(boost::asio::steady_timer::time_point::max());
+	m_keep_alive_timer.cancel();
+	m_idle_timer.cancel();
+	m_handshake_timer.cancel();
 
 	if (m_port_forwarder)
 		m_port_forwarder->connection_closed();
 
-	// copy the list since calling Close will change it
-	std::list<channel_ptr> channels(m_channels);
-	for (auto ch : channels)
+	// take a copy since calling close will change the table
+	for (auto ch : m_channels.channels())
 		ch->close();
+
+	m_scheduler.cancel_all(error::make_error_code(error::connection_lost));
+
+	m_open_snapshot = false;
+	m_channels_open_snapshot = false;
 }
 
 void basic_connection::rekey()
 {
-	m_kex.reset(new key_exchange(m_host_version, m_session_id));
+	m_kex.reset(new key_exchange(m_host_version, m_session_id, get_crypto_profile()));
 	async_write(m_kex->init());
 }
 
@@ -115,27 +142,131 @@ void basic_connection::read_loop(boost::system::error_code ec, std::size_t bytes
 	if (m_auth_state != authenticated)
 		return;
 
+	try
+	{
+		m_response.commit(bytes_transferred);
+
+		if (not process_received())
+		{
+			// the budget is used up, continue after the others had their turn
+			schedule_read_loop();
+			return;
+		}
+
+		// the next layer calls received_direct when more data arrives
+		if (m_direct_read)
+			return;
+
+		// idle until more data arrives, prepare keystream for it
+		m_crypto_engine.decoder().prefetch();
+
+		// read in large blocks, the streambuf reuses its memory
+		const std::size_t kMaxReadSize = 0x100000;
+
+		std::size_t size = m_read_size;
+		if (m_read_size_from_socket)
+			size = std::max(size, std::min(next_layer_available(), kMaxReadSize));
+
+		using namespace std::placeholders;
+		async_read_some(m_response.prepare(size),
+			std::bind(&basic_connection::read_loop, this, _1, _2));
+	}
+	catch (...)
+	{
+		close();
+	}
+}
+
+void basic_connection::schedule_read_loop()
+{
+	// a single read_loop processes all data received in the mean time
+	if (not m_read_scheduled)
+	{
+		m_read_scheduled = true;
+		boost::asio::post(get_executor(), [conn = shared_from_this()]()
+			{
+				conn->m_read_scheduled = false;
+				conn->read_loop(); });
+	}
+}
+
+void basic_connection::received_direct(const boost::system::error_code &ec, const char *data, std::size_t size)
+{
+	if (ec)
+	{
+		boost::asio::post(get_executor(), [conn = shared_from_this(), ec]()
+			{ conn->read_loop(ec); });
+		return;
+	}
+
+	if (not m_direct_read)
+		return;
+
+	m_response.commit(boost::asio::buffer_copy(m_response.prepare(size), boost::asio::buffer(data, size)));
+	schedule_read_loop();
+}
+
+bool basic_connection::process_received()
+{
+	// Hold the packets written while processing, like window adjusts, and
+	// write them all at once afterwards.
+	m_corked = true;
+
+	bool drained = false;
+	std::size_t packets = 0, bytes = 0;
+
 	try
 	{
 		for (;;)
 		{
+			if ((m_read_budget_packets > 0 and packets >= m_read_budget_packets) or
+				(m_read_budget_bytes > 0 and bytes >= m_read_budget_bytes))
+				break;
+
+			boost::system::error_code ec;
 			auto p = m_crypto_engine.get_next_packet(m_response, ec);
 
 			if (ec)
 			{
+				drained = true;
 				handle_error(ec);
 				break;
 			}
 
 			if (not p)
+			{
+				drained = true;
 				break;
+			}
+
+			++packets;
+			bytes += p->size();
 
 			process_packet(*p);
 		}
+	}
+	catch (...)
+	{
+		m_corked = false;
+		throw;
+	}
 
-		using namespace std::placeholders;
-		boost::asio::async_read(*this, m_response, boost::asio::transfer_at_least(1),
-			std::bind(&basic_connection::read_loop, this, _1, _2));
+	m_corked = false;
+	write_next();
+
+	return drained;
+}
+
+void basic_connection::process_pipelined()
+{
+	if (m_auth_state != authenticated)
+		return;
+
+	try
+	{
+		if (not process_received())
+			boost::asio::post(get_executor(), [conn = shared_from_this()]()
+				{ conn->process_pipelined(); });
 	}
 	catch (...)
 	{
@@ -143,6 +274,73 @@ void basic_connection::read_loop(boost::system::error_code ec, std::size_t bytes
 	}
 }
 
+void basic_connection::set_crypto_pipeline(std::shared_ptr<crypto_pipeline> pipeline)
+{
+	m_crypto_pipeline = pipeline;
+	m_crypto_engine.encoder().set_pipeline(pipeline);
+}
+
+void basic_connection::set_max_packet_size(uint32_t size)
+{
+	m_max_packet_size = std::min(size, kMaxPacketSizeLimit);
+	m_crypto_engine.decoder().set_max_packet_size(std::max(m_max_packet_size, kMaxPacketSize));
+}
+
+void basic_connection::queue_write(pending_write &&w)
+{
+	m_write_queue.push_back(std::move(w));
+	write_next();
+}
+
+void basic_connection::write_next()
+{
+	if (m_writing or m_corked or m_write_queue.empty())
+		return;
+
+	m_writing = true;
+
+	// write all queued packets at once, up to a sensible limit
+	const std::size_t kMaxBuffers = 64;
+
+	std::vector<boost::asio::const_buffer> buffers;
+	auto now = std::chrono::steady_clock::now();
+
+	for (auto &w : m_write_queue)
+	{
+		if (buffers.size() == kMaxBuffers)
+			break;
+
+		if (w.m_control)
+			m_scheduler.add_control(w.m_buffer.size(), now - w.m_queued);
+
+		buffers.push_back(w.m_buffer);
+	}
+
+	boost::asio::async_write(*this, buffers,
+		[conn = shared_from_this(), count = buffers.size()](const boost::system::error_code &ec, std::size_t bytes_transferred)
+		{
+			std::vector<pending_write> written;
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				written.push_back(std::move(conn->m_write_queue.front()));
+				conn->m_write_queue.pop_front();
+			}
+
+			conn->m_writing = false;
+
+			for (auto &w : written)
+				w.m_handler(ec, ec ? 0 : w.m_buffer.size());
+
+			conn->write_next();
+		});
+}
+
+void basic_connection::release_scheduled()
+{
+	while (m_write_backlog < m_max_write_backlog and m_scheduler.release_next())
+		;
+}
+
 void basic_connection::process_packet(ipacket &in)
 {
 	// update time for keep alive
@@ -279,9 +477,12 @@ void basic_connection::process_channel_open(ipacket &in, opacket &out)
 
 	if (c)
 	{
+		c->m_my_channel_id = m_channels.insert(c);
+
 		in.message(msg_channel_open_confirmation);
 		c->process(in);
-		m_channels.push_back(c);
+
+		update_state_snapshot();
 	}
 	else
 	{
@@ -302,13 +503,14 @@ void basic_connection::process_channel(ipacket &in)
 		uint32_t channel_id{};
 		in >> channel_id;
 
-		for (channel_ptr c : m_channels)
+		channel_ptr c = m_channels.find(channel_id);
+		if (c)
 		{
-			if (c->my_channel_id() == channel_id)
-			{
-				c->process(in);
-				break;
-			}
+			c->process(in);
+
+			// closing is handled by close_channel
+			if (in == msg_channel_open_confirmation)
+				update_state_snapshot();
 		}
 	}
 	catch (...)
@@ -316,16 +518,12 @@ void basic_connection::process_channel(ipacket &in)
 	}
 }
 
-void basic_connection::open_channel(channel_ptr ch, uint32_t channel_id)
+void basic_connection::open_channel(channel_ptr ch)
 {
-	if (std::find(m_channels.begin(), m_channels.end(), ch) == m_channels.end())
+	if (ch->m_my_channel_id == 0 or m_channels.find(ch->m_my_channel_id) != ch)
 	{
-		// some sanity check first
-		assert(std::find_if(m_channels.begin(), m_channels.end(),
-				   [channel_id](channel_ptr ch) -> bool { return ch->my_channel_id() == channel_id; }) == m_channels.end());
 		assert(not ch->is_open());
-
-		m_channels.push_back(ch);
+		ch->m_my_channel_id = m_channels.insert(ch);
 	}
 
 	if (m_auth_state == authenticated)
@@ -336,74 +534,168 @@ void basic_connection::open_channel(channel_ptr ch, uint32_t channel_id)
 	}
 }
 
+void basic_connection::write_channel_message(uint32_t channel_id, opacket &&out)
+{
+	std::size_t size = out.size();
+
+	outbound_scheduler::release_type release =
+		[this, out = std::move(out)](const boost::system::error_code &ec) mutable
+		{
+			// when cancelled the connection is gone, nothing left to do
+			if (not ec)
+				async_write(std::move(out));
+		};
+
+	if (not m_scheduler.push_behind(channel_id, size, std::move(release)))
+		release({});
+}
+
 void basic_connection::close_channel(channel_ptr ch, uint32_t channel_id)
 {
 	if (ch->is_open())
 	{
+		// the close goes out after the data already scheduled for this
+		// channel, that data is not cancelled
 		if (m_auth_state == authenticated)
 		{
 			opacket out(msg_channel_close);
 			out << channel_id;
-			async_write(std::move(out));
+			write_channel_message(ch->m_my_channel_id, std::move(out));
 		}
 
 		ch->closed();
 	}
 
-	m_channels.erase(
-		std::remove(m_channels.begin(), m_channels.end(), ch),
-		m_channels.end());
+	// the ID may be reused by a new channel from now on
+	if (m_channels.find(ch->m_my_channel_id) == ch)
+	{
+		m_channels.erase(ch->m_my_channel_id);
+		ch->m_my_channel_id = 0;
+
+		if (m_channels.empty())
+			m_idle_since = std::chrono::steady_clock::now();
+	}
+
+	update_state_snapshot();
+}
+
+void basic_connection::set_send_rate_limit(double bytes_per_second, std::size_t burst)
+{
+	m_send_limit.set_rate(bytes_per_second, burst);
+	rate_limits_changed();
+}
+
+void basic_connection::set_receive_rate_limit(double bytes_per_second, std::size_t burst)
+{
+	m_receive_limit.set_rate(bytes_per_second, burst);
+	rate_limits_changed();
+}
+
+void basic_connection::set_rate_limit_group(std::shared_ptr<rate_limit_group> group)
+{
+	m_rate_limit_group = std::move(group);
+	rate_limits_changed();
+}
+
+void basic_connection::rate_limits_changed()
+{
+	m_channels.for_each([](const channel_ptr &ch)
+		{ ch->rate_limits_changed(); });
+}
+
+rate_limiter::duration basic_connection::get_rate_limit_delay(direction dir, rate_limiter::time_point now)
+{
+	rate_limiter::duration result;
+
+	if (dir == direction::c2s)
+	{
+		result = m_send_limit.delay(now);
+		if (m_rate_limit_group)
+			result = std::max(result, m_rate_limit_group->m_send.delay(now));
+	}
+	else
+	{
+		result = m_receive_limit.delay(now);
+		if (m_rate_limit_group)
+			result = std::max(result, m_rate_limit_group->m_receive.delay(now));
+	}
+
+	return result;
+}
+
+void basic_connection::consume_rate_limit(direction dir, std::size_t bytes, rate_limiter::time_point now)
+{
+	if (dir == direction::c2s)
+	{
+		m_send_limit.consume(bytes, now);
+		if (m_rate_limit_group)
+			m_rate_limit_group->m_send.consume(bytes, now);
+	}
+	else
+	{
+		m_receive_limit.consume(bytes, now);
+		if (m_rate_limit_group)
+			m_rate_limit_group->m_receive.consume(bytes, now);
+	}
 }
 
 bool basic_connection::has_open_channels()
 {
 	bool channel_open = false;
 
-	for (auto c : m_channels)
-	{
-		if (c->is_open())
+	m_channels.for_each([&channel_open](const channel_ptr &c)
 		{
-			channel_open = true;
-			break;
-		}
-	}
+			if (c->is_open())
+				channel_open = true; });
 
 	return channel_open;
 }
 
+void basic_connection::update_state_snapshot()
+{
+	m_open_snapshot = is_open();
+	m_channels_open_snapshot = m_open_snapshot and has_open_channels();
+}
+
 void basic_connection::handle_banner(const std::string &message, const std::string &lang)
 {
-	for (auto c : m_channels)
+	for (auto c : m_channels.channels())
 		c->banner(message, lang);
 }
 
 void basic_connection::keep_alive(std::chrono::seconds interval, uint32_t max_timeouts)
 {
-	m_keep_alive_interval = interval;
-	m_max_keep_alive_timeouts = max_timeouts;
+	// the timer_wheel may only be used by the thread running the io_context
+	boost::asio::post(get_executor(), [conn = shared_from_this(), interval, max_timeouts]()
+		{
+			conn->m_keep_alive_interval = interval;
+			conn->m_max_keep_alive_timeouts = max_timeouts;
 
-	m_keep_alive_timer.cancel();
+			conn->m_keep_alive_timer.cancel();
 
-	if (m_keep_alive_interval > std::chrono::seconds(0))
-	{
-		m_keep_alive_timer.expires_after(m_keep_alive_interval);
-		m_keep_alive_timer.async_wait(std::bind(&basic_connection::keep_alive_time_out, this, std::placeholders::_1));
-	}
+			if (conn->m_keep_alive_interval > std::chrono::seconds(0))
+				conn->m_keep_alive_timer.expires_after(conn->m_keep_alive_interval, conn->timer_handler(&basic_connection::keep_alive_time_out));
+		});
 }
 
-void basic_connection::keep_alive_time_out(const boost::system::error_code &ec)
+void basic_connection::keep_alive_time_out()
 {
-	if (ec == boost::asio::error::operation_aborted)
-		return;
-
 	time_point_type now = std::chrono::steady_clock::now();
-	std::chrono::seconds idle = std::chrono::duration_cast<std::chrono::seconds>(now - m_last_io);
+	time_point_type next = now + m_keep_alive_interval;
 
 	// See if we really need to send a packet.
-	if (not ec and idle >= m_keep_alive_interval and is_open())
+	if (is_open())
 	{
-		if (++m_keep_alive_timeouts > m_max_keep_alive_timeouts)
+		if (now - m_last_io < m_keep_alive_interval)
+		{
+			// there was I/O recently, check again one interval after it
+			next = m_last_io + m_keep_alive_interval;
+		}
+		else if (++m_keep_alive_timeouts > m_max_keep_alive_timeouts)
+		{
 			handle_error(error::make_error_code(error::keep_alive_timeout));
+			return;
+		}
 		else
 		{
 			opacket out(msg_global_request);
@@ -413,16 +705,46 @@ void basic_connection::keep_alive_time_out(const boost::system::error_code &ec)
 				if (ec)
 					handle_error(ec);
 			});
-
-			idle = std::chrono::seconds(0);
 		}
 	}
 
 	if (m_keep_alive_interval > std::chrono::seconds(1) and is_open())
-	{
-		m_keep_alive_timer.expires_after(m_keep_alive_interval);
-		m_keep_alive_timer.async_wait(std::bind(&basic_connection::keep_alive_time_out, this, std::placeholders::_1));
-	}
+		m_keep_alive_timer.expires_at(next, timer_handler(&basic_connection::keep_alive_time_out));
+}
+
+void basic_connection::handshake_time_out()
+{
+	if (m_auth_state == handshake)
+		handle_error(boost::asio::error::timed_out);
+}
+
+void basic_connection::set_idle_timeout(std::chrono::seconds timeout)
+{
+	// like keep_alive, the timer is set from the io_context's thread
+	boost::asio::post(get_executor(), [conn = shared_from_this(), timeout]()
+		{
+			conn->m_idle_timeout = timeout;
+
+			conn->m_idle_timer.cancel();
+
+			if (conn->m_idle_timeout > std::chrono::seconds(0) and conn->m_auth_state == authenticated)
+				conn->idle_time_out();
+		});
+}
+
+void basic_connection::idle_time_out()
+{
+	if (not is_open() or m_idle_timeout <= std::chrono::seconds(0))
+		return;
+
+	time_point_type now = std::chrono::steady_clock::now();
+
+	if (not m_channels.empty())
+		m_idle_timer.expires_at(now + m_idle_timeout, timer_handler(&basic_connection::idle_time_out));
+	else if (now - m_idle_since < m_idle_timeout)
+		m_idle_timer.expires_at(m_idle_since + m_idle_timeout, timer_handler(&basic_connection::idle_time_out));
+	else
+		handle_error(error::make_error_code(error::idle_timeout));
 }
 
 void basic_connection::forward_port(uint16_t local_port, const std::string &remote_address, uint16_t remote_port)
@@ -454,6 +776,15 @@ void basic_connection::do_open(std::unique_ptr<detail::open_connection_op> op)
 	{
 		m_auth_state = handshake;
 
+		// do_open may be called from any thread, the timers are set from the io_context's
+		if (m_handshake_timeout > std::chrono::seconds(0))
+		{
+			boost::asio::post(get_executor(), [conn = shared_from_this()]()
+				{
+					if (conn->m_auth_state == handshake)
+						conn->m_handshake_timer.expires_after(conn->m_handshake_timeout, conn->timer_handler(&basic_connection::handshake_time_out)); });
+		}
+
 #if __cpp_impl_coroutine
 		boost::asio::co_spawn(get_executor(), do_handshake(std::move(op)), boost::asio::detached);
 #else
@@ -484,10 +815,34 @@ void basic_connection::do_handshake(std::unique_ptr<detail::open_connection_op>
 		CO_AWAIT async_open_next_layer(YIELD);
 		CO_AWAIT async_wait(wait_type::write, YIELD);
 
-		boost::asio::streambuf buffer;
-		std::ostream os(&buffer);
-		os << kSSHVersionString << "\r\n";
-		CO_AWAIT boost::asio::async_write(*this, buffer, YIELD);
+		// Our kexinit does not depend on the version string of the host, send
+		// it right behind our own version string. When the host is likely to
+		// agree on the algorithms, the first kex packet goes along as well,
+		// saving a round trip.
+		const auto &profile = get_crypto_profile();
+		const std::string server = m_host + ':' + std::to_string(m_port);
+
+		auto kex = std::make_unique<key_exchange>(std::string(), profile);
+		bool guess = key_exchange::guess_likely(server, profile);
+
+		auto version = std::make_shared<std::string>(kSSHVersionString + "\r\n");
+
+		m_corked = true;
+
+		queue_write({ version, boost::asio::buffer(*version),
+			[this](const boost::system::error_code &ec, std::size_t)
+			{
+				if (ec)
+					handle_error(ec);
+			},
+			true, std::chrono::steady_clock::now() });
+
+		async_write(kex->init(guess));
+		if (auto first = kex->first_kex_packet())
+			async_write(std::move(first));
+
+		m_corked = false;
+		write_next();
 
 		CO_AWAIT boost::asio::async_read_until(*this, m_response, "\n", YIELD);
 
@@ -503,8 +858,7 @@ void basic_connection::do_handshake(std::unique_ptr<detail::open_connection_op>
 		if (host_version.substr(0, 7) != "SSH-2.0")
 			throw boost::system::system_error(error::make_error_code(error::protocol_version_not_supported));
 
-		auto kex = std::make_unique<key_exchange>(host_version);
-		async_write(kex->init());
+		kex->set_host_version(host_version);
 
 		CO_AWAIT boost::asio::async_read(*this, m_response, boost::asio::transfer_at_least(8), YIELD);
 
@@ -531,6 +885,9 @@ void basic_connection::do_handshake(std::unique_ptr<detail::open_connection_op>
 			opacket out;
 			if (kex->process(in, out, ec))
 			{
+				if (in == msg_kexinit)
+					kex->remember_server(server);
+
 				if (out)
 					async_write(std::move(out));
 
@@ -746,24 +1103,105 @@ void connection::open_next_layer(std::unique_ptr<detail::wait_connection_op> op)
 	{
 		using namespace boost::asio::ip;
 
-		// synchronous for now...
-		boost::system::error_code ec;
+		if (m_connector)
+			m_connector->cancel();
 
-		tcp::resolver resolver(get_executor());
-		tcp::resolver::results_type endpoints = resolver.resolve(m_host, std::to_string(m_port), ec);
+		m_connector = std::make_shared<tcp_connector>(get_executor(), m_connect_options, m_resolver_cache);
+		m_connector->async_connect(m_host, m_port,
+			[this](tcp::socket &socket)
+			{
+				// some options have to be set before connecting
+				apply_socket_options(socket, false);
+			},
+			[this, self = shared_from_this(), connector = m_connector, op = std::shared_ptr<detail::wait_connection_op>(std::move(op))](const boost::system::error_code &ec, tcp::socket &&socket)
+			{
+				if (m_connector == connector)
+					m_connector.reset();
 
-		if (ec)
-			op->complete(ec);
-		else
-		{
-			boost::asio::async_connect(m_next_layer, endpoints,
-				[self = shared_from_this(), op = std::move(op)](const boost::system::error_code &ec, tcp::resolver::endpoint_type) {
-					op->complete(ec);
-				});
-		}
+				if (not ec)
+				{
+					m_next_layer = std::move(socket);
+					apply_socket_options(m_next_layer, true);
+				}
+
+				op->complete(ec);
+			});
+	}
+}
+
+void connection::close()
+{
+	if (m_connector)
+	{
+		m_connector->cancel();
+		m_connector.reset();
+	}
+
+	basic_stream_connection::close();
+}
+
+void connection::set_socket_options(const socket_options &options)
+{
+	m_socket_options = options;
+
+	if (m_next_layer.is_open())
+	{
+		apply_socket_options(m_next_layer, false);
+		apply_socket_options(m_next_layer, true);
+	}
+}
+
+void connection::apply_socket_options(boost::asio::ip::tcp::socket &socket, bool connected) const
+{
+	using namespace boost::asio;
+
+	boost::system::error_code ec;
+
+	if (not connected)
+	{
+		if (m_socket_options.m_receive_buffer_size > 0)
+			socket.set_option(socket_base::receive_buffer_size(m_socket_options.m_receive_buffer_size), ec);
+
+		if (m_socket_options.m_send_buffer_size > 0)
+			socket.set_option(socket_base::send_buffer_size(m_socket_options.m_send_buffer_size), ec);
+
+#if defined(TCP_FASTOPEN_CONNECT)
+		if (m_socket_options.m_fast_open)
+			socket.set_option(tcp_boolean_option<TCP_FASTOPEN_CONNECT>(true), ec);
+#endif
+	}
+	else
+	{
+		socket.set_option(ip::tcp::no_delay(m_socket_options.m_no_delay), ec);
 	}
 }
 
+void connection::apply_quick_ack()
+{
+#if defined(TCP_QUICKACK)
+	boost::system::error_code ec;
+	if (m_socket_options.m_quick_ack and m_next_layer.is_open())
+		m_next_layer.set_option(tcp_boolean_option<TCP_QUICKACK>(true), ec);
+#endif
+}
+
+void connection::read_next_layer(boost::asio::mutable_buffer buffer, std::unique_ptr<detail::io_connection_op> op)
+{
+	// Quick ack mode is left by the kernel after a while, it is set again
+	// after each read so the data that follows is acknowledged right away too.
+	apply_quick_ack();
+
+	m_next_layer.async_read_some(buffer,
+		[this, op = std::move(op)](const boost::system::error_code &ec, std::size_t bytes_transferred)
+		{
+			// this may be gone when the read was aborted
+			if (not ec)
+				apply_quick_ack();
+
+			op->complete(ec, bytes_transferred);
+		});
+}
+
 // --------------------------------------------------------------------
 
 class proxy_channel : public channel
@@ -823,6 +1261,8 @@ proxied_connection::lowest_layer_type &proxied_connection::lowest_layer()
 
 void proxied_connection::close()
 {
+	m_channel->set_receive_sink({});
+
 	basic_connection::close();
 
 	m_channel->close();
@@ -855,6 +1295,40 @@ void proxied_connection::open_next_layer(std::unique_ptr<detail::wait_connection
 	}
 }
 
+void proxied_connection::read_next_layer(boost::asio::mutable_buffer buffer, std::unique_ptr<detail::io_connection_op> op)
+{
+	m_channel->async_read_some(buffer,
+		[op = std::move(op)](const boost::system::error_code &ec, std::size_t bytes_transferred)
+		{ op->complete(ec, bytes_transferred); });
+}
+
+void proxied_connection::write_next_layer(std::vector<boost::asio::const_buffer> &&buffers, std::unique_ptr<detail::io_connection_op> op)
+{
+	boost::asio::async_write(*m_channel, std::move(buffers),
+		[op = std::move(op)](const boost::system::error_code &ec, std::size_t bytes_transferred)
+		{ op->complete(ec, bytes_transferred); });
+}
+
+void proxied_connection::wait_next_layer(std::unique_ptr<detail::wait_connection_op> op)
+{
+	do_wait(std::move(op));
+}
+
+bool proxied_connection::start_direct_read()
+{
+	// The proxy channel appends its data straight to our receive buffer,
+	// skipping the channel's own receive queue and async_read_some. Flow
+	// control is left to the channels inside this connection.
+	std::weak_ptr<proxied_connection> self(std::static_pointer_cast<proxied_connection>(shared_from_this()));
+
+	m_channel->set_receive_sink([self](const boost::system::error_code &ec, const char *data, std::size_t size)
+		{
+			if (auto conn = self.lock(); conn)
+				conn->received_direct(ec, data, size); });
+
+	return true;
+}
+
 void proxied_connection::do_wait(std::unique_ptr<detail::wait_connection_op> op)
 {
 	assert(m_channel);
@@ -13,7 +13,14 @@ namespace pinch
 // --------------------------------------------------------------------
 
 connection_pool::connection_pool(boost::asio::io_context &io_context)
-	: m_io_context(io_context)
+	: m_io_context(&io_context)
+	, m_resolver_cache(std::make_shared<resolver_cache>())
+{
+}
+
+connection_pool::connection_pool(engine &engine)
+	: m_engine(&engine)
+	, m_resolver_cache(std::make_shared<resolver_cache>())
 {
 }
 
@@ -26,6 +33,8 @@ connection_pool::~connection_pool()
 void connection_pool::register_proxy(const std::string &destination_host, uint16_t destination_port,
 	const std::string &proxy_user, const std::string &proxy_host, uint16_t proxy_port, const std::string &proxy_cmd)
 {
+	std::lock_guard lock(m_mutex);
+
 	proxy p = {destination_host, destination_port, proxy_cmd, proxy_user, proxy_host, proxy_port};
 	proxy_list::iterator pi = find(m_proxies.begin(), m_proxies.end(), p);
 	if (pi == m_proxies.end())
@@ -35,6 +44,13 @@ void connection_pool::register_proxy(const std::string &destination_host, uint16
 }
 
 std::shared_ptr<basic_connection> connection_pool::get(const std::string &user, const std::string &host, uint16_t port)
+{
+	std::lock_guard lock(m_mutex);
+
+	return get_connection(user, host, port);
+}
+
+std::shared_ptr<basic_connection> connection_pool::get_connection(const std::string &user, const std::string &host, uint16_t port)
 {
 	std::shared_ptr<basic_connection> result;
 
@@ -49,10 +65,17 @@ std::shared_ptr<basic_connection> connection_pool::get(const std::string &user,
 
 	if (result == nullptr)
 	{
-		result = std::make_shared<connection>(m_io_context, user, host, port);
+		std::shared_ptr<connection> conn;
+
+		if (m_engine)
+			conn = m_engine->make_connection<connection>(user, host, port);
+		else
+			conn = std::make_shared<connection>(*m_io_context, user, host, port);
 
-		entry e = {user, host, port, result};
-		m_entries.push_back(e);
+		conn->set_resolver_cache(m_resolver_cache);
+		result = conn;
+
+		add_entry(user, host, port, result);
 	}
 
 	return result;
@@ -61,6 +84,8 @@ std::shared_ptr<basic_connection> connection_pool::get(const std::string &user,
 std::shared_ptr<basic_connection> connection_pool::get(const std::string &user, const std::string &host, uint16_t port,
 	const std::string &proxy_user, const std::string &proxy_host, uint16_t proxy_port, const std::string &proxy_cmd)
 {
+	std::lock_guard lock(m_mutex);
+
 	std::shared_ptr<basic_connection> result;
 
 	for (auto &e : m_entries)
@@ -75,35 +100,109 @@ std::shared_ptr<basic_connection> connection_pool::get(const std::string &user,
 
 	if (result == nullptr)
 	{
-		std::shared_ptr<basic_connection> proxy = get(proxy_user, proxy_host, proxy_port);
-
-		if (proxy_cmd.empty())
+		// a proxied connection lives in the same shard as its proxy
+		std::shared_ptr<basic_connection> proxy = get_connection(proxy_user, proxy_host, proxy_port);
+
+		if (m_engine and proxy_cmd.empty())
+			result = m_engine->make_connection_in_shard_of<proxied_connection>(*proxy, proxy, user, host, port);
+		else if (m_engine)
+			result = m_engine->make_connection_in_shard_of<proxied_connection>(*proxy, proxy, proxy_cmd, user, host, port);
+		else if (proxy_cmd.empty())
 			result.reset(new proxied_connection(proxy, user, host, port));
 		else
 			result.reset(new proxied_connection(proxy, proxy_cmd, user, host, port));
 
-		entry e = {user, host, port, result};
-		m_entries.push_back(e);
+		add_entry(user, host, port, result);
 	}
 
 	return result;
 }
 
+void connection_pool::add_entry(const std::string &user, const std::string &host, uint16_t port, std::shared_ptr<basic_connection> connection)
+{
+	if (m_rate_limit_group)
+		connection->set_rate_limit_group(m_rate_limit_group);
+
+	entry e = {user, host, port, connection};
+	m_entries.push_back(e);
+}
+
+void connection_pool::set_resolver_cache(std::shared_ptr<resolver_cache> cache)
+{
+	std::lock_guard lock(m_mutex);
+
+	m_resolver_cache = std::move(cache);
+}
+
+std::shared_ptr<resolver_cache> connection_pool::get_resolver_cache()
+{
+	std::lock_guard lock(m_mutex);
+
+	return m_resolver_cache;
+}
+
+void connection_pool::set_send_rate_limit(double bytes_per_second, std::size_t burst)
+{
+	std::lock_guard lock(m_mutex);
+
+	if (not m_rate_limit_group)
+		m_rate_limit_group = std::make_shared<rate_limit_group>();
+
+	m_rate_limit_group->m_send.set_rate(bytes_per_second, burst);
+	rate_limits_changed();
+}
+
+void connection_pool::set_receive_rate_limit(double bytes_per_second, std::size_t burst)
+{
+	std::lock_guard lock(m_mutex);
+
+	if (not m_rate_limit_group)
+		m_rate_limit_group = std::make_shared<rate_limit_group>();
+
+	m_rate_limit_group->m_receive.set_rate(bytes_per_second, burst);
+	rate_limits_changed();
+}
+
+void connection_pool::rate_limits_changed()
+{
+	// connections should be updated in their own shard
+	for (auto &e : m_entries)
+	{
+		boost::asio::post(e.connection->get_executor(),
+			[conn = e.connection, group = m_rate_limit_group]()
+			{ conn->set_rate_limit_group(group); });
+	}
+}
+
 void connection_pool::disconnect_all()
 {
-	m_io_context.stop();
+	std::lock_guard lock(m_mutex);
+
+	if (m_engine)
+	{
+		// connections should be closed in their own shard
+		for (auto &e : m_entries)
+			boost::asio::post(e.connection->get_executor(), [conn = e.connection]() { conn->close(); });
+	}
+	else
+	{
+		m_io_context->stop();
 
-	for (auto& e: m_entries)
-		e.connection->close();
+		for (auto &e : m_entries)
+			e.connection->close();
+	}
 }
 
 bool connection_pool::has_open_connections()
 {
+	std::lock_guard lock(m_mutex);
+
 	bool connection_open = false;
 
+	// the connections may live in other threads, use their snapshots
 	for (auto &e : m_entries)
 	{
-		if (e.connection->is_open())
+		if (e.connection->is_open_snapshot())
 		{
 			connection_open = true;
 			break;
@@ -115,11 +214,13 @@ bool connection_pool::has_open_connections()
 
 bool connection_pool::has_open_channels()
 {
+	std::lock_guard lock(m_mutex);
+
 	bool channel_open = false;
 
 	for (auto &e : m_entries)
 	{
-		if (e.connection->is_open() and e.connection->has_open_channels())
+		if (e.connection->has_open_channels_snapshot())
 		{
 			channel_open = true;
 			break;
@@ -0,0 +1,243 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <pinch/pinch.hpp>
+
+#include <boost/asio/post.hpp>
+
+#include <pinch/connector.hpp>
+
+namespace pinch
+{
+
+tcp_connector::tcp_connector(const executor_type &executor, const connect_options &options,
+	std::shared_ptr<resolver_cache> cache)
+	: m_executor(executor)
+	, m_options(options)
+	, m_cache(std::move(cache))
+	, m_resolver(executor)
+	, m_delay_timer(executor)
+	, m_timeout_timer(executor)
+{
+}
+
+void tcp_connector::async_connect(const std::string &host, uint16_t port, prepare_type prepare, handler_type handler)
+{
+	m_prepare = std::move(prepare);
+	m_handler = std::move(handler);
+
+	start_timeout();
+
+	if (m_cache)
+	{
+		m_cache->async_resolve(m_executor, host, port,
+			[self = shared_from_this()](const boost::system::error_code &ec, const std::vector<endpoint_type> &endpoints)
+			{ self->resolved(ec, endpoints); });
+	}
+	else
+	{
+		m_resolver.async_resolve(host, std::to_string(port),
+			[self = shared_from_this()](const boost::system::error_code &ec, boost::asio::ip::tcp::resolver::results_type results)
+			{ self->resolved(ec, std::vector<endpoint_type>(results.begin(), results.end())); });
+	}
+}
+
+void tcp_connector::async_connect(const std::vector<endpoint_type> &endpoints, prepare_type prepare, handler_type handler)
+{
+	m_prepare = std::move(prepare);
+	m_handler = std::move(handler);
+
+	start_timeout();
+
+	boost::asio::post(m_executor, [self = shared_from_this(), endpoints]()
+		{
+			if (not self->m_finished)
+				self->connect(endpoints); });
+}
+
+void tcp_connector::cancel()
+{
+	finish(boost::asio::error::operation_aborted, socket_type(m_executor));
+}
+
+std::vector<tcp_connector::endpoint_type> tcp_connector::interleave(const std::vector<endpoint_type> &endpoints)
+{
+	std::vector<endpoint_type> first, second;
+
+	for (auto &ep : endpoints)
+	{
+		if (first.empty() or ep.protocol() == first.front().protocol())
+			first.push_back(ep);
+		else
+			second.push_back(ep);
+	}
+
+	std::vector<endpoint_type> result;
+	result.reserve(endpoints.size());
+
+	for (std::size_t i = 0; i < first.size() or i < second.size(); ++i)
+	{
+		if (i < first.size())
+			result.push_back(first[i]);
+		if (i < second.size())
+			result.push_back(second[i]);
+	}
+
+	return result;
+}
+
+void tcp_connector::start_timeout()
+{
+	if (m_options.m_timeout.count() > 0)
+	{
+		m_timeout_timer.expires_after(m_options.m_timeout);
+		m_timeout_timer.async_wait([self = shared_from_this()](const boost::system::error_code &ec)
+			{
+				if (not ec)
+					self->finish(boost::asio::error::timed_out, socket_type(self->m_executor)); });
+	}
+}
+
+void tcp_connector::resolved(const boost::system::error_code &ec, const std::vector<endpoint_type> &endpoints)
+{
+	if (m_finished)
+		return;
+
+	if (ec)
+		finish(ec, socket_type(m_executor));
+	else
+		connect(endpoints);
+}
+
+void tcp_connector::connect(const std::vector<endpoint_type> &endpoints)
+{
+	m_endpoints = interleave(endpoints);
+
+	if (m_endpoints.empty())
+		finish(boost::asio::error::host_not_found, socket_type(m_executor));
+	else
+		start_next();
+}
+
+void tcp_connector::start_next()
+{
+	if (m_finished)
+		return;
+
+	if (m_attempts.size() == m_endpoints.size())
+	{
+		// all addresses tried, the last one to fail reports the error
+		if (m_active == 0)
+			finish(m_last_error ? m_last_error : boost::asio::error::host_not_found, socket_type(m_executor));
+		return;
+	}
+
+	std::size_t index = m_attempts.size();
+	auto &endpoint = m_endpoints[index];
+	auto &a = *m_attempts.emplace_back(new attempt(m_executor));
+
+	boost::system::error_code ec;
+	a.m_socket.open(endpoint.protocol(), ec);
+
+	if (ec)
+	{
+		// e.g. no IPv6 on this host, try the next address right away
+		m_last_error = ec;
+		start_next();
+		return;
+	}
+
+	if (m_prepare)
+		m_prepare(a.m_socket);
+
+	++m_active;
+
+	a.m_socket.async_connect(endpoint, [self = shared_from_this(), index](const boost::system::error_code &ec)
+		{ self->attempt_done(index, ec); });
+
+	if (m_options.m_attempt_timeout.count() > 0)
+	{
+		a.m_timer.expires_after(m_options.m_attempt_timeout);
+		a.m_timer.async_wait([self = shared_from_this(), index](const boost::system::error_code &ec)
+			{
+				auto &a = *self->m_attempts[index];
+				if (not ec and not self->m_finished)
+				{
+					a.m_timed_out = true;
+
+					boost::system::error_code ignore;
+					a.m_socket.close(ignore);
+				} });
+	}
+
+	// the next address is tried when this one did not answer in time
+	m_delay_timer.expires_after(m_options.m_attempt_delay);
+	m_delay_timer.async_wait([self = shared_from_this(), generation = ++m_generation](const boost::system::error_code &ec)
+		{
+			if (not ec and generation == self->m_generation)
+				self->start_next(); });
+}
+
+void tcp_connector::attempt_done(std::size_t index, boost::system::error_code ec)
+{
+	auto &a = *m_attempts[index];
+
+	a.m_timer.cancel();
+	--m_active;
+
+	if (m_finished)
+		return;
+
+	if (a.m_timed_out)
+		ec = boost::asio::error::timed_out;
+
+	if (not ec)
+	{
+		finish({}, std::move(a.m_socket));
+		return;
+	}
+
+	m_last_error = ec;
+
+	boost::system::error_code ignore;
+	a.m_socket.close(ignore);
+
+	// no need to wait for the attempt delay, try the next address now
+	++m_generation;
+	start_next();
+}
+
+void tcp_connector::finish(const boost::system::error_code &ec, socket_type &&socket)
+{
+	if (m_finished)
+		return;
+
+	m_finished = true;
+
+	// take the socket first, it may be one of the attempts closed below
+	socket_type result(std::move(socket));
+
+	m_resolver.cancel();
+	m_delay_timer.cancel();
+	m_timeout_timer.cancel();
+
+	for (auto &a : m_attempts)
+	{
+		a->m_timer.cancel();
+
+		boost::system::error_code ignore;
+		if (a->m_socket.is_open())
+			a->m_socket.close(ignore);
+	}
+
+	boost::asio::post(m_executor,
+		[handler = std::move(m_handler), ec, socket = std::move(result)]() mutable
+		{
+			if (handler)
+				handler(ec, std::move(socket));
+		});
+}
+
+} // namespace pinch
@@ -0,0 +1,235 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <pinch/pinch.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include <pinch/crypto-backend.hpp>
+
+namespace pinch
+{
+
+// --------------------------------------------------------------------
+// The OpenSSL implementation, using the EVP interface so the assembly
+// implementations are used when available.
+
+namespace
+{
+
+	class openssl_cipher final : public stream_cipher
+	{
+	  public:
+		openssl_cipher(const EVP_CIPHER *cipher, bool random_access, bool encrypt, const uint8_t *key, const uint8_t *iv)
+			: m_ctx(EVP_CIPHER_CTX_new())
+			, m_random_access(random_access)
+		{
+			if (m_ctx == nullptr or
+				EVP_CipherInit_ex(m_ctx, cipher, nullptr, key, iv, encrypt ? 1 : 0) != 1)
+			{
+				EVP_CIPHER_CTX_free(m_ctx);
+				throw std::runtime_error("Failed to initialize cipher");
+			}
+
+			EVP_CIPHER_CTX_set_padding(m_ctx, 0);
+
+			std::memcpy(m_iv, iv, EVP_CIPHER_iv_length(cipher));
+		}
+
+		~openssl_cipher()
+		{
+			EVP_CIPHER_CTX_free(m_ctx);
+		}
+
+		void process(const uint8_t *in, std::size_t len, uint8_t *out) override
+		{
+			// A block cipher would keep a partial block inside EVP and return
+			// less data than it was given, SSH only passes whole blocks.
+			if (not m_random_access and len % EVP_CIPHER_CTX_block_size(m_ctx) != 0)
+				throw std::invalid_argument("Data is not a multiple of the cipher block size");
+
+			// EVP_CipherUpdate takes an int for the length
+			while (len > 0)
+			{
+				int n = static_cast<int>(std::min<std::size_t>(len, 1 << 30)), outl = 0;
+
+				if (EVP_CipherUpdate(m_ctx, out, &outl, in, n) != 1 or outl != n)
+					throw std::runtime_error("Failed to process data");
+
+				in += n;
+				out += n;
+				len -= n;
+			}
+		}
+
+		void seek(uint64_t offset) override
+		{
+			if (not m_random_access)
+				stream_cipher::seek(offset);
+
+			// The counter is the IV as a 128 bit big endian number, add the block
+			// number and skip the remaining bytes of the first block.
+			uint8_t counter[16];
+			std::memcpy(counter, m_iv, sizeof(counter));
+
+			uint64_t block = offset / 16;
+			unsigned carry = 0;
+			for (int i = 15; i >= 0; --i)
+			{
+				unsigned sum = counter[i] + static_cast<unsigned>(block & 0xff) + carry;
+				counter[i] = static_cast<uint8_t>(sum);
+				carry = sum >> 8;
+				block >>= 8;
+			}
+
+			if (EVP_CipherInit_ex(m_ctx, nullptr, nullptr, nullptr, counter, -1) != 1)
+				throw std::runtime_error("Failed to seek in key stream");
+
+			uint8_t skip[16] = {};
+			process(skip, offset % 16, skip);
+		}
+
+	  private:
+		EVP_CIPHER_CTX *m_ctx;
+		bool m_random_access;
+		uint8_t m_iv[EVP_MAX_IV_LENGTH] = {};
+	};
+
+	// --------------------------------------------------------------------
+
+	class openssl_hmac final : public message_authenticator
+	{
+	  public:
+		openssl_hmac(const EVP_MD *md, const uint8_t *key, std::size_t key_size)
+			: m_key(EVP_PKEY_new_raw_private_key(EVP_PKEY_HMAC, nullptr, key, key_size))
+			, m_init(EVP_MD_CTX_new())
+			, m_ctx(EVP_MD_CTX_new())
+			, m_digest_size(EVP_MD_size(md))
+		{
+			if (m_key == nullptr or m_init == nullptr or m_ctx == nullptr or
+				EVP_DigestSignInit(m_init, nullptr, md, nullptr, m_key) != 1)
+			{
+				free();
+				throw std::runtime_error("Failed to initialize MAC");
+			}
+
+			restart();
+		}
+
+		~openssl_hmac()
+		{
+			free();
+		}
+
+		void update(const uint8_t *data, std::size_t len) override
+		{
+			if (EVP_DigestSignUpdate(m_ctx, data, len) != 1)
+				throw std::runtime_error("Failed to update MAC");
+		}
+
+		void final(uint8_t *digest) override
+		{
+			std::size_t len = m_digest_size;
+			if (EVP_DigestSignFinal(m_ctx, digest, &len) != 1)
+				throw std::runtime_error("Failed to finalize MAC");
+
+			restart();
+		}
+
+		bool verify(const uint8_t *signature) override
+		{
+			uint8_t digest[EVP_MAX_MD_SIZE];
+			final(digest);
+			return CRYPTO_memcmp(digest, signature, m_digest_size) == 0;
+		}
+
+		std::size_t digest_size() const override
+		{
+			return m_digest_size;
+		}
+
+	  private:
+		/// Copying the initialized context is a lot cheaper than setting up the key again
+		void restart()
+		{
+			if (EVP_MD_CTX_copy_ex(m_ctx, m_init) != 1)
+				throw std::runtime_error("Failed to reset MAC");
+		}
+
+		void free()
+		{
+			EVP_MD_CTX_free(m_ctx);
+			EVP_MD_CTX_free(m_init);
+			EVP_PKEY_free(m_key);
+		}
+
+		EVP_PKEY *m_key;
+		EVP_MD_CTX *m_init, *m_ctx;
+		std::size_t m_digest_size;
+	};
+
+	// --------------------------------------------------------------------
+
+	template <const EVP_CIPHER *(*Cipher)(), bool RandomAccess>
+	std::unique_ptr<stream_cipher> create_openssl_cipher(bool encrypt, const uint8_t *key, const uint8_t *iv)
+	{
+		return std::make_unique<openssl_cipher>(Cipher(), RandomAccess, encrypt, key, iv);
+	}
+
+	template <const EVP_MD *(*Hash)(), std::size_t KeySize>
+	std::unique_ptr<message_authenticator> create_openssl_hmac(const uint8_t *key)
+	{
+		return std::make_unique<openssl_hmac>(Hash(), key, KeySize);
+	}
+
+	constexpr cipher_descriptor kOpenSSLCiphers[] = {
+		{ "aes128-ctr", 16, 16, 16, true, &create_openssl_cipher<&EVP_aes_128_ctr, true> },
+		{ "aes192-ctr", 24, 16, 16, true, &create_openssl_cipher<&EVP_aes_192_ctr, true> },
+		{ "aes256-ctr", 32, 16, 16, true, &create_openssl_cipher<&EVP_aes_256_ctr, true> },
+		{ "aes128-cbc", 16, 16, 16, false, &create_openssl_cipher<&EVP_aes_128_cbc, false> },
+		{ "aes192-cbc", 24, 16, 16, false, &create_openssl_cipher<&EVP_aes_192_cbc, false> },
+		{ "aes256-cbc", 32, 16, 16, false, &create_openssl_cipher<&EVP_aes_256_cbc, false> },
+		{ "3des-cbc", 24, 8, 8, false, &create_openssl_cipher<&EVP_des_ede3_cbc, false> }
+	};
+
+	constexpr mac_descriptor kOpenSSLMacs[] = {
+		{ "hmac-sha2-512", 64, 64, &create_openssl_hmac<&EVP_sha512, 64> },
+		{ "hmac-sha2-256", 32, 32, &create_openssl_hmac<&EVP_sha256, 32> },
+		{ "hmac-sha1", 20, 20, &create_openssl_hmac<&EVP_sha1, 20> }
+	};
+
+	class openssl_backend_impl : public crypto_backend
+	{
+	  public:
+		std::string name() const override
+		{
+			return "openssl";
+		}
+
+		std::span<const cipher_descriptor> ciphers() const override
+		{
+			return kOpenSSLCiphers;
+		}
+
+		std::span<const mac_descriptor> macs() const override
+		{
+			return kOpenSSLMacs;
+		}
+	};
+
+} // namespace
+
+const crypto_backend &openssl_backend()
+{
+	static const openssl_backend_impl s_instance;
+	return s_instance;
+}
+
+} // namespace pinch
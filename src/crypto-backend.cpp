@@ -0,0 +1,313 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <pinch/pinch.hpp>
+
+#include <list>
+#include <mutex>
+#include <stdexcept>
+
+#include <boost/algorithm/string.hpp>
+
+#include <cryptopp/aes.h>
+#include <cryptopp/cryptlib.h>
+#include <cryptopp/des.h>
+#include <cryptopp/hmac.h>
+#include <cryptopp/modes.h>
+#include <cryptopp/sha.h>
+
+#include <pinch/crypto-backend.hpp>
+
+#ifndef PINCH_CRYPTO_BACKEND_DEFAULT
+#define PINCH_CRYPTO_BACKEND_DEFAULT "cryptopp"
+#endif
+
+namespace ba = boost::algorithm;
+
+namespace pinch
+{
+
+#if PINCH_HAVE_OPENSSL
+/// \brief Defined in crypto-backend-openssl.cpp
+const crypto_backend &openssl_backend();
+#endif
+
+// --------------------------------------------------------------------
+
+void stream_cipher::seek(uint64_t offset)
+{
+	throw std::logic_error("seek is not supported by this cipher");
+}
+
+// --------------------------------------------------------------------
+// The Crypto++ implementation
+
+namespace
+{
+
+	template <typename T>
+	class cryptopp_cipher final : public stream_cipher
+	{
+	  public:
+		cryptopp_cipher(const uint8_t *key, std::size_t key_size, const uint8_t *iv)
+			: m_st(key, key_size, iv)
+		{
+		}
+
+		void process(const uint8_t *in, std::size_t len, uint8_t *out) override
+		{
+			m_st.ProcessData(out, in, len);
+		}
+
+		void seek(uint64_t offset) override
+		{
+			m_st.Seek(offset);
+		}
+
+	  private:
+		T m_st;
+	};
+
+	template <typename Hash>
+	class cryptopp_hmac final : public message_authenticator
+	{
+	  public:
+		cryptopp_hmac(const uint8_t *key, std::size_t key_size)
+			: m_mac(key, key_size)
+		{
+		}
+
+		void update(const uint8_t *data, std::size_t len) override
+		{
+			m_mac.Update(data, len);
+		}
+
+		void final(uint8_t *digest) override
+		{
+			m_mac.Final(digest);
+		}
+
+		bool verify(const uint8_t *signature) override
+		{
+			return m_mac.Verify(signature);
+		}
+
+		std::size_t digest_size() const override
+		{
+			return m_mac.DigestSize();
+		}
+
+	  private:
+		CryptoPP::HMAC<Hash> m_mac;
+	};
+
+	template <template <typename> typename Mode, typename Cipher, std::size_t KeySize>
+	std::unique_ptr<stream_cipher> create_cryptopp_cipher(bool encrypt, const uint8_t *key, const uint8_t *iv)
+	{
+		std::unique_ptr<stream_cipher> result;
+
+		if (encrypt)
+			result = std::make_unique<cryptopp_cipher<typename Mode<Cipher>::Encryption>>(key, KeySize, iv);
+		else
+			result = std::make_unique<cryptopp_cipher<typename Mode<Cipher>::Decryption>>(key, KeySize, iv);
+
+		return result;
+	}
+
+	template <typename Hash, std::size_t KeySize>
+	std::unique_ptr<message_authenticator> create_cryptopp_hmac(const uint8_t *key)
+	{
+		return std::make_unique<cryptopp_hmac<Hash>>(key, KeySize);
+	}
+
+	using CryptoPP::AES;
+	using CryptoPP::CBC_Mode;
+	using CryptoPP::CTR_Mode;
+	using CryptoPP::DES_EDE3;
+
+	constexpr cipher_descriptor kCryptoppCiphers[] = {
+		{ "aes128-ctr", 16, 16, 16, true, &create_cryptopp_cipher<CTR_Mode, AES, 16> },
+		{ "aes192-ctr", 24, 16, 16, true, &create_cryptopp_cipher<CTR_Mode, AES, 24> },
+		{ "aes256-ctr", 32, 16, 16, true, &create_cryptopp_cipher<CTR_Mode, AES, 32> },
+		{ "aes128-cbc", 16, 16, 16, false, &create_cryptopp_cipher<CBC_Mode, AES, 16> },
+		{ "aes192-cbc", 24, 16, 16, false, &create_cryptopp_cipher<CBC_Mode, AES, 24> },
+		{ "aes256-cbc", 32, 16, 16, false, &create_cryptopp_cipher<CBC_Mode, AES, 32> },
+		{ "3des-cbc", 24, 8, 8, false, &create_cryptopp_cipher<CBC_Mode, DES_EDE3, 24> }
+	};
+
+	constexpr mac_descriptor kCryptoppMacs[] = {
+		{ "hmac-sha2-512", 64, 64, &create_cryptopp_hmac<CryptoPP::SHA512, 64> },
+		{ "hmac-sha2-256", 32, 32, &create_cryptopp_hmac<CryptoPP::SHA256, 32> },
+		{ "hmac-sha1", 20, 20, &create_cryptopp_hmac<CryptoPP::SHA1, 20> }
+	};
+
+	class cryptopp_backend : public crypto_backend
+	{
+	  public:
+		std::string name() const override
+		{
+			return "cryptopp";
+		}
+
+		std::span<const cipher_descriptor> ciphers() const override
+		{
+			return kCryptoppCiphers;
+		}
+
+		std::span<const mac_descriptor> macs() const override
+		{
+			return kCryptoppMacs;
+		}
+	};
+
+	const crypto_backend &cryptopp_backend_instance()
+	{
+		static const cryptopp_backend s_instance;
+		return s_instance;
+	}
+
+} // namespace
+
+// --------------------------------------------------------------------
+// The algorithms registered by the application
+
+namespace
+{
+
+	struct registry
+	{
+		std::mutex m_mutex;
+		std::list<cipher_descriptor> m_ciphers; // a list, so pointers stay valid, newest first
+		std::list<mac_descriptor> m_macs;
+
+		static registry &instance()
+		{
+			static registry s_instance;
+			return s_instance;
+		}
+	};
+
+	template <typename Descriptor>
+	const Descriptor *find_descriptor(const std::list<Descriptor> &registered, std::span<const Descriptor> builtin, std::string_view name)
+	{
+		for (auto &d : registered)
+		{
+			if (d.m_name == name)
+				return &d;
+		}
+
+		for (auto &d : builtin)
+		{
+			if (d.m_name == name)
+				return &d;
+		}
+
+		return nullptr;
+	}
+
+	template <typename Descriptor>
+	void register_descriptor(std::list<Descriptor> &registered, const Descriptor &descriptor)
+	{
+		// Descriptors returned by find_descriptor may still be in use, they
+		// are never changed. A new one for the same name goes in front and
+		// is found first from now on.
+		registered.push_front(descriptor);
+	}
+
+	template <typename Known>
+	std::string filter_names(const std::string &names, Known &&known)
+	{
+		std::vector<std::string> result, algs;
+		ba::split(algs, names, ba::is_any_of(","));
+
+		for (auto &alg : algs)
+		{
+			if (known(alg))
+				result.push_back(alg);
+		}
+
+		return ba::join(result, ",");
+	}
+
+} // namespace
+
+const cipher_descriptor *crypto_backend::find_cipher(std::string_view name) const
+{
+	auto &r = registry::instance();
+	std::unique_lock lock(r.m_mutex);
+	return find_descriptor(r.m_ciphers, ciphers(), name);
+}
+
+const mac_descriptor *crypto_backend::find_mac(std::string_view name) const
+{
+	auto &r = registry::instance();
+	std::unique_lock lock(r.m_mutex);
+	return find_descriptor(r.m_macs, macs(), name);
+}
+
+std::string crypto_backend::supported_ciphers(const std::string &names) const
+{
+	return filter_names(names, [this](const std::string &name)
+		{ return find_cipher(name) != nullptr; });
+}
+
+std::string crypto_backend::supported_macs(const std::string &names) const
+{
+	return filter_names(names, [this](const std::string &name)
+		{ return find_mac(name) != nullptr; });
+}
+
+void crypto_backend::register_cipher(const cipher_descriptor &cipher)
+{
+	auto &r = registry::instance();
+	std::unique_lock lock(r.m_mutex);
+	register_descriptor(r.m_ciphers, cipher);
+}
+
+void crypto_backend::register_mac(const mac_descriptor &mac)
+{
+	auto &r = registry::instance();
+	std::unique_lock lock(r.m_mutex);
+	register_descriptor(r.m_macs, mac);
+}
+
+// --------------------------------------------------------------------
+
+const crypto_backend &crypto_backend::instance()
+{
+	static const crypto_backend &s_instance = []() -> const crypto_backend &
+	{
+		auto backend = get(PINCH_CRYPTO_BACKEND_DEFAULT);
+		return backend ? *backend : cryptopp_backend_instance();
+	}();
+
+	return s_instance;
+}
+
+const crypto_backend *crypto_backend::get(const std::string &name)
+{
+	const crypto_backend *result = nullptr;
+
+	if (name == "cryptopp")
+		result = &cryptopp_backend_instance();
+#if PINCH_HAVE_OPENSSL
+	else if (name == "openssl")
+		result = &openssl_backend();
+#endif
+
+	return result;
+}
+
+std::vector<std::string> crypto_backend::available()
+{
+	return {
+		"cryptopp",
+#if PINCH_HAVE_OPENSSL
+		"openssl"
+#endif
+	};
+}
+
+} // namespace pinch
@@ -7,18 +7,11 @@
 #include <pinch/error.hpp>
 #include <pinch/pinch.hpp>
 
-#include <boost/iostreams/filtering_stream.hpp>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
 
-#include <cryptopp/aes.h>
-#include <cryptopp/cryptlib.h>
-#include <cryptopp/des.h>
-#include <cryptopp/factory.h>
-#include <cryptopp/files.h>
-#include <cryptopp/filters.h>
-#include <cryptopp/gfpcrypt.h>
-#include <cryptopp/modes.h>
-#include <cryptopp/osrng.h>
-#include <cryptopp/rsa.h>
+#include <boost/iostreams/filtering_stream.hpp>
 
 namespace io = boost::iostreams;
 
@@ -29,9 +22,74 @@ namespace pinch
 
 struct TransformDataImpl
 {
-	std::unique_ptr<CryptoPP::StreamTransformation> m_stream_transformation;
+	const cipher_descriptor &m_descriptor;
+	std::unique_ptr<stream_cipher> m_cipher;
+
+	// Keystream cache, only used in CTR mode. The cipher is
+	// then used to generate keystream ahead of the data, in a ring buffer.
+	blob m_keystream;
+	std::size_t m_head = 0, m_available = 0;
+	std::size_t m_cache_size = 0; ///< zero means the keystream left in m_keystream is only used up
+
+	/// \brief Release m_keystream once the cache is off and used up
+	void release_drained();
+
+	void fill(std::size_t max_bytes);
 };
 
+void TransformDataImpl::fill(std::size_t max_bytes)
+{
+	const std::size_t size = m_keystream.size();
+
+	while (m_available < size and max_bytes > 0)
+	{
+		// generate contiguous chunks, in as few calls as possible
+		std::size_t tail = (m_head + m_available) % size;
+		std::size_t n = std::min({ size - m_available, size - tail, max_bytes });
+
+		std::fill(m_keystream.begin() + tail, m_keystream.begin() + tail + n, 0);
+		m_cipher->process(m_keystream.data() + tail, n, m_keystream.data() + tail);
+
+		m_available += n;
+		max_bytes -= n;
+	}
+}
+
+void TransformDataImpl::release_drained()
+{
+	if (m_cache_size == 0 and m_available == 0 and not m_keystream.empty())
+	{
+		m_keystream = blob();
+		m_head = 0;
+	}
+}
+
+namespace
+{
+
+	/// \brief out = in ^ keystream, a word at a time so the compiler can vectorize this
+	void xor_keystream(const uint8_t *in, const uint8_t *keystream, std::size_t len, uint8_t *out)
+	{
+		while (len >= sizeof(uint64_t))
+		{
+			uint64_t a, b;
+			std::memcpy(&a, in, sizeof(a));
+			std::memcpy(&b, keystream, sizeof(b));
+			a ^= b;
+			std::memcpy(out, &a, sizeof(a));
+
+			in += sizeof(uint64_t);
+			keystream += sizeof(uint64_t);
+			out += sizeof(uint64_t);
+			len -= sizeof(uint64_t);
+		}
+
+		while (len-- > 0)
+			*out++ = *in++ ^ *keystream++;
+	}
+
+} // namespace
+
 TransformData::~TransformData()
 {
 	delete m_impl;
@@ -43,67 +101,128 @@ void TransformData::clear()
 	m_impl = nullptr;
 }
 
-void TransformData::reset_encryptor(const std::string &name, const uint8_t *key, const uint8_t *iv)
+void TransformData::reset_encryptor(const std::string &name, const uint8_t *key, const uint8_t *iv, const crypto_backend &backend)
 {
 	clear();
 
-	if (name == "3des-cbc")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CBC_Mode<CryptoPP::DES_EDE3>::Encryption>(key, 24, iv) };
-	else if (name == "aes128-cbc")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption>(key, 16, iv) };
-	else if (name == "aes192-cbc")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption>(key, 24, iv) };
-	else if (name == "aes256-cbc")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption>(key, 32, iv) };
-	else if (name == "aes128-ctr")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption>(key, 16, iv) };
-	else if (name == "aes192-ctr")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption>(key, 24, iv) };
-	else if (name == "aes256-ctr")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption>(key, 32, iv) };
-	else
-		assert(false);
+	auto descriptor = backend.find_cipher(name);
+	if (descriptor == nullptr)
+		throw std::invalid_argument("Unsupported cipher " + name);
+
+	m_impl = new TransformDataImpl{ *descriptor, descriptor->m_create(true, key, iv) };
 }
 
-void TransformData::reset_decryptor(const std::string &name, const uint8_t *key, const uint8_t *iv)
+void TransformData::reset_decryptor(const std::string &name, const uint8_t *key, const uint8_t *iv, const crypto_backend &backend)
 {
 	clear();
 
-	if (name == "3des-cbc")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CBC_Mode<CryptoPP::DES_EDE3>::Decryption>(key, 24, iv) };
-	else if (name == "aes128-cbc")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption>(key, 16, iv) };
-	else if (name == "aes192-cbc")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption>(key, 24, iv) };
-	else if (name == "aes256-cbc")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption>(key, 32, iv) };
-	else if (name == "aes128-ctr")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption>(key, 16, iv) };
-	else if (name == "aes192-ctr")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption>(key, 24, iv) };
-	else if (name == "aes256-ctr")
-		m_impl = new TransformDataImpl { std::make_unique<CryptoPP::CTR_Mode<CryptoPP::AES>::Decryption>(key, 32, iv) };
-	else
-		assert(false);
+	auto descriptor = backend.find_cipher(name);
+	if (descriptor == nullptr)
+		throw std::invalid_argument("Unsupported cipher " + name);
+
+	m_impl = new TransformDataImpl{ *descriptor, descriptor->m_create(false, key, iv) };
 }
 
 void TransformData::process(const uint8_t *in, std::size_t len, uint8_t *out)
 {
 	assert(m_impl);
-	assert(m_impl->m_stream_transformation);
-	m_impl->m_stream_transformation->ProcessData(out, in, len);
+	assert(m_impl->m_cipher);
+
+	auto &impl = *m_impl;
+	const std::size_t size = impl.m_keystream.size();
+
+	while (len > 0 and size > 0)
+	{
+		// Large chunks are better off using the cipher directly, the keystream
+		// position is kept in sync since the generator is the same object.
+		if (impl.m_available == 0)
+		{
+			if (len >= size or impl.m_cache_size == 0)
+				break;
+
+			impl.fill(size);
+		}
+
+		std::size_t n = std::min({ len, impl.m_available, size - impl.m_head });
+
+		xor_keystream(in, impl.m_keystream.data() + impl.m_head, n, out);
+
+		impl.m_head = (impl.m_head + n) % size;
+		impl.m_available -= n;
+
+		in += n;
+		out += n;
+		len -= n;
+	}
+
+	impl.release_drained();
+
+	if (len > 0)
+		impl.m_cipher->process(in, len, out);
 }
 
 std::size_t TransformData::get_block_size() const
 {
-	return m_impl->m_stream_transformation->OptimalBlockSize();
+	return m_impl->m_descriptor.m_block_size;
+}
+
+bool TransformData::is_random_access() const
+{
+	return m_impl != nullptr and m_impl->m_descriptor.m_random_access;
+}
+
+void TransformData::seek(uint64_t offset)
+{
+	assert(is_random_access());
+	m_impl->m_cipher->seek(offset);
+	m_impl->m_head = m_impl->m_available = 0;
+	m_impl->release_drained();
+}
+
+void TransformData::set_keystream_cache(std::size_t size)
+{
+	if (not is_random_access())
+		return;
+
+	// round up to whole blocks, the generator works per block
+	std::size_t blocksize = get_block_size();
+	size = (size + blocksize - 1) / blocksize * blocksize;
+
+	if (m_impl->m_available > 0)
+	{
+		// keep the keystream already generated, it cannot be generated again
+		blob keystream(std::max(size, m_impl->m_available));
+		for (std::size_t i = 0; i < m_impl->m_available; ++i)
+			keystream[i] = m_impl->m_keystream[(m_impl->m_head + i) % m_impl->m_keystream.size()];
+		std::swap(keystream, m_impl->m_keystream);
+	}
+	else
+		m_impl->m_keystream = blob(size);
+
+	m_impl->m_head = 0;
+
+	// with a size of zero the keystream still buffered is used up first,
+	// process releases the buffer after that
+	m_impl->m_cache_size = size;
+	m_impl->release_drained();
+}
+
+void TransformData::prefetch(std::size_t max_bytes)
+{
+	if (m_impl != nullptr and m_impl->m_cache_size > 0)
+		m_impl->fill(max_bytes);
+}
+
+std::size_t TransformData::get_keystream_available() const
+{
+	return m_impl != nullptr ? m_impl->m_available : 0;
 }
 
 // --------------------------------------------------------------------
 
 struct MessageAuthenticationCodeImpl
 {
-	std::unique_ptr<CryptoPP::MessageAuthenticationCode> m_verify;
+	std::unique_ptr<message_authenticator> m_verify;
 };
 
 MessageAuthenticationCode::~MessageAuthenticationCode()
@@ -117,33 +236,35 @@ void MessageAuthenticationCode::clear()
 	m_impl = nullptr;
 }
 
-void MessageAuthenticationCode::reset(const std::string &name, const uint8_t *iv)
+void MessageAuthenticationCode::reset(const std::string &name, const uint8_t *iv, const crypto_backend &backend)
 {
 	clear();
 
-	if (name == "hmac-sha2-512")
-		m_impl = new MessageAuthenticationCodeImpl{ std::make_unique<CryptoPP::HMAC<CryptoPP::SHA512>>(iv, 64) };
-	else if (name == "hmac-sha2-256")
-		m_impl = new MessageAuthenticationCodeImpl{ std::make_unique<CryptoPP::HMAC<CryptoPP::SHA256>>(iv, 32) };
-	else if (name == "hmac-sha1")
-		m_impl = new MessageAuthenticationCodeImpl{ std::make_unique<CryptoPP::HMAC<CryptoPP::SHA1>>(iv, 20) };
-	else
-		assert(false);
+	auto descriptor = backend.find_mac(name);
+	if (descriptor == nullptr)
+		throw std::invalid_argument("Unsupported MAC " + name);
+
+	m_impl = new MessageAuthenticationCodeImpl{ descriptor->m_create(iv) };
 }
 
 void MessageAuthenticationCode::update(const uint8_t *data, std::size_t len)
 {
-	m_impl->m_verify->Update(data, len);
+	m_impl->m_verify->update(data, len);
 }
 
 bool MessageAuthenticationCode::verify(const uint8_t *signature)
 {
-	return m_impl->m_verify->Verify(signature);
+	return m_impl->m_verify->verify(signature);
+}
+
+void MessageAuthenticationCode::final(uint8_t *digest)
+{
+	m_impl->m_verify->final(digest);
 }
 
 std::size_t MessageAuthenticationCode::get_digest_size() const
 {
-	return m_impl->m_verify->DigestSize();
+	return m_impl->m_verify->digest_size();
 }
 
 // --------------------------------------------------------------------
@@ -155,8 +276,7 @@ struct packet_encryptor
 	{
 	};
 
-	packet_encryptor(CryptoPP::StreamTransformation &cipher,
-	                 CryptoPP::MessageAuthenticationCode &signer, uint32_t blocksize, uint32_t seq_nr)
+	packet_encryptor(TransformData &cipher, MessageAuthenticationCode &signer, uint32_t blocksize, uint32_t seq_nr)
 		: m_cipher(cipher)
 		, m_signer(signer)
 		, m_blocksize(blocksize)
@@ -165,44 +285,28 @@ struct packet_encryptor
 		for (int i = 3; i >= 0; --i)
 		{
 			uint8_t ch = static_cast<uint8_t>(seq_nr >> (i * 8));
-			m_signer.Update(&ch, 1);
+			m_signer.update(&ch, 1);
 		}
-
-		m_block.reserve(m_blocksize);
 	}
 
 	template <typename Sink>
 	std::streamsize write(Sink &sink, const char *s, std::streamsize n)
 	{
-		std::streamsize result = 0;
-
-		for (std::streamsize o = 0; o < n; o += m_blocksize)
-		{
-			size_t k = n;
-			if (k > m_blocksize - m_block.size())
-				k = m_blocksize - m_block.size();
-
-			const uint8_t *sp = reinterpret_cast<const uint8_t *>(s);
-
-			m_signer.Update(sp, static_cast<size_t>(k));
-			m_block.insert(m_block.end(), sp, sp + k);
-
-			result += k;
-			s += k;
-
-			if (m_block.size() == m_blocksize)
-			{
-				blob block(m_blocksize);
-				m_cipher.ProcessData(block.data(), m_block.data(), m_blocksize);
+		const uint8_t *sp = reinterpret_cast<const uint8_t *>(s);
 
-				for (uint32_t i = 0; i < m_blocksize; ++i)
-					io::put(sink, block[i]);
+		m_signer.update(sp, static_cast<size_t>(n));
+		m_block.insert(m_block.end(), sp, sp + n);
 
-				m_block.clear();
-			}
+		// encrypt all whole blocks in one go
+		std::size_t k = m_block.size() - m_block.size() % m_blocksize;
+		if (k > 0)
+		{
+			m_cipher.process(m_block.data(), k, m_block.data());
+			io::write(sink, reinterpret_cast<const char *>(m_block.data()), k);
+			m_block.erase(m_block.begin(), m_block.begin() + k);
 		}
 
-		return result;
+		return n;
 	}
 
 	template <typename Sink>
@@ -212,10 +316,9 @@ struct packet_encryptor
 		{
 			assert(m_block.size() == 0);
 
-			blob digest(m_signer.DigestSize());
-			m_signer.Final(digest.data());
-			for (size_t i = 0; i < digest.size(); ++i)
-				io::put(sink, digest[i]);
+			blob digest(m_signer.get_digest_size());
+			m_signer.final(digest.data());
+			io::write(sink, reinterpret_cast<const char *>(digest.data()), digest.size());
 
 			m_flushed = true;
 		}
@@ -223,8 +326,8 @@ struct packet_encryptor
 		return true;
 	}
 
-	CryptoPP::StreamTransformation &m_cipher;
-	CryptoPP::MessageAuthenticationCode &m_signer;
+	TransformData &m_cipher;
+	MessageAuthenticationCode &m_signer;
 	blob m_block;
 	uint32_t m_blocksize;
 	bool m_flushed;
@@ -232,161 +335,357 @@ struct packet_encryptor
 
 // --------------------------------------------------------------------
 
-crypto_engine::crypto_engine()
-{
-}
+/// \brief Simple sink appending to a blob
 
-void crypto_engine::newkeys(key_exchange &kex, bool authenticated)
+struct blob_sink
 {
-	using namespace CryptoPP;
+	typedef char char_type;
+	typedef io::sink_tag category;
 
-	// Client to server encryption
-	m_alg_enc_c2s = kex.get_encryption_protocol(direction::c2s);
+	blob_sink(blob &data)
+		: m_data(data)
+	{
+	}
 
-	const uint8_t *key = kex.key(key_exchange::C);
-	const uint8_t *iv = kex.key(key_exchange::A);
+	std::streamsize write(const char *s, std::streamsize n)
+	{
+		m_data.insert(m_data.end(), reinterpret_cast<const uint8_t *>(s), reinterpret_cast<const uint8_t *>(s) + n);
+		return n;
+	}
 
-	m_encryptor.reset_encryptor(m_alg_enc_c2s, key, iv);
+	blob &m_data;
+};
 
-	// Server to client encryption
-	m_alg_enc_s2c = kex.get_encryption_protocol(direction::s2c);
+// --------------------------------------------------------------------
 
-	key = kex.key(key_exchange::D);
-	iv = kex.key(key_exchange::B);
+crypto_direction::crypto_direction(bool outgoing)
+	: m_outgoing(outgoing)
+{
+}
 
-	m_decryptor.reset_decryptor(m_alg_enc_s2c, key, iv);
+crypto_direction::~crypto_direction()
+{
+	delete m_pending_keys.exchange(nullptr);
+}
 
-	// Client To Server verification
-	m_alg_ver_c2s = kex.get_verification_protocol(direction::c2s);
-	iv = kex.key(key_exchange::E);
+void crypto_direction::newkeys(std::unique_ptr<crypto_keys> keys)
+{
+	delete m_pending_keys.exchange(keys.release(), std::memory_order_acq_rel);
+}
 
-	m_signer.reset(m_alg_ver_c2s, iv);
+void crypto_direction::enable_compression()
+{
+	m_pending_compression.store(true, std::memory_order_release);
+}
 
-	// Server to Client verification
+void crypto_direction::update()
+{
+	std::shared_ptr<const crypto_keys> keys(m_pending_keys.exchange(nullptr, std::memory_order_acq_rel));
 
-	m_alg_ver_s2c = kex.get_verification_protocol(direction::s2c);
-	iv = kex.key(key_exchange::F);
+	if (keys)
+	{
+		if (m_outgoing)
+			m_cipher.reset_encryptor(keys->m_enc, keys->m_key.data(), keys->m_iv.data());
+		else
+			m_cipher.reset_decryptor(keys->m_enc, keys->m_key.data(), keys->m_iv.data());
 
-	m_verifier.reset(m_alg_ver_s2c, iv);
+		m_mac.reset(keys->m_ver, keys->m_mac_key.data());
 
-	// Client to Server compression
-	m_alg_cmp_c2s = kex.get_compression_protocol(direction::c2s);
-	if ((not m_compressor and m_alg_cmp_c2s == "zlib") or (authenticated and m_alg_cmp_c2s == "zlib@openssh.com"))
-		m_compressor.reset(new compression_helper(true));
-	else if (m_alg_cmp_c2s == "zlib@openssh.com")
-		m_delay_compressor = true;
+		if ((not m_compressor and keys->m_cmp == "zlib") or (keys->m_authenticated and keys->m_cmp == "zlib@openssh.com"))
+			m_compressor.reset(new compression_helper(m_outgoing));
+		else if (keys->m_cmp == "zlib@openssh.com")
+			m_delay_compressor = true;
 
-	// Server to Client compression
-	m_alg_cmp_s2c = kex.get_compression_protocol(direction::s2c);
-	if ((not m_decompressor and m_alg_cmp_s2c == "zlib") or (authenticated and m_alg_cmp_s2c == "zlib@openssh.com"))
-		m_decompressor.reset(new compression_helper(false));
-	else if (m_alg_cmp_c2s == "zlib@openssh.com")
-		m_delay_decompressor = true;
+		m_blocksize = m_cipher.get_block_size();
+		m_offset = 0;
+		m_keys = std::move(keys);
 
-	if (m_decryptor)
+		if (m_keystream_cache > 0)
+			m_cipher.set_keystream_cache(m_keystream_cache);
+	}
+
+	if (m_pending_compression.exchange(false, std::memory_order_acquire) and m_delay_compressor)
 	{
-		m_iblocksize = m_decryptor.get_block_size();
-		m_oblocksize = m_encryptor.get_block_size();
+		m_compressor.reset(new compression_helper(m_outgoing));
+		m_delay_compressor = false;
 	}
 }
 
-void crypto_engine::reset()
+void crypto_direction::reset()
 {
-	m_packet.reset();
-	m_encryptor.clear();
-	m_decryptor.clear();
-	m_signer.clear();
-	m_verifier.clear();
+	delete m_pending_keys.exchange(nullptr);
+	m_pending_compression = false;
+
+	m_cipher.clear();
+	m_mac.clear();
 	m_compressor.reset(nullptr);
-	m_decompressor.reset(nullptr);
-	m_delay_decompressor = m_delay_compressor = false;
-	m_in_seq_nr = m_out_seq_nr = 0;
-	m_iblocksize = m_oblocksize = 8;
+	m_delay_compressor = false;
+	m_seq_nr = 0;
+	m_offset = 0;
+	m_blocksize = 8;
+	m_keys.reset();
+
+	if (m_pipeline)
+		m_lane = m_pipeline->make_lane();
+}
 
-	m_alg_kex.clear();
-	m_alg_enc_c2s.clear();
-	m_alg_ver_c2s.clear();
-	m_alg_cmp_c2s.clear();
-	m_alg_enc_s2c.clear();
-	m_alg_ver_s2c.clear();
-	m_alg_cmp_s2c.clear();
+void crypto_direction::set_keystream_cache(std::size_t size)
+{
+	m_keystream_cache = size;
+
+	if (m_cipher)
+		m_cipher.set_keystream_cache(size);
 }
 
-std::string crypto_engine::get_connection_parameters(direction dir) const
+void crypto_direction::prefetch()
 {
-	std::string result;
+	if (m_cipher and not m_lane)
+		m_cipher.prefetch();
+}
 
-	if (dir == direction::c2s)
-	{
-		result = m_alg_enc_c2s + '/' + m_alg_ver_c2s;
+bool crypto_direction::can_offload() const
+{
+	return m_lane and m_cipher.is_random_access() and m_mac and not m_compressor and not m_delay_compressor;
+}
 
-		if (m_alg_cmp_c2s != "none")
-			result = result + '/' + m_alg_cmp_c2s;
+// --------------------------------------------------------------------
+
+/// \brief The packets completed by the pipeline, shared with the jobs in flight
+
+struct crypto_ready_queue
+{
+	std::mutex m_mutex;
+	std::deque<std::unique_ptr<ipacket>> m_packets;
+	boost::system::error_code m_ec;
+	std::size_t m_in_flight = 0;
+	std::function<void()> m_notify;
+};
+
+void crypto_decoder::reset()
+{
+	crypto_direction::reset();
+	m_packet.reset();
+	m_header.clear();
+	m_packet_size = 0;
+	m_stalled = false;
+
+	if (m_ready)
+	{
+		auto ready = std::make_shared<crypto_ready_queue>();
+		ready->m_notify = m_ready->m_notify;
+		m_ready = ready;
 	}
-	else
+}
+
+void crypto_decoder::set_pipeline(std::shared_ptr<crypto_pipeline> pipeline, std::function<void()> notify)
+{
+	assert(not m_packet);
+
+	m_pipeline = std::move(pipeline);
+	m_lane.reset();
+	m_ready.reset();
+
+	if (m_pipeline)
 	{
-		result = m_alg_enc_s2c + '/' + m_alg_ver_s2c;
+		m_lane = m_pipeline->make_lane();
+		m_ready = std::make_shared<crypto_ready_queue>();
+		m_ready->m_notify = std::move(notify);
+	}
+}
 
-		if (m_alg_cmp_s2c != "none")
-			result = result + '/' + m_alg_cmp_s2c;
+std::unique_ptr<ipacket> crypto_decoder::pop_ready(boost::system::error_code &ec)
+{
+	std::unique_ptr<ipacket> result;
+
+	std::lock_guard lock(m_ready->m_mutex);
+
+	if (not m_ready->m_packets.empty())
+	{
+		result = std::move(m_ready->m_packets.front());
+		m_ready->m_packets.pop_front();
 	}
+	else if (m_ready->m_ec)
+		ec = m_ready->m_ec;
 
 	return result;
 }
 
-std::string crypto_engine::get_key_exchange_algorithm() const
+void crypto_decoder::offload(boost::asio::streambuf &buffer)
 {
-	return m_alg_kex;
+	const std::size_t digest_size = m_mac.get_digest_size();
+
+	while (not m_stalled)
+	{
+		// decrypt the first block ourselves, we need the length
+		if (m_header.empty())
+		{
+			if (buffer.size() < m_blocksize)
+				break;
+
+			m_header.resize(m_blocksize);
+			buffer.sgetn(reinterpret_cast<char *>(m_header.data()), m_blocksize);
+
+			m_cipher.seek(m_offset);
+			m_cipher.process(m_header.data(), m_blocksize, m_header.data());
+
+			uint32_t length = 0;
+			for (int i = 0; i < 4; ++i)
+				length = length << 8 | m_header[i];
+
+			m_packet_size = length + 4;
+
+			if (length > m_max_packet_size + 32 or m_packet_size < m_blocksize or m_packet_size % m_blocksize != 0)
+				throw packet_exception();
+		}
+
+		if (buffer.size() < m_packet_size - m_blocksize + digest_size)
+			break;
+
+		crypto_pipeline::job job;
+		job.m_type = crypto_pipeline::job_type::decrypt;
+		job.m_keys = m_keys;
+		job.m_seq_nr = m_seq_nr++;
+		job.m_offset = m_offset;
+		job.m_skip = m_blocksize;
+
+		job.m_data = std::move(m_header);
+		job.m_data.resize(m_packet_size + digest_size);
+		buffer.sgetn(reinterpret_cast<char *>(job.m_data.data() + m_blocksize), m_packet_size - m_blocksize + digest_size);
+
+		m_offset += m_packet_size;
+		m_header.clear();
+
+		// Packets following a newkeys use keys we do not know yet
+		if (job.m_data[5] == msg_newkeys)
+			m_stalled = true;
+
+		job.m_handler = [ready = m_ready, max_packet_size = m_max_packet_size](crypto_pipeline::job &&job)
+		{
+			std::unique_lock lock(ready->m_mutex);
+
+			--ready->m_in_flight;
+
+			if (ready->m_ec)
+				return;
+
+			if (not job.m_verified)
+				ready->m_ec = error::make_error_code(error::mac_error);
+			else
+			{
+				try
+				{
+					auto p = std::make_unique<ipacket>(job.m_seq_nr);
+					p->append(job.m_data, max_packet_size);
+					ready->m_packets.push_back(std::move(p));
+				}
+				catch (const packet_exception &)
+				{
+					ready->m_ec = error::make_error_code(error::protocol_error);
+				}
+			}
+
+			auto notify = ready->m_notify;
+			lock.unlock();
+
+			if (notify)
+				notify();
+		};
+
+		{
+			std::lock_guard lock(m_ready->m_mutex);
+			++m_ready->m_in_flight;
+		}
+
+		m_pipeline->submit(m_lane, std::move(job));
+	}
 }
 
-blob crypto_engine::get_next_block(boost::asio::streambuf &buffer, bool empty)
+blob crypto_decoder::get_next_block(boost::asio::streambuf &buffer, bool empty)
 {
-	blob block(m_iblocksize);
-	buffer.sgetn(reinterpret_cast<char *>(block.data()), m_iblocksize);
+	blob block(m_blocksize);
+	buffer.sgetn(reinterpret_cast<char *>(block.data()), m_blocksize);
 
-	if (m_decryptor)
+	if (m_cipher)
 	{
-		blob data(m_iblocksize);
-		m_decryptor.process(block.data(), m_iblocksize, data.data());
+		blob data(m_blocksize);
+		m_cipher.process(block.data(), m_blocksize, data.data());
 		std::swap(data, block);
+
+		m_offset += m_blocksize;
 	}
 
-	if (m_verifier)
+	if (m_mac)
 	{
 		if (empty)
 		{
 			for (int32_t i = 3; i >= 0; --i)
 			{
-				uint8_t b = m_in_seq_nr >> (i * 8);
-				m_verifier.update(&b, 1);
+				uint8_t b = m_seq_nr >> (i * 8);
+				m_mac.update(&b, 1);
 			}
 		}
 
-		m_verifier.update(block.data(), block.size());
+		m_mac.update(block.data(), block.size());
 	}
 
 	return block;
 }
 
-std::unique_ptr<ipacket> crypto_engine::get_next_packet(boost::asio::streambuf &buffer, boost::system::error_code &ec)
+std::unique_ptr<ipacket> crypto_decoder::get_next_packet(boost::asio::streambuf &buffer, boost::system::error_code &ec)
 {
-	std::lock_guard lock(m_in_mutex);
+	if (m_lane and not m_packet)
+	{
+		// first hand out what the pipeline has finished, in order
+		auto result = pop_ready(ec);
+		if (result or ec)
+			return result;
+
+		std::size_t in_flight;
+		{
+			std::lock_guard lock(m_ready->m_mutex);
+			in_flight = m_ready->m_in_flight;
+		}
+
+		if (in_flight == 0 and m_header.empty())
+		{
+			auto keys = m_keys;
+			update();
+			if (m_keys != keys)
+				m_stalled = false;
+		}
+
+		if (can_offload() or not m_header.empty())
+		{
+			offload(buffer);
+			return pop_ready(ec);
+		}
+
+		if (in_flight > 0 or m_stalled)
+			return {};
+	}
 
 	if (not m_packet)
-		m_packet = std::make_unique<ipacket>(m_in_seq_nr);
+	{
+		update();
+		m_packet = std::make_unique<ipacket>(m_seq_nr);
+
+		// the pipeline may have been used for the previous packets
+		if (m_lane and m_cipher.is_random_access())
+			m_cipher.seek(m_offset);
+	}
 
 	bool complete_and_verified = false;
 
-	while (buffer.size() >= m_iblocksize)
+	while (buffer.size() >= m_blocksize)
 	{
 		if (not m_packet->complete())
-			m_packet->append(get_next_block(buffer, m_packet->empty()));
+			m_packet->append(get_next_block(buffer, m_packet->empty()), m_max_packet_size);
 
 		if (m_packet->complete())
 		{
-			if (m_verifier)
+			if (m_mac)
 			{
-				const std::size_t digest_size = m_verifier.get_digest_size();
+				const std::size_t digest_size = m_mac.get_digest_size();
 
 				if (buffer.size() < digest_size)
 					break;
@@ -394,17 +693,17 @@ std::unique_ptr<ipacket> crypto_engine::get_next_packet(boost::asio::streambuf &
 				blob digest(digest_size);
 				buffer.sgetn(reinterpret_cast<char *>(digest.data()), digest_size);
 
-				if (not m_verifier.verify(digest.data()))
+				if (not m_mac.verify(digest.data()))
 				{
 					ec = error::make_error_code(error::mac_error);
 					break;
 				}
 			}
 
-			if (m_decompressor)
-				m_packet->decompress(*m_decompressor, ec);
+			if (m_compressor)
+				m_packet->decompress(*m_compressor, ec);
 
-			++m_in_seq_nr;
+			++m_seq_nr;
 
 			complete_and_verified = true;
 			break;
@@ -414,9 +713,24 @@ std::unique_ptr<ipacket> crypto_engine::get_next_packet(boost::asio::streambuf &
 	return complete_and_verified ? std::move(m_packet) : std::unique_ptr<ipacket>();
 }
 
-std::unique_ptr<boost::asio::streambuf> crypto_engine::get_next_request(opacket &&p)
+// --------------------------------------------------------------------
+
+void crypto_encoder::set_pipeline(std::shared_ptr<crypto_pipeline> pipeline)
+{
+	m_pipeline = std::move(pipeline);
+	m_lane.reset();
+
+	if (m_pipeline)
+		m_lane = m_pipeline->make_lane();
+}
+
+std::unique_ptr<boost::asio::streambuf> crypto_encoder::get_next_request(opacket &&p)
 {
-	std::lock_guard lock(m_out_mutex);
+	update();
+
+	// the pipeline may have been used for the previous packets
+	if (m_lane and m_cipher.is_random_access())
+		m_cipher.seek(m_offset);
 
 	auto request = std::make_unique<boost::asio::streambuf>();
 
@@ -429,25 +743,165 @@ std::unique_ptr<boost::asio::streambuf> crypto_engine::get_next_request(opacket
 			throw ec;
 	}
 
-	io::filtering_stream<io::output> out;
-	if (m_encryptor)
-		out.push(packet_encryptor(*m_encryptor.m_impl->m_stream_transformation, *m_signer.m_impl->m_verify, m_oblocksize, m_out_seq_nr));
-	out.push(*request);
+	{
+		io::filtering_stream<io::output> out;
+		if (m_cipher)
+			out.push(packet_encryptor(m_cipher, m_mac, m_blocksize, m_seq_nr));
+		out.push(*request);
 
-	p.write(out, m_oblocksize);
+		p.write(out, m_blocksize);
+	}
 
-	++m_out_seq_nr;
+	if (m_cipher)
+		m_offset += request->size() - m_mac.get_digest_size();
+
+	++m_seq_nr;
 
 	return request;
 }
 
-void crypto_engine::enable_compression()
+void crypto_encoder::async_get_next_request(opacket &&p, request_handler handler)
 {
-	if (m_delay_compressor)
-		m_compressor.reset(new compression_helper(true));
+	crypto_pipeline::job job;
+
+	if (m_lane)
+		update();
+
+	if (can_offload())
+	{
+		// compress and pad here, sign and encrypt in the pipeline
+		if (m_compressor)
+		{
+			boost::system::error_code ec;
+			p.compress(*m_compressor, ec);
+
+			if (ec)
+				throw ec;
+		}
+
+		{
+			io::filtering_stream<io::output> out(blob_sink{ job.m_data });
+			p.write(out, m_blocksize);
+		}
+
+		job.m_type = crypto_pipeline::job_type::encrypt;
+		job.m_keys = m_keys;
+		job.m_seq_nr = m_seq_nr++;
+		job.m_offset = m_offset;
+
+		m_offset += job.m_data.size();
+	}
+	else
+	{
+		auto request = get_next_request(std::move(p));
 
-	if (m_delay_decompressor)
-		m_decompressor.reset(new compression_helper(false));
+		job.m_data.resize(request->size());
+		request->sgetn(reinterpret_cast<char *>(job.m_data.data()), job.m_data.size());
+
+		if (not m_lane)
+		{
+			handler(std::move(job.m_data));
+			return;
+		}
+	}
+
+	job.m_handler = [handler = std::move(handler)](crypto_pipeline::job &&job)
+	{
+		handler(std::move(job.m_data));
+	};
+
+	m_pipeline->submit(m_lane, std::move(job));
+}
+
+// --------------------------------------------------------------------
+
+crypto_engine::crypto_engine()
+{
+}
+
+void crypto_engine::newkeys(key_exchange &kex, bool authenticated)
+{
+	// the keys as derived by the key exchange are always 64 bytes long
+	const std::size_t kKeySize = 64;
+
+	auto copy_key = [&kex, kKeySize](key_exchange::key_enum k)
+	{
+		const uint8_t *key = kex.key(k);
+		return blob(key, key + kKeySize);
+	};
+
+	// Client to server
+	m_alg_enc_c2s = kex.get_encryption_protocol(direction::c2s);
+	m_alg_ver_c2s = kex.get_verification_protocol(direction::c2s);
+	m_alg_cmp_c2s = kex.get_compression_protocol(direction::c2s);
+
+	m_encoder.newkeys(std::unique_ptr<crypto_keys>(new crypto_keys{
+		m_alg_enc_c2s, m_alg_ver_c2s, m_alg_cmp_c2s,
+		copy_key(key_exchange::C), copy_key(key_exchange::A), copy_key(key_exchange::E),
+		authenticated }));
+
+	// Server to client
+	m_alg_enc_s2c = kex.get_encryption_protocol(direction::s2c);
+	m_alg_ver_s2c = kex.get_verification_protocol(direction::s2c);
+	m_alg_cmp_s2c = kex.get_compression_protocol(direction::s2c);
+
+	m_decoder.newkeys(std::unique_ptr<crypto_keys>(new crypto_keys{
+		m_alg_enc_s2c, m_alg_ver_s2c, m_alg_cmp_s2c,
+		copy_key(key_exchange::D), copy_key(key_exchange::B), copy_key(key_exchange::F),
+		authenticated }));
+}
+
+void crypto_engine::reset()
+{
+	m_decoder.reset();
+	m_encoder.reset();
+
+	m_alg_kex.clear();
+	m_alg_enc_c2s.clear();
+	m_alg_ver_c2s.clear();
+	m_alg_cmp_c2s.clear();
+	m_alg_enc_s2c.clear();
+	m_alg_ver_s2c.clear();
+	m_alg_cmp_s2c.clear();
+}
+
+std::string crypto_engine::get_connection_parameters(direction dir) const
+{
+	std::string result;
+
+	if (dir == direction::c2s)
+	{
+		result = m_alg_enc_c2s + '/' + m_alg_ver_c2s;
+
+		if (m_alg_cmp_c2s != "none")
+			result = result + '/' + m_alg_cmp_c2s;
+	}
+	else
+	{
+		result = m_alg_enc_s2c + '/' + m_alg_ver_s2c;
+
+		if (m_alg_cmp_s2c != "none")
+			result = result + '/' + m_alg_cmp_s2c;
+	}
+
+	return result;
+}
+
+std::string crypto_engine::get_key_exchange_algorithm() const
+{
+	return m_alg_kex;
+}
+
+void crypto_engine::set_keystream_cache(std::size_t size)
+{
+	m_encoder.set_keystream_cache(size);
+	m_decoder.set_keystream_cache(size);
+}
+
+void crypto_engine::enable_compression()
+{
+	m_encoder.enable_compression();
+	m_decoder.enable_compression();
 }
 
 } // namespace pinch
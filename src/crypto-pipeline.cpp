@@ -0,0 +1,210 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <pinch/pinch.hpp>
+
+#include <pinch/crypto-engine.hpp>
+#include <pinch/crypto-pipeline.hpp>
+
+namespace pinch
+{
+
+// --------------------------------------------------------------------
+
+/// \brief The per thread state, each worker has its own copy of the cipher and MAC
+
+struct crypto_pipeline::worker
+{
+	std::shared_ptr<const crypto_keys> m_encrypt_keys, m_decrypt_keys;
+
+	TransformData m_encryptor, m_decryptor;
+	MessageAuthenticationCode m_signer, m_verifier;
+
+	void encrypt(job &j);
+	void decrypt(job &j);
+};
+
+void crypto_pipeline::worker::encrypt(job &j)
+{
+	if (m_encrypt_keys != j.m_keys)
+	{
+		m_encryptor.reset_encryptor(j.m_keys->m_enc, j.m_keys->m_key.data(), j.m_keys->m_iv.data());
+		m_signer.reset(j.m_keys->m_ver, j.m_keys->m_mac_key.data());
+		m_encrypt_keys = j.m_keys;
+	}
+
+	const uint8_t seq_nr[4] = {
+		static_cast<uint8_t>(j.m_seq_nr >> 24), static_cast<uint8_t>(j.m_seq_nr >> 16),
+		static_cast<uint8_t>(j.m_seq_nr >> 8), static_cast<uint8_t>(j.m_seq_nr)
+	};
+
+	const std::size_t n = j.m_data.size();
+
+	m_signer.update(seq_nr, sizeof(seq_nr));
+	m_signer.update(j.m_data.data(), n);
+
+	j.m_data.resize(n + m_signer.get_digest_size());
+	m_signer.final(j.m_data.data() + n);
+
+	m_encryptor.seek(j.m_offset);
+	m_encryptor.process(j.m_data.data(), n, j.m_data.data());
+}
+
+void crypto_pipeline::worker::decrypt(job &j)
+{
+	if (m_decrypt_keys != j.m_keys)
+	{
+		m_decryptor.reset_decryptor(j.m_keys->m_enc, j.m_keys->m_key.data(), j.m_keys->m_iv.data());
+		m_verifier.reset(j.m_keys->m_ver, j.m_keys->m_mac_key.data());
+		m_decrypt_keys = j.m_keys;
+	}
+
+	const uint8_t seq_nr[4] = {
+		static_cast<uint8_t>(j.m_seq_nr >> 24), static_cast<uint8_t>(j.m_seq_nr >> 16),
+		static_cast<uint8_t>(j.m_seq_nr >> 8), static_cast<uint8_t>(j.m_seq_nr)
+	};
+
+	const std::size_t digest_size = m_verifier.get_digest_size();
+	if (j.m_data.size() < digest_size + j.m_skip)
+	{
+		j.m_verified = false;
+		return;
+	}
+
+	const std::size_t n = j.m_data.size() - digest_size;
+
+	m_decryptor.seek(j.m_offset + j.m_skip);
+	m_decryptor.process(j.m_data.data() + j.m_skip, n - j.m_skip, j.m_data.data() + j.m_skip);
+
+	m_verifier.update(seq_nr, sizeof(seq_nr));
+	m_verifier.update(j.m_data.data(), n);
+	j.m_verified = m_verifier.verify(j.m_data.data() + n);
+
+	j.m_data.resize(n);
+}
+
+// --------------------------------------------------------------------
+
+crypto_pipeline::crypto_pipeline(std::size_t workers)
+{
+	if (workers == 0)
+		workers = std::thread::hardware_concurrency();
+
+	if (workers == 0)
+		workers = 1;
+
+	for (std::size_t i = 0; i < workers; ++i)
+		m_threads.emplace_back([this]()
+			{
+				worker w;
+				run(w); });
+}
+
+crypto_pipeline::~crypto_pipeline()
+{
+	{
+		std::unique_lock lock(m_mutex);
+		m_stop = true;
+		m_queue.clear();
+	}
+
+	m_cv.notify_all();
+
+	for (auto &t : m_threads)
+		t.join();
+}
+
+std::shared_ptr<crypto_pipeline::lane> crypto_pipeline::make_lane()
+{
+	return std::make_shared<lane>();
+}
+
+void crypto_pipeline::submit(const std::shared_ptr<lane> &l, job &&j)
+{
+	std::unique_lock lock(m_mutex);
+
+	uint64_t ticket = l->m_next_ticket++;
+
+	if (j.m_type == job_type::none)
+	{
+		lock.unlock();
+		complete(l, ticket, std::move(j));
+	}
+	else
+	{
+		m_queue.emplace_back(l, ticket, std::move(j));
+		lock.unlock();
+		m_cv.notify_one();
+	}
+}
+
+void crypto_pipeline::run(worker &w)
+{
+	for (;;)
+	{
+		std::unique_lock lock(m_mutex);
+
+		m_cv.wait(lock, [this]
+			{ return m_stop or not m_queue.empty(); });
+
+		if (m_stop)
+			break;
+
+		auto [l, ticket, j] = std::move(m_queue.front());
+		m_queue.pop_front();
+
+		lock.unlock();
+
+		if (j.m_type == job_type::encrypt)
+			w.encrypt(j);
+		else
+			w.decrypt(j);
+
+		complete(l, ticket, std::move(j));
+	}
+}
+
+void crypto_pipeline::complete(const std::shared_ptr<lane> &l, uint64_t ticket, job &&j)
+{
+	std::unique_lock lock(m_mutex);
+
+	l->m_done.emplace(ticket, std::move(j));
+
+	// Only one thread at a time delivers the results for a lane, the others
+	// simply leave their result behind. That keeps the order intact.
+	if (l->m_delivering)
+		return;
+
+	l->m_delivering = true;
+
+	while (not l->m_done.empty() and l->m_done.begin()->first == l->m_next_delivery)
+	{
+		auto next = std::move(l->m_done.begin()->second);
+		l->m_done.erase(l->m_done.begin());
+		++l->m_next_delivery;
+
+		lock.unlock();
+
+		if (next.m_handler)
+		{
+			auto handler = std::move(next.m_handler);
+
+			try
+			{
+				handler(std::move(next));
+			}
+			catch (...)
+			{
+				// a failing handler should not stall the rest of the lane
+			}
+		}
+
+		lock.lock();
+	}
+
+	l->m_delivering = false;
+}
+
+} // namespace pinch
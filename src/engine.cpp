@@ -0,0 +1,139 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <pinch/pinch.hpp>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <pinch/channel.hpp>
+#include <pinch/engine.hpp>
+
+namespace pinch
+{
+
+// --------------------------------------------------------------------
+
+namespace
+{
+
+	void pin_thread_to_core(std::thread &thread, std::size_t core)
+	{
+#if defined(_WIN32)
+		::SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << (core % (8 * sizeof(DWORD_PTR))));
+#elif defined(__linux__)
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(core % CPU_SETSIZE, &cpuset);
+		::pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuset);
+#else
+		// not supported on this platform, simply ignore
+#endif
+	}
+
+} // namespace
+
+// --------------------------------------------------------------------
+
+engine::engine(std::size_t shards, bool pin_threads)
+	: m_pin_threads(pin_threads)
+{
+	if (shards == 0)
+		shards = std::thread::hardware_concurrency();
+
+	if (shards == 0)
+		shards = 1;
+
+	for (std::size_t i = 0; i < shards; ++i)
+		m_shards.emplace_back(std::make_shared<shard>());
+}
+
+engine::~engine()
+{
+	stop();
+}
+
+void engine::start()
+{
+	for (std::size_t i = 0; i < m_shards.size(); ++i)
+	{
+		auto s = m_shards[i];
+
+		if (s->m_thread.joinable())
+			continue;
+
+		if (s->m_io_context.stopped())
+			s->m_io_context.restart();
+
+		s->m_thread = std::thread([s]() {
+			for (;;)
+			{
+				try
+				{
+					s->m_io_context.run();
+					break;
+				}
+				catch (...)
+				{
+					// an exception escaping a handler should not kill the whole shard
+				}
+			}
+		});
+
+		if (m_pin_threads)
+			pin_thread_to_core(s->m_thread, i);
+	}
+}
+
+void engine::stop()
+{
+	for (auto &s : m_shards)
+		s->m_io_context.stop();
+
+	for (auto &s : m_shards)
+	{
+		if (not s->m_thread.joinable())
+			continue;
+
+		if (s->m_thread.get_id() == std::this_thread::get_id())
+			s->m_thread.detach();
+		else
+			s->m_thread.join();
+	}
+}
+
+std::size_t engine::least_loaded_shard() const
+{
+	std::size_t result = 0, least = m_shards.front()->m_load;
+
+	for (std::size_t i = 1; i < m_shards.size() and least > 0; ++i)
+	{
+		std::size_t load = m_shards[i]->m_load;
+		if (load < least)
+		{
+			least = load;
+			result = i;
+		}
+	}
+
+	return result;
+}
+
+std::size_t engine::shard_of(basic_connection &conn) const
+{
+	auto &io_context = conn.get_executor().context();
+
+	std::size_t result = 0;
+	while (result < m_shards.size() and &m_shards[result]->m_io_context != &io_context)
+		++result;
+
+	return result;
+}
+
+} // namespace pinch
@@ -96,6 +96,8 @@ namespace detail
 					return "Illegal user name";
 				case error::keep_alive_timeout:
 					return "Timeout on a keep-alive message";
+				case error::idle_timeout:
+					return "Connection closed after being idle";
 				default:
 					return "ssh disconnected with error";
 			}
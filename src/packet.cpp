@@ -6,6 +6,7 @@
 #include <pinch/pinch.hpp>
 
 #include <random>
+#include <utility>
 
 #include <boost/algorithm/string.hpp>
 
@@ -72,30 +73,78 @@ opacket::opacket(message_type message)
 
 opacket::opacket(const opacket &rhs)
 	: m_data(rhs.m_data)
+	, m_referenced(rhs.m_referenced)
+	, m_referenced_size(rhs.m_referenced_size)
+	, m_owner(rhs.m_owner)
 {
 }
 
 opacket::opacket(opacket &&rhs)
 	: m_data(move(rhs.m_data))
+	, m_referenced(move(rhs.m_referenced))
+	, m_referenced_size(std::exchange(rhs.m_referenced_size, 0))
+	, m_owner(move(rhs.m_owner))
 {
 }
 
 opacket &opacket::operator=(opacket &&rhs)
 {
 	if (this != &rhs)
+	{
 		m_data = move(rhs.m_data);
+		m_referenced = move(rhs.m_referenced);
+		m_referenced_size = std::exchange(rhs.m_referenced_size, 0);
+		m_owner = move(rhs.m_owner);
+	}
 	return *this;
 }
 
 opacket &opacket::operator=(const opacket &rhs)
 {
 	if (this != &rhs)
+	{
 		m_data = rhs.m_data;
+		m_referenced = rhs.m_referenced;
+		m_referenced_size = rhs.m_referenced_size;
+		m_owner = rhs.m_owner;
+	}
 	return *this;
 }
 
+opacket::operator blob() const
+{
+	blob result;
+	result.reserve(size());
+	result.insert(result.end(), m_data.begin(), m_data.end());
+
+	for (auto &b : m_referenced)
+	{
+		auto p = static_cast<const uint8_t *>(b.data());
+		result.insert(result.end(), p, p + b.size());
+	}
+
+	return result;
+}
+
+void opacket::flatten()
+{
+	if (m_referenced_size > 0)
+	{
+		std::size_t offset = m_data.size();
+		m_data.resize(offset + m_referenced_size);
+		boost::asio::buffer_copy(boost::asio::buffer(m_data.data() + offset, m_referenced_size), m_referenced);
+	}
+
+	m_referenced.clear();
+	m_referenced_size = 0;
+	m_owner.reset();
+}
+
 void opacket::compress(compression_helper &compressor, boost::system::error_code &ec)
 {
+	// zlib wants the data in one block
+	flatten();
+
 	z_stream &zstream(compressor);
 
 	zstream.next_in = m_data.data();
@@ -140,7 +189,7 @@ void opacket::write(std::ostream &os, int blocksize) const
 	uint8_t header[5];
 	blob padding;
 
-	uint32_t size = m_data.size() + 5;
+	uint32_t size = this->size() + 5;
 	uint32_t padding_size = blocksize - (size % blocksize);
 	if (padding_size == static_cast<uint32_t>(blocksize))
 		padding_size = 0;
@@ -165,6 +214,8 @@ void opacket::write(std::ostream &os, int blocksize) const
 
 	os.write(reinterpret_cast<const char *>(header), 5);
 	os.write(reinterpret_cast<const char *>(m_data.data()), m_data.size());
+	for (auto &b : m_referenced)
+		os.write(static_cast<const char *>(b.data()), b.size());
 	os.write(reinterpret_cast<const char *>(padding.data()), padding_size);
 }
 
@@ -431,7 +482,7 @@ void ipacket::clear()
 	m_offset = 0;
 }
 
-void ipacket::append(const blob &block)
+void ipacket::append(const blob &block, uint32_t max_packet_size)
 {
 	if (m_complete)
 		throw packet_exception();
@@ -443,7 +494,7 @@ void ipacket::append(const blob &block)
 		for (int i = 0; i < 4; ++i)
 			m_length = m_length << 8 | static_cast<uint8_t>(block[i]);
 
-		if (m_length > kMaxPacketSize + 32) // weird, allow some overhead?
+		if (m_length > max_packet_size + 32) // weird, allow some overhead?
 			throw packet_exception();
 
 		m_length -= 1; // the padding uint8_t
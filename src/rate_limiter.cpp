@@ -0,0 +1,94 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <pinch/pinch.hpp>
+
+#include <algorithm>
+
+#include <pinch/packet.hpp>
+#include <pinch/rate_limiter.hpp>
+
+namespace pinch
+{
+
+void rate_limiter::set_rate(double bytes_per_second, std::size_t burst)
+{
+	std::lock_guard lock(m_mutex);
+
+	if (bytes_per_second <= 0)
+	{
+		m_rate = m_burst = m_tokens = 0;
+		return;
+	}
+
+	// a bucket smaller than a packet would stall the sender
+	if (burst == 0)
+		burst = static_cast<std::size_t>(bytes_per_second / 10);
+	if (burst < kMaxPacketSize)
+		burst = kMaxPacketSize;
+
+	// a new limit starts with a full bucket, an existing one keeps its debt
+	if (m_rate == 0)
+	{
+		m_tokens = burst;
+		m_last = clock_type::now();
+	}
+	else
+		m_tokens = std::min<double>(m_tokens, burst);
+
+	m_rate = bytes_per_second;
+	m_burst = burst;
+}
+
+double rate_limiter::get_rate() const
+{
+	std::lock_guard lock(m_mutex);
+	return m_rate;
+}
+
+std::size_t rate_limiter::get_burst() const
+{
+	std::lock_guard lock(m_mutex);
+	return static_cast<std::size_t>(m_burst);
+}
+
+void rate_limiter::refill(time_point now)
+{
+	if (now > m_last)
+	{
+		m_tokens = std::min(m_burst, m_tokens + std::chrono::duration<double>(now - m_last).count() * m_rate);
+		m_last = now;
+	}
+}
+
+rate_limiter::duration rate_limiter::delay(time_point now)
+{
+	std::lock_guard lock(m_mutex);
+
+	if (m_rate == 0)
+		return {};
+
+	refill(now);
+
+	if (m_tokens > 0)
+		return {};
+
+	// wait until the bucket holds at least one byte
+	auto result = std::chrono::duration_cast<duration>(std::chrono::duration<double>((1 - m_tokens) / m_rate));
+	return std::max(result, duration(1));
+}
+
+void rate_limiter::consume(std::size_t bytes, time_point now)
+{
+	std::lock_guard lock(m_mutex);
+
+	if (m_rate != 0)
+	{
+		refill(now);
+		m_tokens -= bytes;
+	}
+}
+
+} // namespace pinch
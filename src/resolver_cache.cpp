@@ -0,0 +1,213 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <pinch/pinch.hpp>
+
+#include <algorithm>
+
+#include <boost/asio/post.hpp>
+
+#include <pinch/resolver_cache.hpp>
+
+namespace pinch
+{
+
+resolver_cache::resolver_cache(duration ttl, duration negative_ttl)
+	: m_ttl(ttl)
+	, m_negative_ttl(negative_ttl)
+	, m_refresh_ahead(ttl / 6)
+{
+}
+
+resolver_cache::~resolver_cache()
+{
+	m_work.reset();
+	m_io_context.stop();
+
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void resolver_cache::set_ttl(duration ttl, duration negative_ttl)
+{
+	std::lock_guard lock(m_mutex);
+
+	m_ttl = ttl;
+	m_negative_ttl = negative_ttl;
+}
+
+void resolver_cache::set_refresh_ahead(duration refresh_ahead)
+{
+	std::lock_guard lock(m_mutex);
+
+	m_refresh_ahead = refresh_ahead;
+}
+
+void resolver_cache::async_resolve(const executor_type &executor, const std::string &host, uint16_t port, handler_type handler)
+{
+	std::string key = host + ':' + std::to_string(port);
+	auto now = clock_type::now();
+
+	std::unique_lock lock(m_mutex);
+
+	auto i = m_entries.find(key);
+
+	if (i != m_entries.end() and i->second.m_valid and i->second.m_expires > now)
+	{
+		auto &e = i->second;
+
+		++m_stats.m_hits;
+		if (e.m_ec)
+			++m_stats.m_negative_hits;
+
+		// a name that is still in use is resolved again before it expires
+		if (not e.m_ec and not e.m_querying and m_refresh_ahead > duration::zero() and e.m_expires - now < m_refresh_ahead)
+		{
+			++m_stats.m_refreshes;
+			start_query(key, host, port);
+		}
+
+		boost::asio::post(executor, [handler = std::move(handler), ec = e.m_ec, endpoints = e.m_endpoints]()
+			{ handler(ec, endpoints); });
+		return;
+	}
+
+	++m_stats.m_misses;
+
+	if (i == m_entries.end())
+	{
+		if (m_entries.size() >= m_prune_size)
+			prune(now);
+
+		i = m_entries.emplace(key, entry{}).first;
+	}
+
+	// an expired entry is no longer used, wait for the new answer
+	auto &e = i->second;
+	e.m_valid = false;
+	e.m_waiters.push_back({ executor, std::move(handler) });
+
+	if (not e.m_querying)
+		start_query(key, host, port);
+}
+
+void resolver_cache::start_query(const std::string &key, const std::string &host, uint16_t port)
+{
+	m_entries[key].m_querying = true;
+
+	if (not m_thread.joinable())
+	{
+		m_thread = std::thread([this]() {
+			for (;;)
+			{
+				try
+				{
+					m_io_context.run();
+					break;
+				}
+				catch (...)
+				{
+					// a failing handler should not stop the other queries
+				}
+			}
+		});
+	}
+
+	auto resolver = std::make_shared<boost::asio::ip::tcp::resolver>(m_io_context);
+
+	// The handler does not keep the cache alive, the destructor stops the
+	// thread before anything is destroyed. The cache is therefore never
+	// released by its own thread.
+	resolver->async_resolve(host, std::to_string(port),
+		[this, resolver, key](const boost::system::error_code &ec, boost::asio::ip::tcp::resolver::results_type results)
+		{
+			query_done(key, ec, std::vector<endpoint_type>(results.begin(), results.end()));
+		});
+}
+
+void resolver_cache::query_done(const std::string &key, const boost::system::error_code &ec, std::vector<endpoint_type> &&endpoints)
+{
+	std::vector<waiter> waiters;
+	boost::system::error_code result_ec = ec;
+	std::vector<endpoint_type> result;
+
+	{
+		std::lock_guard lock(m_mutex);
+
+		auto &e = m_entries[key];
+		e.m_querying = false;
+
+		if (ec and e.m_valid and not e.m_ec)
+		{
+			// a failed refresh, keep the previous answer until it expires
+		}
+		else if (ec == boost::asio::error::operation_aborted)
+		{
+			// not a real answer, do not cache it
+			e.m_valid = false;
+		}
+		else
+		{
+			e.m_ec = ec;
+			e.m_endpoints = std::move(endpoints);
+			e.m_expires = clock_type::now() + (ec ? m_negative_ttl : m_ttl);
+			e.m_valid = true;
+		}
+
+		std::swap(waiters, e.m_waiters);
+		if (e.m_valid)
+		{
+			result_ec = e.m_ec;
+			result = e.m_endpoints;
+		}
+	}
+
+	for (auto &w : waiters)
+	{
+		boost::asio::post(w.m_executor, [handler = std::move(w.m_handler), result_ec, result]()
+			{ handler(result_ec, result); });
+	}
+}
+
+void resolver_cache::clear()
+{
+	std::lock_guard lock(m_mutex);
+
+	// entries with a query in progress are kept for their waiters
+	for (auto i = m_entries.begin(); i != m_entries.end();)
+	{
+		if (i->second.m_querying)
+		{
+			i->second.m_valid = false;
+			++i;
+		}
+		else
+			i = m_entries.erase(i);
+	}
+}
+
+resolver_cache_stats resolver_cache::get_stats() const
+{
+	std::lock_guard lock(m_mutex);
+
+	auto result = m_stats;
+	result.m_entries = m_entries.size();
+	return result;
+}
+
+void resolver_cache::prune(time_point now)
+{
+	for (auto i = m_entries.begin(); i != m_entries.end();)
+	{
+		if (not i->second.m_querying and i->second.m_expires <= now)
+			i = m_entries.erase(i);
+		else
+			++i;
+	}
+
+	m_prune_size = std::max<std::size_t>(1024, 2 * m_entries.size());
+}
+
+} // namespace pinch
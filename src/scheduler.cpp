@@ -0,0 +1,120 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <pinch/pinch.hpp>
+
+#include <algorithm>
+
+#include <pinch/scheduler.hpp>
+
+namespace pinch
+{
+
+void outbound_scheduler::push(uint32_t flow_id, traffic_class cls, uint32_t weight, std::size_t size, release_type &&release)
+{
+	if (cls == traffic_class::control)
+		cls = traffic_class::interactive;
+
+	auto &f = m_flows[flow_id];
+
+	// a flow that is not active yet joins at the end of the round
+	if (f.m_items.empty())
+	{
+		f.m_class = cls;
+		f.m_deficit = 0;
+		m_active[static_cast<std::size_t>(cls)].push_back(flow_id);
+	}
+
+	f.m_weight = std::max<uint32_t>(weight, 1);
+	f.m_items.push_back({ size, std::chrono::steady_clock::now(), std::move(release) });
+
+	++m_size;
+}
+
+bool outbound_scheduler::push_behind(uint32_t flow_id, std::size_t size, release_type &&release)
+{
+	auto fi = m_flows.find(flow_id);
+	if (fi == m_flows.end())
+		return false;
+
+	fi->second.m_items.push_back({ size, std::chrono::steady_clock::now(), std::move(release) });
+	++m_size;
+
+	return true;
+}
+
+bool outbound_scheduler::release_next()
+{
+	for (auto &active : m_active)
+	{
+		while (not active.empty())
+		{
+			auto fi = m_flows.find(active.front());
+			auto &f = fi->second;
+
+			if (f.m_items.front().m_size > f.m_deficit)
+			{
+				// not enough credit left, next flow's turn
+				f.m_deficit += kQuantum * f.m_weight;
+				active.push_back(active.front());
+				active.pop_front();
+				continue;
+			}
+
+			auto i = std::move(f.m_items.front());
+			f.m_items.pop_front();
+			f.m_deficit -= i.m_size;
+			--m_size;
+
+			if (f.m_items.empty())
+			{
+				active.pop_front();
+				m_flows.erase(fi);
+			}
+
+			m_stats[&active - m_active.data()].add(i.m_size, std::chrono::steady_clock::now() - i.m_queued);
+
+			i.m_release({});
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void outbound_scheduler::cancel(uint32_t flow_id, const boost::system::error_code &ec)
+{
+	auto fi = m_flows.find(flow_id);
+	if (fi == m_flows.end())
+		return;
+
+	auto items = std::move(fi->second.m_items);
+	auto &active = m_active[static_cast<std::size_t>(fi->second.m_class)];
+
+	active.erase(std::find(active.begin(), active.end(), flow_id));
+	m_flows.erase(fi);
+	m_size -= items.size();
+
+	for (auto &i : items)
+		i.m_release(ec);
+}
+
+void outbound_scheduler::cancel_all(const boost::system::error_code &ec)
+{
+	auto flows = std::move(m_flows);
+
+	m_flows.clear();
+	for (auto &active : m_active)
+		active.clear();
+	m_size = 0;
+
+	for (auto &[id, f] : flows)
+	{
+		for (auto &i : f.m_items)
+			i.m_release(ec);
+	}
+}
+
+} // namespace pinch
@@ -496,6 +496,7 @@ ssh_private_key ssh_agent::get_key(ipacket &b) const
 ssh_agent_channel::ssh_agent_channel(std::shared_ptr<basic_connection> connection)
 	: channel(connection)
 {
+	set_traffic_class(traffic_class::interactive);
 }
 
 ssh_agent_channel::~ssh_agent_channel()
@@ -507,7 +508,7 @@ void ssh_agent_channel::opened()
 	channel::opened();
 
 	opacket out(msg_channel_open_confirmation);
-	out << m_host_channel_id << m_my_channel_id << m_my_window_size << kMaxPacketSize;
+	out << m_host_channel_id << m_my_channel_id << m_my_window_size << m_max_receive_packet_size;
 	m_connection->async_write(std::move(out));
 }
 
@@ -20,6 +20,7 @@ terminal_channel::terminal_channel(std::shared_ptr<basic_connection> connection)
 	, m_forward_agent(false)
 	, m_forward_x11(false)
 {
+	set_traffic_class(traffic_class::interactive);
 }
 
 void terminal_channel::set_environment_variable(
@@ -61,7 +62,7 @@ void terminal_channel::send_window_resize(uint32_t width, uint32_t height)
 		<< "window-change" << false
 		<< width << height
 		<< uint32_t(0) << uint32_t(0);
-	m_connection->async_write(std::move(out));
+	m_connection->write_channel_message(m_my_channel_id, std::move(out));
 }
 
 } // namespace pinch
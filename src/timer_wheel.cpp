@@ -0,0 +1,243 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <pinch/pinch.hpp>
+
+#include <pinch/timer_wheel.hpp>
+
+namespace pinch
+{
+
+// The wheel has kLevels levels of kSlots slots. A timer that expires less
+// than kSlots ticks from now is in level zero, in the slot for its tick. A
+// timer further away is in a higher level, in the slot for the upper bits
+// of its tick. Each time the lower bits of the current tick wrap around to
+// zero, the current slot of the next level is cascaded: its timers are
+// moved to the lower levels.
+
+boost::asio::io_context::id timer_wheel::id;
+
+void timer_wheel::timer::expires_at(time_point time, handler_type handler)
+{
+	m_wheel->add(this, time, std::move(handler));
+}
+
+void timer_wheel::timer::cancel()
+{
+	m_wheel->remove(this);
+}
+
+bool timer_wheel::timer::pending() const
+{
+	std::lock_guard lock(m_wheel->m_mutex);
+	return m_head != nullptr;
+}
+
+// --------------------------------------------------------------------
+
+timer_wheel::timer_wheel(boost::asio::io_context &io_context)
+	: boost::asio::io_context::service(io_context)
+	, m_tick_timer(io_context)
+{
+}
+
+std::size_t timer_wheel::size() const
+{
+	std::lock_guard lock(m_mutex);
+	return m_size;
+}
+
+void timer_wheel::shutdown()
+{
+	std::lock_guard lock(m_mutex);
+
+	m_shutdown = true;
+	m_tick_timer.cancel();
+
+	for (auto &level : m_slots)
+	{
+		for (auto &head : level)
+		{
+			while (head != nullptr)
+			{
+				auto t = head;
+				head = t->m_next;
+
+				t->m_head = nullptr;
+				t->m_prev = t->m_next = nullptr;
+				t->m_handler = nullptr;
+			}
+		}
+	}
+
+	m_size = 0;
+}
+
+uint64_t timer_wheel::to_tick(time_point time, bool round_up)
+{
+	auto ticks = time.time_since_epoch() / kTimerWheelResolution;
+	if (round_up and kTimerWheelResolution * ticks < time.time_since_epoch())
+		++ticks;
+	return ticks;
+}
+
+void timer_wheel::add(timer *t, time_point time, handler_type handler)
+{
+	std::lock_guard lock(m_mutex);
+
+	if (t->m_head != nullptr)
+		unlink(t);
+
+	if (m_shutdown)
+	{
+		t->m_handler = nullptr;
+		return;
+	}
+
+	t->m_handler = std::move(handler);
+
+	// an empty wheel is not ticking, catch up with the clock first
+	if (not m_ticking)
+		m_now = to_tick(clock_type::now(), false);
+
+	// the current tick was processed already
+	t->m_tick = std::max(to_tick(time, true), m_now + 1);
+
+	place(t);
+	++m_size;
+
+	start_ticking();
+}
+
+void timer_wheel::remove(timer *t)
+{
+	// the handler is released outside the lock, it may own other timers
+	handler_type handler;
+
+	{
+		std::lock_guard lock(m_mutex);
+
+		if (t->m_head != nullptr)
+			unlink(t);
+		handler = std::move(t->m_handler);
+		t->m_handler = nullptr;
+	}
+}
+
+void timer_wheel::unlink(timer *t)
+{
+	if (t->m_prev != nullptr)
+		t->m_prev->m_next = t->m_next;
+	else
+		*t->m_head = t->m_next;
+
+	if (t->m_next != nullptr)
+		t->m_next->m_prev = t->m_prev;
+
+	t->m_head = nullptr;
+	t->m_prev = t->m_next = nullptr;
+
+	--m_size;
+}
+
+void timer_wheel::place(timer *t)
+{
+	uint64_t delta = t->m_tick - m_now;
+	uint64_t tick = t->m_tick;
+
+	std::size_t level = 0;
+	while (level + 1 < kLevels and delta >= (uint64_t(1) << (kBits * (level + 1))))
+		++level;
+
+	// beyond the range of the wheel, park it at the far end
+	if (delta > kMaxDelta)
+		tick = m_now + kMaxDelta;
+
+	auto &head = m_slots[level][(tick >> (kBits * level)) & kMask];
+
+	t->m_head = &head;
+	t->m_prev = nullptr;
+	t->m_next = head;
+	if (head != nullptr)
+		head->m_prev = t;
+	head = t;
+}
+
+void timer_wheel::cascade(std::size_t level, std::size_t slot)
+{
+	auto t = m_slots[level][slot];
+	m_slots[level][slot] = nullptr;
+
+	while (t != nullptr)
+	{
+		auto next = t->m_next;
+		place(t);
+		t = next;
+	}
+}
+
+void timer_wheel::advance(uint64_t tick, std::unique_lock<std::mutex> &lock)
+{
+	m_now = tick;
+
+	// find the highest level whose lower digits wrapped, cascade from there down
+	std::size_t top = 0;
+	while (top + 1 < kLevels and (tick & ((uint64_t(1) << (kBits * (top + 1))) - 1)) == 0)
+		++top;
+
+	for (std::size_t level = top; level > 0; --level)
+		cascade(level, (tick >> (kBits * level)) & kMask);
+
+	auto &head = m_slots[0][tick & kMask];
+
+	while (head != nullptr)
+	{
+		auto t = head;
+		unlink(t);
+
+		auto handler = std::move(t->m_handler);
+		t->m_handler = nullptr;
+
+		// the handler may set the timer again, or destroy it, call it unlocked
+		lock.unlock();
+		handler();
+		handler = nullptr;
+		lock.lock();
+	}
+}
+
+void timer_wheel::start_ticking()
+{
+	if (m_ticking or m_size == 0)
+		return;
+
+	m_ticking = true;
+
+	m_tick_timer.expires_at(time_point(kTimerWheelResolution * (m_now + 1)));
+	m_tick_timer.async_wait([this](const boost::system::error_code &ec)
+		{ tick(ec); });
+}
+
+void timer_wheel::tick(const boost::system::error_code &ec)
+{
+	std::unique_lock lock(m_mutex);
+
+	if (ec or m_shutdown)
+	{
+		m_ticking = false;
+		return;
+	}
+
+	// handlers may add timers, m_ticking stays set so these do not move m_now
+	auto now = to_tick(clock_type::now(), false);
+
+	while (m_now < now)
+		advance(m_now + 1, lock);
+
+	m_ticking = false;
+	start_ticking();
+}
+
+} // namespace pinch
@@ -0,0 +1,113 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <pinch/pinch.hpp>
+
+#include <algorithm>
+
+#include <pinch/window-tuner.hpp>
+
+namespace pinch
+{
+
+window_tuner::window_tuner(uint32_t window_size, uint32_t max_window_size)
+	: m_initial_window_size(window_size)
+	, m_window_size(window_size)
+	, m_max_window_size(std::max(window_size, max_window_size))
+	, m_credit(window_size)
+{
+}
+
+void window_tuner::set_window_size(uint32_t size)
+{
+	m_initial_window_size = m_window_size = size;
+	m_max_window_size = std::max(m_max_window_size, size);
+	m_credit = m_received + size;
+}
+
+void window_tuner::set_max_window_size(uint32_t size)
+{
+	m_max_window_size = std::max(size, m_initial_window_size);
+	m_window_size = std::min(m_window_size, m_max_window_size);
+}
+
+void window_tuner::received(std::size_t bytes, time_point now)
+{
+	m_received += bytes;
+
+	if (m_probing and m_received > m_probe_edge)
+	{
+		auto rtt = now - m_probe_start;
+		if (m_rtt == duration::zero() or rtt < m_rtt)
+			m_rtt = rtt;
+		m_probing = false;
+	}
+}
+
+void window_tuner::consumed(std::size_t bytes, time_point now)
+{
+	m_consumed += bytes;
+
+	if (m_rtt == duration::zero())
+		return;
+
+	if (not m_period_started)
+	{
+		m_period_started = true;
+		m_period_start = now;
+		m_period_bytes = 0;
+	}
+
+	m_period_bytes += bytes;
+
+	auto elapsed = now - m_period_start;
+	if (elapsed < m_rtt)
+		return;
+
+	m_drain_rate = m_period_bytes / std::chrono::duration<double>(elapsed).count();
+
+	// Consuming more than half a window per round trip means the window is
+	// what limits the throughput.
+	double per_rtt = m_drain_rate * std::chrono::duration<double>(m_rtt).count();
+	if (per_rtt > m_window_size / 2 and m_window_size < m_max_window_size)
+	{
+		m_window_size = static_cast<uint32_t>(std::min<uint64_t>(2ULL * m_window_size, m_max_window_size));
+		++m_grows;
+	}
+
+	m_period_start = now;
+	m_period_bytes = 0;
+}
+
+void window_tuner::adjust_sent(uint32_t credit, time_point now)
+{
+	if (not m_probing)
+	{
+		m_probing = true;
+		m_probe_edge = m_credit;
+		m_probe_start = now;
+	}
+
+	m_credit += credit;
+	++m_adjusts;
+}
+
+channel_stats window_tuner::get_stats() const
+{
+	channel_stats result;
+
+	result.m_bytes_received = m_received;
+	result.m_bytes_consumed = m_consumed;
+	result.m_window_size = m_window_size;
+	result.m_max_window_size = m_max_window_size;
+	result.m_window_adjusts = m_adjusts;
+	result.m_window_grows = m_grows;
+	result.m_rtt = m_rtt;
+	result.m_drain_rate = m_drain_rate;
+
+	return result;
+}
+
+} // namespace pinch
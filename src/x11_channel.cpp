@@ -124,7 +124,7 @@ void x11_channel::opened()
 
 		opacket out(msg_channel_open_confirmation);
 		out << m_host_channel_id
-			<< m_my_channel_id << m_my_window_size << kMaxPacketSize;
+			<< m_my_channel_id << m_my_window_size << m_max_receive_packet_size;
 		m_connection->async_write(std::move(out));
 
 		m_channel_open = true;
@@ -0,0 +1,774 @@
+//        Copyright Maarten L. Hekkelman 2013-2021
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Simple benchmark for the crypto code, no server needed.
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <thread>
+
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/program_options.hpp>
+
+#include <pinch/connection.hpp>
+#include <pinch/crypto-engine.hpp>
+#include <pinch/crypto-pipeline.hpp>
+#include <pinch/key_exchange.hpp>
+#include <pinch/window-tuner.hpp>
+
+namespace po = boost::program_options;
+
+// --------------------------------------------------------------------
+
+std::unique_ptr<pinch::crypto_keys> make_keys(const std::string &cipher, const std::string &mac)
+{
+	std::mt19937 rng(42);
+	std::uniform_int_distribution<uint32_t> rb(0, 255);
+
+	auto random_key = [&]()
+	{
+		pinch::blob result(64);
+		for (auto &b : result)
+			b = rb(rng);
+		return result;
+	};
+
+	return std::unique_ptr<pinch::crypto_keys>(new pinch::crypto_keys{
+		cipher, mac, "none", random_key(), random_key(), random_key(), true });
+}
+
+double megabytes_per_second(std::size_t bytes, std::chrono::steady_clock::duration elapsed)
+{
+	return (bytes / (1024.0 * 1024.0)) / std::chrono::duration<double>(elapsed).count();
+}
+
+// --------------------------------------------------------------------
+// Encrypt \a count packets of \a size bytes, using a pipeline with \a workers
+// threads or inline if workers is zero. When inline, a keystream cache of
+// \a cache bytes is used. The encrypted stream is stored in \a stream for
+// use in the decrypt benchmark.
+
+double bench_encrypt(const std::string &cipher, const std::string &mac, std::size_t workers,
+	std::size_t cache, std::size_t count, std::size_t size, boost::asio::streambuf &stream)
+{
+	pinch::crypto_encoder encoder;
+	encoder.set_keystream_cache(cache);
+	encoder.newkeys(make_keys(cipher, mac));
+
+	std::shared_ptr<pinch::crypto_pipeline> pipeline;
+	if (workers > 0)
+	{
+		pipeline = std::make_shared<pinch::crypto_pipeline>(workers);
+		encoder.set_pipeline(pipeline);
+	}
+
+	const pinch::blob payload(size, 'x');
+
+	std::mutex m;
+	std::condition_variable cv;
+	std::size_t done = 0;
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		pinch::opacket out(pinch::msg_channel_data);
+		out << uint32_t(0) << payload;
+
+		encoder.async_get_next_request(std::move(out), [&](pinch::blob &&data)
+			{
+				std::unique_lock lock(m);
+				stream.sputn(reinterpret_cast<const char *>(data.data()), data.size());
+				if (++done == count)
+					cv.notify_one(); });
+	}
+
+	std::unique_lock lock(m);
+	cv.wait(lock, [&]
+		{ return done == count; });
+
+	return megabytes_per_second(count * size, std::chrono::steady_clock::now() - start);
+}
+
+// --------------------------------------------------------------------
+// Decrypt the packets in \a stream again, returns zero if the result is not correct
+
+double bench_decrypt(const std::string &cipher, const std::string &mac, std::size_t workers,
+	std::size_t cache, std::size_t count, std::size_t size, boost::asio::streambuf &stream)
+{
+	pinch::crypto_decoder decoder;
+	decoder.set_keystream_cache(cache);
+	decoder.set_max_packet_size(std::max<uint32_t>(size + 64, pinch::kMaxPacketSize));
+	decoder.newkeys(make_keys(cipher, mac));
+
+	std::mutex m;
+	std::condition_variable cv;
+	bool ready = false;
+
+	std::shared_ptr<pinch::crypto_pipeline> pipeline;
+	if (workers > 0)
+	{
+		pipeline = std::make_shared<pinch::crypto_pipeline>(workers);
+		decoder.set_pipeline(pipeline, [&]()
+			{
+				std::unique_lock lock(m);
+				ready = true;
+				cv.notify_one(); });
+	}
+
+	std::size_t received = 0;
+
+	auto start = std::chrono::steady_clock::now();
+
+	while (received < count)
+	{
+		boost::system::error_code ec;
+		auto p = decoder.get_next_packet(stream, ec);
+
+		if (ec)
+		{
+			std::cerr << "error decrypting: " << ec.message() << std::endl;
+			return 0;
+		}
+
+		if (p)
+		{
+			if (*p != pinch::msg_channel_data)
+				return 0;
+
+			++received;
+			continue;
+		}
+
+		std::unique_lock lock(m);
+		cv.wait_for(lock, std::chrono::milliseconds(10), [&]
+			{ return ready; });
+		ready = false;
+	}
+
+	return megabytes_per_second(count * size, std::chrono::steady_clock::now() - start);
+}
+
+// --------------------------------------------------------------------
+// Compare the crypto backends, each cipher and MAC is run for a fixed time
+// on buffers of \a size bytes.
+
+template <typename F>
+double bench_primitive(std::size_t size, F &&f)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::size_t bytes = 0;
+
+	do
+	{
+		f();
+		bytes += size;
+	} while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(250));
+
+	return megabytes_per_second(bytes, std::chrono::steady_clock::now() - start);
+}
+
+void bench_backends(std::size_t size)
+{
+	const auto backends = pinch::crypto_backend::available();
+
+	const pinch::blob key(64, 0x5a);
+	pinch::blob data(size, 'x');
+
+	std::cout << std::setw(16) << "MB/s";
+	for (auto &name : backends)
+		std::cout << std::setw(12) << name;
+	std::cout << std::endl;
+
+	for (auto cipher : { "aes128-ctr", "aes192-ctr", "aes256-ctr", "aes128-cbc", "aes192-cbc", "aes256-cbc", "3des-cbc" })
+	{
+		std::cout << std::setw(16) << cipher;
+
+		for (auto &name : backends)
+		{
+			pinch::TransformData t;
+			t.reset_encryptor(cipher, key.data(), key.data(), *pinch::crypto_backend::get(name));
+
+			std::cout << std::setw(12) << std::fixed << std::setprecision(1)
+					  << bench_primitive(size, [&]()
+							 { t.process(data.data(), data.size(), data.data()); });
+		}
+
+		std::cout << std::endl;
+	}
+
+	for (auto mac : { "hmac-sha1", "hmac-sha2-256", "hmac-sha2-512" })
+	{
+		std::cout << std::setw(16) << mac;
+
+		for (auto &name : backends)
+		{
+			pinch::MessageAuthenticationCode m;
+			m.reset(mac, key.data(), *pinch::crypto_backend::get(name));
+
+			pinch::blob digest(m.get_digest_size());
+
+			std::cout << std::setw(12) << std::fixed << std::setprecision(1)
+					  << bench_primitive(size, [&]()
+							 {
+								 m.update(data.data(), data.size());
+								 m.final(digest.data()); });
+		}
+
+		std::cout << std::endl;
+	}
+}
+
+// --------------------------------------------------------------------
+// Simulate a bulk transfer over a link with a round trip time of \a latency
+// and a bandwidth of \a bandwidth bytes per second, for ten seconds of
+// simulated time. The sender sends packets of kMaxPacketSize as long as it
+// has window, the receiver consumes the data at \a consumer bytes per second,
+// or right away if that is zero, and returns the window the way a channel
+// does using \a policy. Returns the throughput in MB/s, \a max_queued is the largest amount
+// of data waiting for the consumer.
+
+double bench_window(std::chrono::microseconds latency, double bandwidth, double consumer, uint32_t max_window_size,
+	const pinch::window_adjust_policy &policy, pinch::channel_stats &stats, std::size_t &max_queued)
+{
+	using namespace std::chrono;
+	using time_point = pinch::window_tuner::time_point;
+
+	pinch::window_tuner tuner(pinch::kWindowSize, max_window_size);
+
+	const auto one_way = duration_cast<steady_clock::duration>(latency / 2);
+	const auto per_byte = duration<double>(1 / bandwidth);
+	const time_point start{}, end = start + seconds(10);
+
+	enum event_type
+	{
+		data_arrived,
+		adjust_arrived,
+		data_consumed
+	};
+
+	struct event
+	{
+		time_point m_time;
+		event_type m_type;
+		uint32_t m_bytes;
+
+		bool operator>(const event &e) const { return m_time > e.m_time; }
+	};
+
+	std::priority_queue<event, std::vector<event>, std::greater<event>> events;
+
+	uint32_t host_window = tuner.get_window_size(), my_window = host_window;
+	time_point link_free = start;
+
+	std::deque<uint32_t> queued;
+	std::size_t queued_bytes = 0;
+	max_queued = 0;
+
+	auto send = [&](time_point now)
+	{
+		while (host_window > 0)
+		{
+			uint32_t n = std::min(host_window, pinch::kMaxPacketSize);
+			host_window -= n;
+
+			link_free = std::max(link_free, now) + duration_cast<steady_clock::duration>(per_byte * n);
+			events.push({ link_free + one_way, data_arrived, n });
+		}
+	};
+
+	send(start);
+
+	while (not events.empty() and events.top().m_time < end)
+	{
+		auto e = events.top();
+		events.pop();
+
+		if (e.m_type == adjust_arrived)
+		{
+			host_window += e.m_bytes;
+			send(e.m_time);
+			continue;
+		}
+
+		if (e.m_type == data_arrived)
+		{
+			my_window -= e.m_bytes;
+			tuner.received(e.m_bytes, e.m_time);
+
+			if (consumer == 0)
+				tuner.consumed(e.m_bytes, e.m_time);
+			else
+			{
+				if (queued.empty())
+					events.push({ e.m_time + duration_cast<steady_clock::duration>(duration<double>(e.m_bytes / consumer)), data_consumed, e.m_bytes });
+
+				queued.push_back(e.m_bytes);
+				queued_bytes += e.m_bytes;
+				max_queued = std::max(max_queued, queued_bytes);
+			}
+		}
+		else
+		{
+			queued.pop_front();
+			queued_bytes -= e.m_bytes;
+			tuner.consumed(e.m_bytes, e.m_time);
+
+			if (not queued.empty())
+				events.push({ e.m_time + duration_cast<steady_clock::duration>(duration<double>(queued.front() / consumer)), data_consumed, queued.front() });
+		}
+
+		// the same decision channel::send_window_adjust makes
+		if (uint32_t adjust = policy.credit(tuner.get_window_size(), my_window + queued_bytes); adjust > 0)
+		{
+			my_window += adjust;
+			tuner.adjust_sent(adjust, e.m_time);
+
+			events.push({ e.m_time + one_way, adjust_arrived, adjust });
+		}
+	}
+
+	stats = tuner.get_stats();
+
+	return megabytes_per_second(stats.m_bytes_consumed, end - start);
+}
+
+int bench_windows(const std::vector<std::size_t> &latencies, double bandwidth, double consumer, uint32_t max_window_size,
+	const pinch::window_adjust_policy &policy)
+{
+	std::cout << "simulated link of " << std::fixed << std::setprecision(1) << bandwidth / (1024 * 1024) << " MB/s";
+	if (consumer > 0)
+		std::cout << ", consumer reads " << consumer / (1024 * 1024) << " MB/s";
+	std::cout << std::endl
+			  << std::endl
+			  << std::setw(8) << "rtt ms" << std::setw(16) << "fixed MB/s" << std::setw(16) << "tuned MB/s"
+			  << std::setw(12) << "window" << std::setw(12) << "drain MB/s" << std::setw(12) << "queued" << std::setw(10) << "adjusts" << std::endl;
+
+	int result = 0;
+
+	for (auto latency : latencies)
+	{
+		pinch::channel_stats fixed_stats, tuned_stats;
+		std::size_t fixed_queued, tuned_queued;
+
+		double fixed = bench_window(std::chrono::milliseconds(latency), bandwidth, consumer, pinch::kWindowSize, policy, fixed_stats, fixed_queued);
+		double tuned = bench_window(std::chrono::milliseconds(latency), bandwidth, consumer, max_window_size, policy, tuned_stats, tuned_queued);
+
+		// tuning should never make things worse
+		if (tuned < 0.95 * fixed)
+			result = 1;
+
+		// and the data waiting for the consumer never exceeds the window
+		if (tuned_queued > tuned_stats.m_window_size)
+			result = 1;
+
+		std::cout << std::setw(8) << latency
+				  << std::setw(16) << std::fixed << std::setprecision(1) << fixed
+				  << std::setw(16) << std::fixed << std::setprecision(1) << tuned
+				  << std::setw(12) << tuned_stats.m_window_size
+				  << std::setw(12) << std::fixed << std::setprecision(1) << tuned_stats.m_drain_rate / (1024 * 1024)
+				  << std::setw(12) << tuned_queued
+				  << std::setw(10) << tuned_stats.m_window_adjusts << std::endl;
+	}
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+// simulated time. The messages of the key exchange, up to the reply that
+// tells the client the keys, on a link with a round trip time of \a rtt.
+// The client follows basic_connection::do_handshake, the server sends its
+// kexinit right away when \a eager_server is set, or after reading the
+// version string of the client, as OpenSSH does. Returns the time it took.
+
+enum class handshake_mode
+{
+	sequential, ///< kexinit sent after reading the version string of the server
+	pipelined,  ///< kexinit sent right behind our version string
+	guess_right,
+	guess_wrong
+};
+
+std::chrono::milliseconds bench_handshake(std::chrono::milliseconds rtt, bool group_exchange, bool eager_server, handshake_mode mode)
+{
+	using namespace std::chrono;
+
+	enum message_type
+	{
+		version,
+		kexinit,
+		first_kex_packet, ///< dh init or gex request
+		guessed_packet,   ///< the first kex packet, sent before the kexinit of the server was seen
+		gex_group,
+		gex_init,
+		kex_reply
+	};
+
+	struct event
+	{
+		milliseconds m_time;
+		uint32_t m_seq; ///< keeps the order of messages sent at the same time
+		bool m_to_server;
+		message_type m_message;
+
+		bool operator>(const event &e) const { return m_time > e.m_time or (m_time == e.m_time and m_seq > e.m_seq); }
+	};
+
+	std::priority_queue<event, std::vector<event>, std::greater<event>> events;
+	uint32_t seq = 0;
+
+	auto send = [&](milliseconds now, bool to_server, message_type message)
+	{
+		events.push({ now + rtt / 2, seq++, to_server, message });
+	};
+
+	const milliseconds start{};
+
+	send(start, true, version);
+	if (mode != handshake_mode::sequential)
+		send(start, true, kexinit);
+	if (mode == handshake_mode::guess_right or mode == handshake_mode::guess_wrong)
+		send(start, true, guessed_packet);
+
+	send(start, false, version);
+	if (eager_server)
+		send(start, false, kexinit);
+
+	while (not events.empty())
+	{
+		auto e = events.top();
+		events.pop();
+
+		if (e.m_to_server)
+		{
+			switch (e.m_message)
+			{
+				case version:
+					if (not eager_server)
+						send(e.m_time, false, kexinit);
+					break;
+
+				case guessed_packet:
+					// a wrong guess is ignored, RFC 4253 section 7
+					if (mode == handshake_mode::guess_wrong)
+						break;
+					[[fallthrough]];
+
+				case first_kex_packet:
+					send(e.m_time, false, group_exchange ? gex_group : kex_reply);
+					break;
+
+				case gex_init:
+					send(e.m_time, false, kex_reply);
+					break;
+
+				default:
+					break;
+			}
+		}
+		else
+		{
+			switch (e.m_message)
+			{
+				case version:
+					if (mode == handshake_mode::sequential)
+						send(e.m_time, true, kexinit);
+					break;
+
+				case kexinit:
+					if (mode != handshake_mode::guess_right)
+						send(e.m_time, true, first_kex_packet);
+					break;
+
+				case gex_group:
+					send(e.m_time, true, gex_init);
+					break;
+
+				case kex_reply:
+					return e.m_time - start;
+
+				default:
+					break;
+			}
+		}
+	}
+
+	return {};
+}
+
+// --------------------------------------------------------------------
+
+// The same on a real connection: a local_connection talks to a scripted peer
+// over a socketpair. The peer sends its version string and kexinit after
+// \a delay, as if they had to cross the link, and then waits another \a delay
+// for what the client sends in reply. It does not finish the key exchange,
+// it records the messages of the client packets in each of the two flights.
+
+std::vector<std::vector<int>> bench_handshake_flights(std::chrono::milliseconds delay, const std::string &host)
+{
+	using boost::asio::local::stream_protocol;
+
+	boost::asio::io_context io_context;
+
+	stream_protocol::socket client(io_context), peer(io_context);
+	boost::asio::local::connect_pair(client, peer);
+
+	std::vector<std::vector<int>> flights;
+
+	std::thread peer_thread([&peer, &flights, delay]()
+	{
+		std::string received;
+		bool version_seen = false;
+
+		auto read_flight = [&]()
+		{
+			std::this_thread::sleep_for(delay);
+
+			boost::system::error_code ec;
+			peer.non_blocking(true, ec);
+
+			char buffer[4096];
+			while (not ec)
+			{
+				std::size_t n = peer.read_some(boost::asio::buffer(buffer), ec);
+				received.append(buffer, n);
+			}
+
+			if (not version_seen)
+			{
+				auto eol = received.find('\n');
+				if (eol != std::string::npos)
+				{
+					received.erase(0, eol + 1);
+					version_seen = true;
+				}
+			}
+
+			// not encrypted yet: length, padding length and the message number
+			std::vector<int> messages;
+			while (version_seen and received.length() >= 6)
+			{
+				uint32_t length = 0;
+				for (int i = 0; i < 4; ++i)
+					length = length << 8 | static_cast<uint8_t>(received[i]);
+
+				if (received.length() < 4 + length)
+					break;
+
+				messages.push_back(static_cast<uint8_t>(received[5]));
+				received.erase(0, 4 + length);
+			}
+
+			flights.push_back(std::move(messages));
+		};
+
+		read_flight();
+
+		boost::asio::streambuf reply;
+		std::ostream os(&reply);
+		os << pinch::kSSHVersionString << "\r\n";
+		pinch::key_exchange(std::string()).init().write(os, 8);
+
+		boost::system::error_code ec;
+		peer.non_blocking(false, ec);
+		boost::asio::write(peer, reply, ec);
+
+		read_flight();
+
+		peer.close(ec);
+	});
+
+	auto conn = std::make_shared<pinch::local_connection>(io_context, std::move(client), "bench", host);
+
+	// the peer hangs up half way, the open fails. The handler is called with
+	// just the error code, though async_open declares a size as well.
+	conn->async_open([conn](boost::system::error_code, std::size_t = 0) { conn->close(); });
+
+	io_context.run();
+	peer_thread.join();
+
+	return flights;
+}
+
+int bench_handshakes(std::size_t rtt_ms)
+{
+	const std::chrono::milliseconds rtt(rtt_ms);
+	const handshake_mode modes[] = { handshake_mode::sequential, handshake_mode::pipelined, handshake_mode::guess_right, handshake_mode::guess_wrong };
+
+	std::cout << "simulated link with a round trip time of " << rtt_ms << " ms, round trips until the keys are known" << std::endl
+			  << std::endl
+			  << std::setw(10) << "kex" << std::setw(10) << "server" << std::setw(12) << "sequential" << std::setw(12) << "pipelined"
+			  << std::setw(14) << "guess right" << std::setw(14) << "guess wrong" << std::endl;
+
+	int result = 0;
+
+	for (bool group_exchange : { false, true })
+	{
+		for (bool eager_server : { false, true })
+		{
+			std::chrono::milliseconds t[4];
+			for (int i = 0; i < 4; ++i)
+				t[i] = bench_handshake(rtt, group_exchange, eager_server, modes[i]);
+
+			// pipelining never costs time, a right guess saves time and a
+			// wrong guess costs nothing compared to not guessing
+			if (t[1] > t[0] or t[2] >= t[0] or t[3] > t[1])
+				result = 1;
+
+			std::cout << std::setw(10) << (group_exchange ? "gex" : "dh-group")
+					  << std::setw(10) << (eager_server ? "eager" : "waits");
+
+			for (int i = 0; i < 4; ++i)
+				std::cout << std::setw(i < 2 ? 12 : 14) << std::fixed << std::setprecision(1) << double(t[i].count()) / rtt.count();
+
+			std::cout << std::endl;
+		}
+	}
+
+	// The first time the client does not know the server and cannot guess,
+	// the second time its first kex packet should go along with its kexinit.
+	std::cout << std::endl
+			  << "local_connection over a socketpair, the peer answers after " << rtt_ms / 2 << " ms, client packets per flight" << std::endl
+			  << std::endl
+			  << std::setw(10) << "server" << std::setw(20) << "flight 1" << std::setw(20) << "flight 2" << std::endl;
+
+	const std::string host = "bench-" + std::to_string(std::random_device{}());
+
+	for (bool remembered : { false, true })
+	{
+		auto flights = bench_handshake_flights(rtt / 2, host);
+
+		std::cout << std::setw(10) << (remembered ? "known" : "new");
+
+		for (auto &flight : flights)
+		{
+			std::string messages = std::to_string(flight.size()) + " (";
+			for (std::size_t i = 0; i < flight.size(); ++i)
+				messages += (i ? " " : "") + std::to_string(flight[i]);
+			messages += ')';
+
+			std::cout << std::setw(20) << messages;
+		}
+
+		std::cout << std::endl;
+
+		// every packet up to the kex reply is sent, a known server saves a flight
+		std::size_t expected[2] = { remembered ? 2u : 1u, remembered ? 0u : 1u };
+		if (flights.size() != 2 or flights[0].size() != expected[0] or flights[1].size() != expected[1])
+			result = 1;
+	}
+
+	return result;
+}
+
+// --------------------------------------------------------------------
+
+int main(int argc, char *const argv[])
+{
+	po::options_description desc("bench-test options");
+	desc.add_options()
+		("help,h", "Display this message")
+		("cipher", po::value<std::string>()->default_value("aes256-ctr"), "The cipher to use")
+		("mac", po::value<std::string>()->default_value("hmac-sha2-256"), "The MAC to use")
+		("packets", po::value<std::size_t>()->default_value(4096), "Number of packets")
+		("size", po::value<std::vector<std::size_t>>()->multitoken(), "Payload size of each packet, several sizes may be given (default is 32000)")
+		("backends", "Compare the crypto backends on each cipher and MAC, using buffers of --size bytes")
+		("handshake", po::value<std::size_t>()->implicit_value(100), "Count the round trips of the key exchange on a simulated link with this round trip time in ms, and the client packets per flight on a socketpair delayed by half of it (default 100)")
+		("latency", po::value<std::vector<std::size_t>>()->multitoken(), "Compare fixed and tuned channel windows on a simulated link with these round trip times in ms")
+		("bandwidth", po::value<double>()->default_value(125), "Bandwidth of the simulated link in MB/s")
+		("consumer", po::value<double>()->default_value(0), "Rate in MB/s at which the application reads in the --latency runs, 0 means as fast as possible")
+		("max-window", po::value<uint32_t>()->default_value(pinch::kDefaultMaxWindowSize), "Maximum channel window size for the --latency runs")
+		("adjust-threshold", po::value<double>()->default_value(0.5), "Fraction of the window to consume before sending a window adjust in the --latency runs")
+		("adjust-min", po::value<uint32_t>()->default_value(0), "Minimum window adjust in bytes for the --latency runs")
+		("keystream-cache", po::value<std::size_t>()->default_value(0), "Size of the CTR keystream cache for the inline runs")
+		("workers", po::value<std::vector<std::size_t>>()->multitoken(), "Number of crypto workers to test, 0 means inline (default is 0 1 2 4)");
+
+	try
+	{
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+
+		if (vm.count("help"))
+		{
+			std::cout << desc << std::endl;
+			return 0;
+		}
+
+		std::string cipher = vm["cipher"].as<std::string>();
+		std::string mac = vm["mac"].as<std::string>();
+		std::size_t count = vm["packets"].as<std::size_t>();
+		std::vector<std::size_t> sizes{ 32000 };
+		if (vm.count("size"))
+			sizes = vm["size"].as<std::vector<std::size_t>>();
+		std::size_t cache = vm["keystream-cache"].as<std::size_t>();
+
+		if (vm.count("handshake"))
+			return bench_handshakes(vm["handshake"].as<std::size_t>());
+
+		if (vm.count("latency"))
+		{
+			pinch::window_adjust_policy policy;
+			policy.m_threshold = vm["adjust-threshold"].as<double>();
+			policy.m_min_increment = vm["adjust-min"].as<uint32_t>();
+
+			return bench_windows(vm["latency"].as<std::vector<std::size_t>>(),
+				vm["bandwidth"].as<double>() * 1024 * 1024, vm["consumer"].as<double>() * 1024 * 1024, vm["max-window"].as<uint32_t>(), policy);
+		}
+
+		if (vm.count("backends"))
+		{
+			bench_backends(sizes.front());
+			return 0;
+		}
+
+		std::vector<std::size_t> workers{ 0, 1, 2, 4 };
+		if (vm.count("workers"))
+			workers = vm["workers"].as<std::vector<std::size_t>>();
+
+		std::cout << cipher << '/' << mac << ", " << count << " packets" << std::endl
+				  << std::endl
+				  << std::setw(8) << "size" << std::setw(8) << "workers" << std::setw(16) << "encrypt MB/s" << std::setw(16) << "decrypt MB/s" << std::endl;
+
+		int result = 0;
+
+		for (auto size : sizes)
+		{
+			if (size > pinch::kMaxPacketSizeLimit)
+			{
+				std::cerr << "size " << size << " is larger than the maximum packet size" << std::endl;
+				return 1;
+			}
+
+			for (auto w : workers)
+			{
+				boost::asio::streambuf stream;
+
+				double enc = bench_encrypt(cipher, mac, w, cache, count, size, stream);
+				double dec = bench_decrypt(cipher, mac, w, cache, count, size, stream);
+
+				if (dec == 0)
+					result = 1;
+
+				std::cout << std::setw(8) << size << std::setw(8) << w
+						  << std::setw(16) << std::fixed << std::setprecision(1) << enc
+						  << std::setw(16) << std::fixed << std::setprecision(1) << dec << std::endl;
+			}
+		}
+
+		return result;
+	}
+	catch (const std::exception &e)
+	{
+		std::cerr << "exception: " << e.what() << std::endl;
+		return 1;
+	}
+}
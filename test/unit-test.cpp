@@ -5,10 +5,37 @@
 
 // #define BOOST_ASIO_ENABLE_HANDLER_TRACKING
 
+#include <algorithm>
 #include <iostream>
+#include <thread>
 
+#include <pinch/channel_table.hpp>
 #include <pinch/connection.hpp>
+#include <pinch/connector.hpp>
+#include <pinch/crypto-backend.hpp>
+#include <pinch/crypto-engine.hpp>
+#include <pinch/key_exchange.hpp>
+#include <pinch/rate_limiter.hpp>
+#include <pinch/resolver_cache.hpp>
+#include <pinch/scheduler.hpp>
 #include <pinch/terminal_channel.hpp>
+#include <pinch/timer_wheel.hpp>
+#include <pinch/window-tuner.hpp>
+
+// --------------------------------------------------------------------
+// A failed check is reported, main returns non-zero when any check failed
+
+int g_failed_checks = 0;
+
+#define CHECK(expr)                                                                         \
+	do                                                                                      \
+	{                                                                                       \
+		if (not(expr))                                                                      \
+		{                                                                                   \
+			std::cerr << __FILE__ << ':' << __LINE__ << ": check failed: " #expr << std::endl; \
+			++g_failed_checks;                                                              \
+		}                                                                                   \
+	} while (false)
 
 void SetStdinEcho(bool enable)
 {
@@ -140,8 +167,929 @@ class seq_timed
 
 
 
+// --------------------------------------------------------------------
+
+void test_crypto_backends()
+{
+	const pinch::blob key(64, 0x5a), iv(64, 0xa5);
+
+	pinch::blob data(4096);
+	for (std::size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<uint8_t>(i * 7);
+
+	for (auto &name : pinch::crypto_backend::available())
+	{
+		auto backend = pinch::crypto_backend::get(name);
+		CHECK(backend != nullptr);
+		if (backend == nullptr)
+			continue;
+
+		for (auto &cipher : backend->ciphers())
+		{
+			pinch::blob encrypted(data.size()), decrypted(data.size());
+
+			cipher.m_create(true, key.data(), iv.data())->process(data.data(), data.size(), encrypted.data());
+			cipher.m_create(false, key.data(), iv.data())->process(encrypted.data(), encrypted.size(), decrypted.data());
+
+			CHECK(encrypted != data);
+			CHECK(decrypted == data);
+
+			// a partial block can not be processed, it is refused rather than buffered
+			if (name == "openssl" and not cipher.m_random_access and cipher.m_block_size > 1)
+			{
+				bool thrown = false;
+				try
+				{
+					cipher.m_create(true, key.data(), iv.data())->process(data.data(), cipher.m_block_size + 1, encrypted.data());
+				}
+				catch (const std::exception &)
+				{
+					thrown = true;
+				}
+				CHECK(thrown);
+			}
+
+			if (not cipher.m_random_access)
+				continue;
+
+			// seeking to a block gives the same key stream as processing up to it
+			const std::size_t offset = 5 * cipher.m_block_size;
+			pinch::blob tail(data.size() - offset);
+
+			auto c = cipher.m_create(true, key.data(), iv.data());
+			c->seek(offset);
+			c->process(data.data() + offset, tail.size(), tail.data());
+
+			CHECK(std::equal(tail.begin(), tail.end(), encrypted.begin() + offset));
+		}
+
+		for (auto &mac : backend->macs())
+		{
+			pinch::blob digest(mac.m_digest_size);
+
+			auto m = mac.m_create(key.data());
+			CHECK(m->digest_size() == mac.m_digest_size);
+
+			m->update(data.data(), data.size());
+			m->final(digest.data());
+
+			// final restarts, the same data gives the same digest
+			m->update(data.data(), data.size());
+			CHECK(m->verify(digest.data()));
+
+			m->update(data.data(), data.size() - 1);
+			CHECK(not m->verify(digest.data()));
+		}
+
+		// all backends should agree
+		auto cryptopp = pinch::crypto_backend::get("cryptopp");
+		for (auto &cipher : backend->ciphers())
+		{
+			auto other = cryptopp->find_cipher(cipher.m_name);
+			if (other == nullptr)
+				continue;
+
+			pinch::blob a(data.size()), b(data.size());
+			cipher.m_create(true, key.data(), iv.data())->process(data.data(), data.size(), a.data());
+			other->m_create(true, key.data(), iv.data())->process(data.data(), data.size(), b.data());
+			CHECK(a == b);
+		}
+	}
+}
+
+void test_register_cipher()
+{
+	auto &backend = pinch::crypto_backend::instance();
+
+	auto builtin = backend.find_cipher("aes128-ctr");
+	CHECK(builtin != nullptr);
+	if (builtin == nullptr)
+		return;
+
+	pinch::cipher_descriptor d = *builtin;
+	d.m_name = "unit-test-cipher";
+	pinch::crypto_backend::register_cipher(d);
+
+	auto first = backend.find_cipher("unit-test-cipher");
+	CHECK(first != nullptr and first->m_key_size == builtin->m_key_size);
+
+	// replacing leaves the descriptor found earlier untouched
+	d.m_key_size = 2 * builtin->m_key_size;
+	pinch::crypto_backend::register_cipher(d);
+
+	auto second = backend.find_cipher("unit-test-cipher");
+	CHECK(second != first);
+	CHECK(second != nullptr and second->m_key_size == 2 * builtin->m_key_size);
+	CHECK(first->m_key_size == builtin->m_key_size);
+}
+
+// --------------------------------------------------------------------
+
+void test_channel_table()
+{
+	boost::asio::io_context io_context;
+	auto conn = std::make_shared<pinch::connection>(io_context, "user", "localhost", 22);
+
+	auto make_channel = [conn]() -> pinch::channel_ptr
+	{ return std::make_shared<pinch::terminal_channel>(conn); };
+
+	// the lower bits of an ID are the slot, the upper bits the generation
+	const uint32_t kSlotMask = (1U << 20) - 1;
+
+	pinch::channel_table table;
+
+	auto a = make_channel(), b = make_channel();
+	uint32_t id_a = table.insert(a), id_b = table.insert(b);
+
+	CHECK(id_a != 0 and id_b != 0 and id_a != id_b);
+	CHECK(table.size() == 2);
+	CHECK(table.find(id_a) == a and table.find(id_b) == b);
+	CHECK(table.find(0) == nullptr);
+
+	CHECK(table.erase(id_a));
+	CHECK(not table.erase(id_a));
+	CHECK(table.find(id_a) == nullptr);
+	CHECK(table.size() == 1);
+
+	// the slot is reused with a new ID, the stale ID finds nothing
+	auto c = make_channel();
+	uint32_t id_c = table.insert(c);
+	CHECK((id_c & kSlotMask) == (id_a & kSlotMask));
+	CHECK(id_c != id_a);
+	CHECK(table.find(id_a) == nullptr);
+	CHECK(not table.erase(id_a));
+	CHECK(table.find(id_c) == c);
+
+	// the generation wraps around, skipping zero, an ID returns only after a full cycle
+	uint32_t id = id_c;
+	std::size_t cycle = 0;
+	bool never_zero = true;
+
+	do
+	{
+		CHECK(table.erase(id));
+		id = table.insert(c);
+		never_zero = never_zero and id != 0 and (id >> 20) != 0;
+		++cycle;
+	} while (id != id_c and cycle < 10000);
+
+	CHECK(never_zero);
+	CHECK(cycle == (1U << 12) - 1);
+	CHECK(table.size() == 2);
+
+	auto channels = table.channels();
+	CHECK(channels.size() == 2);
+}
+
+// --------------------------------------------------------------------
+
+void test_window_tuner()
+{
+	using namespace std::chrono_literals;
+
+	pinch::window_tuner tuner(1000, 4000);
+	auto now = pinch::window_tuner::time_point{} + 1s;
+
+	// no round trip time known yet, nothing changes
+	tuner.consumed(1000, now);
+	CHECK(tuner.get_window_size() == 1000);
+
+	// the first byte beyond the window granted before the adjust ends the measurement
+	tuner.adjust_sent(1000, now);
+	tuner.received(1000, now + 10ms);
+	tuner.received(1, now + 100ms);
+	CHECK(tuner.get_stats().m_rtt == 100ms);
+
+	// consuming less than half a window per round trip does not grow the window
+	now += 1s;
+	tuner.consumed(200, now);
+	tuner.consumed(200, now + 100ms);
+	CHECK(tuner.get_window_size() == 1000);
+
+	// more than half a window does
+	tuner.consumed(300, now + 150ms);
+	tuner.consumed(300, now + 200ms);
+	CHECK(tuner.get_window_size() == 2000);
+
+	// doubling stops at the maximum
+	for (int i = 1; i <= 4; ++i)
+		tuner.consumed(4000, now + 200ms + i * 100ms);
+
+	CHECK(tuner.get_window_size() == 4000);
+	CHECK(tuner.get_stats().m_window_grows == 2);
+
+	// the maximum never drops below the initial window
+	tuner.set_max_window_size(500);
+	CHECK(tuner.get_max_window_size() == 1000);
+	CHECK(tuner.get_window_size() == 1000);
+
+	// the credit is sent once half the window can be returned
+	pinch::window_adjust_policy policy;
+	CHECK(policy.credit(1000, 1000) == 0);
+	CHECK(policy.credit(1000, 600) == 0);
+	CHECK(policy.credit(1000, 500) == 500);
+	CHECK(policy.credit(1000, 2000) == 0);
+
+	// but never less than the minimum increment, limited to the window
+	policy.m_min_increment = 800;
+	CHECK(policy.credit(1000, 300) == 0);
+	CHECK(policy.credit(1000, 200) == 800);
+	policy.m_min_increment = 5000;
+	CHECK(policy.credit(1000, 0) == 1000);
+}
+
+// --------------------------------------------------------------------
+
+void test_receive_queue()
+{
+	pinch::detail::receive_queue q;
+
+	q.append("hello, ", 7);
+	q.append("", 0);
+	q.append("world", 5);
+	CHECK(q.size() == 12);
+
+	// each chunk is a buffer of its own
+	auto buffers = q.data();
+	CHECK(buffers.size() == 2);
+	CHECK(buffers.size() == 2 and buffers[0].size() == 7 and buffers[1].size() == 5);
+
+	// a read may span chunks and end halfway one
+	char b1[9] = {}, b2[3] = {};
+	std::size_t n = q.read(std::array<boost::asio::mutable_buffer, 2>{ boost::asio::buffer(b1, 4), boost::asio::buffer(b1 + 4, 5) });
+	CHECK(n == 9);
+	CHECK(std::string(b1, 9) == "hello, wo");
+	CHECK(q.size() == 3);
+
+	buffers = q.data();
+	CHECK(buffers.size() == 1 and buffers[0].size() == 3);
+
+	// partial consume
+	q.consume(1);
+	CHECK(q.size() == 2);
+	CHECK(q.read(boost::asio::buffer(b2)) == 2);
+	CHECK(std::string(b2, 2) == "ld");
+	CHECK(q.empty());
+	CHECK(q.data().empty());
+
+	// the storage of a consumed chunk is used for the next one
+	q.append("0123456789", 10);
+	auto first = q.data().front().data();
+	q.consume(10);
+	q.append("abc", 3);
+	CHECK(q.data().front().data() == first);
+
+	// consuming more than there is empties the queue
+	q.consume(100);
+	CHECK(q.empty() and q.size() == 0);
+}
+
+// --------------------------------------------------------------------
+
+void test_outbound_scheduler()
+{
+	using pinch::traffic_class;
+
+	std::vector<std::string> released;
+	boost::system::error_code last_ec;
+
+	auto release = [&](const std::string &name)
+	{
+		return [&released, &last_ec, name](const boost::system::error_code &ec)
+		{
+			if (ec)
+				last_ec = ec;
+			else
+				released.push_back(name);
+		};
+	};
+
+	pinch::outbound_scheduler scheduler;
+	CHECK(scheduler.empty());
+	CHECK(not scheduler.release_next());
+
+	// packets of a flow leave in the order they were queued
+	for (int i = 0; i < 3; ++i)
+		scheduler.push(1, traffic_class::bulk, 1, 100, release("a" + std::to_string(i)));
+	while (scheduler.release_next())
+		;
+	CHECK((released == std::vector<std::string>{ "a0", "a1", "a2" }));
+	released.clear();
+
+	// interactive data always goes before bulk data, control counts as interactive
+	scheduler.push(1, traffic_class::bulk, 1, 100, release("bulk"));
+	scheduler.push(2, traffic_class::interactive, 1, 100, release("interactive"));
+	scheduler.push(3, traffic_class::control, 1, 100, release("control"));
+	while (scheduler.release_next())
+		;
+	CHECK((released == std::vector<std::string>{ "interactive", "control", "bulk" }));
+	released.clear();
+
+	// within a class the flows share according to their weight
+	const std::size_t kPacketSize = 0x8000;
+	for (int i = 0; i < 40; ++i)
+	{
+		scheduler.push(1, traffic_class::bulk, 1, kPacketSize, release("light"));
+		scheduler.push(2, traffic_class::bulk, 3, kPacketSize, release("heavy"));
+	}
+	for (int i = 0; i < 40; ++i)
+		scheduler.release_next();
+	CHECK(std::count(released.begin(), released.end(), "light") == 10);
+	CHECK(std::count(released.begin(), released.end(), "heavy") == 30);
+	scheduler.cancel_all(pinch::error::make_error_code(pinch::error::connection_lost));
+	CHECK(scheduler.empty());
+	CHECK(last_ec == pinch::error::make_error_code(pinch::error::connection_lost));
+	released.clear();
+
+	// a message pushed behind a flow's data keeps the flow's class and comes last
+	CHECK(not scheduler.push_behind(1, 10, release("nothing waiting")));
+	scheduler.push(1, traffic_class::bulk, 1, 100, release("data"));
+	CHECK(scheduler.push_behind(1, 10, release("close")));
+	scheduler.push(2, traffic_class::interactive, 1, 100, release("keystroke"));
+	while (scheduler.release_next())
+		;
+	CHECK((released == std::vector<std::string>{ "keystroke", "data", "close" }));
+	released.clear();
+
+	// cancelling a flow leaves the other flows alone
+	last_ec = {};
+	scheduler.push(1, traffic_class::bulk, 1, 100, release("cancelled"));
+	scheduler.push(2, traffic_class::bulk, 1, 100, release("kept"));
+	scheduler.cancel(1, pinch::error::make_error_code(pinch::error::channel_closed));
+	CHECK(last_ec == pinch::error::make_error_code(pinch::error::channel_closed));
+	CHECK(not scheduler.push_behind(1, 10, release("gone")));
+	while (scheduler.release_next())
+		;
+	CHECK((released == std::vector<std::string>{ "kept" }));
+	CHECK(scheduler.empty());
+
+	CHECK(scheduler.get_stats(traffic_class::bulk).m_packets > 0);
+}
+
+// --------------------------------------------------------------------
+
+void test_rate_limiter()
+{
+	using namespace std::chrono_literals;
+
+	pinch::rate_limiter limiter;
+
+	// no limit, no delay and no debt
+	auto now = pinch::rate_limiter::clock_type::now();
+	limiter.consume(1000000, now);
+	CHECK(limiter.delay(now) == 0s);
+
+	// a megabyte per second, the bucket is full right away
+	limiter.set_rate(1000000, 200000);
+	CHECK(limiter.get_burst() == 200000);
+	now = pinch::rate_limiter::clock_type::now();
+	CHECK(limiter.delay(now) == 0s);
+
+	// an empty bucket waits for a single byte
+	limiter.consume(200000, now);
+	CHECK(limiter.delay(now) > 0s);
+	CHECK(limiter.delay(now) <= 1ms);
+
+	// a debt of 100000 bytes takes a tenth of a second to pay off
+	limiter.consume(100000, now);
+	auto delay = limiter.delay(now);
+	CHECK(delay >= 100ms and delay < 101ms);
+
+	delay = limiter.delay(now + 50ms);
+	CHECK(delay >= 50ms and delay < 51ms);
+
+	// the clock going back does not change the bucket
+	delay = limiter.delay(now);
+	CHECK(delay >= 50ms and delay < 51ms);
+
+	CHECK(limiter.delay(now + 101ms) == 0s);
+
+	// the bucket never holds more than the burst
+	now += 10s;
+	limiter.consume(201000, now);
+	delay = limiter.delay(now);
+	CHECK(delay >= 1ms and delay < 2ms);
+
+	// a new rate keeps the debt, but pays it off faster
+	limiter.consume(99000, now);
+	limiter.set_rate(2000000, 200000);
+	delay = limiter.delay(now);
+	CHECK(delay >= 50ms and delay < 51ms);
+
+	// a tiny burst is raised to a full packet
+	limiter.set_rate(1000, 10);
+	CHECK(limiter.get_burst() == pinch::kMaxPacketSize);
+
+	limiter.set_rate(0);
+	CHECK(limiter.get_rate() == 0);
+	CHECK(limiter.delay(now) == 0s);
+}
+
+// --------------------------------------------------------------------
+
+void test_tcp_connector()
+{
+	using namespace std::chrono_literals;
+	using boost::asio::ip::tcp;
+	using endpoint = tcp::endpoint;
+
+	auto v4 = [](int n) { return endpoint(boost::asio::ip::make_address("10.0.0." + std::to_string(n)), 22); };
+	auto v6 = [](int n) { return endpoint(boost::asio::ip::make_address("fd00::" + std::to_string(n)), 22); };
+
+	// the families alternate starting with the first one, the order within a family is kept
+	CHECK((pinch::tcp_connector::interleave({ v6(1), v6(2), v6(3), v4(1), v4(2) }) ==
+		std::vector<endpoint>{ v6(1), v4(1), v6(2), v4(2), v6(3) }));
+	CHECK((pinch::tcp_connector::interleave({ v4(1), v6(1), v6(2) }) ==
+		std::vector<endpoint>{ v4(1), v6(1), v6(2) }));
+	CHECK(pinch::tcp_connector::interleave({}).empty());
+
+	boost::asio::io_context io_context;
+	auto loopback = boost::asio::ip::address_v4::loopback();
+
+	// a listener that accepts, the connection is completed by the kernel
+	tcp::acceptor good(io_context, endpoint(loopback, 0));
+
+	// a listener that never accepts, its queue is full so a connect never finishes
+	tcp::acceptor stuck(io_context);
+	stuck.open(tcp::v4());
+	stuck.bind(endpoint(loopback, 0));
+	stuck.listen(0);
+	tcp::socket filler(io_context);
+	filler.connect(stuck.local_endpoint());
+
+	// a port nobody listens on
+	endpoint refused;
+	{
+		tcp::acceptor a(io_context, endpoint(loopback, 0));
+		refused = a.local_endpoint();
+	}
+
+	struct result
+	{
+		bool done = false;
+		boost::system::error_code ec;
+		endpoint peer;
+		std::chrono::steady_clock::duration elapsed;
+	};
+
+	auto run = [&](const pinch::connect_options &options, const std::vector<endpoint> &endpoints, bool cancel = false)
+	{
+		result r;
+		auto start = std::chrono::steady_clock::now();
+
+		auto connector = std::make_shared<pinch::tcp_connector>(io_context.get_executor(), options);
+		connector->async_connect(endpoints, {},
+			[&r, start](const boost::system::error_code &ec, tcp::socket &&socket)
+			{
+				r.done = true;
+				r.ec = ec;
+				r.elapsed = std::chrono::steady_clock::now() - start;
+
+				boost::system::error_code ignore;
+				if (not ec)
+					r.peer = socket.remote_endpoint(ignore);
+			});
+
+		if (cancel)
+			connector->cancel();
+
+		io_context.restart();
+		io_context.run_for(5s);
+		return r;
+	};
+
+	pinch::connect_options options;
+	options.m_attempt_delay = 100ms;
+
+	// the stuck address does not answer within the attempt delay, the next one wins
+	auto r = run(options, { stuck.local_endpoint(), good.local_endpoint() });
+	CHECK(r.done and not r.ec);
+	CHECK(r.peer == good.local_endpoint());
+	CHECK(r.elapsed >= 100ms and r.elapsed < 2s);
+
+	// a refused address does not wait for the attempt delay
+	options.m_attempt_delay = 10s;
+	r = run(options, { refused, good.local_endpoint() });
+	CHECK(r.done and not r.ec);
+	CHECK(r.peer == good.local_endpoint());
+	CHECK(r.elapsed < 2s);
+
+	// when all addresses fail the last error is reported
+	r = run(options, { refused, refused });
+	CHECK(r.done and r.ec == boost::asio::error::connection_refused);
+
+	// a single attempt may take no longer than the attempt timeout
+	options.m_attempt_timeout = 100ms;
+	r = run(options, { stuck.local_endpoint() });
+	CHECK(r.done and r.ec == boost::asio::error::timed_out);
+	CHECK(r.elapsed >= 100ms and r.elapsed < 2s);
+
+	// nor may all of them together take longer than the timeout
+	options.m_attempt_delay = 50ms;
+	options.m_attempt_timeout = 0ms;
+	options.m_timeout = 200ms;
+	r = run(options, { stuck.local_endpoint(), stuck.local_endpoint() });
+	CHECK(r.done and r.ec == boost::asio::error::timed_out);
+	CHECK(r.elapsed >= 200ms and r.elapsed < 2s);
+
+	// cancel reports operation_aborted
+	r = run(options, { stuck.local_endpoint() }, true);
+	CHECK(r.done and r.ec == boost::asio::error::operation_aborted);
+}
+
+// --------------------------------------------------------------------
+
+void test_resolver_cache()
+{
+	using namespace std::chrono_literals;
+	using endpoints = std::vector<boost::asio::ip::tcp::endpoint>;
+
+	auto cache = std::make_shared<pinch::resolver_cache>(400ms, 400ms);
+	cache->set_refresh_ahead(300ms);
+
+	boost::asio::io_context io_context;
+
+	struct result
+	{
+		bool done = false;
+		boost::system::error_code ec;
+		endpoints eps;
+	};
+
+	auto lookup = [&](const std::string &host, result &r, boost::asio::io_context &ctx)
+	{
+		cache->async_resolve(ctx.get_executor(), host, 22,
+			[&r](const boost::system::error_code &ec, const endpoints &eps)
+			{
+				r.done = true;
+				r.ec = ec;
+				r.eps = eps;
+			});
+	};
+
+	auto wait = [&](result &r)
+	{
+		// the answer is posted from the cache's thread, poll for it
+		for (int i = 0; i < 500 and not r.done; ++i)
+		{
+			io_context.restart();
+			if (io_context.poll() == 0)
+				std::this_thread::sleep_for(10ms);
+		}
+		return r.done;
+	};
+
+	// lookups for the same name wait for a single query, even when the
+	// context of the first caller never runs
+	boost::asio::io_context stopped;
+	result first, second;
+	lookup("localhost", first, stopped);
+	lookup("localhost", second, io_context);
+	CHECK(wait(second) and not second.ec and not second.eps.empty());
+	CHECK(not first.done);
+
+	auto stats = cache->get_stats();
+	CHECK(stats.m_misses == 2 and stats.m_hits == 0 and stats.m_entries == 1);
+
+	// the answer is cached
+	result hit;
+	lookup("localhost", hit, io_context);
+	CHECK(wait(hit) and hit.eps == second.eps);
+	CHECK(cache->get_stats().m_hits == 1);
+
+	// a failure is cached as well
+	result failed, negative;
+	lookup("no-such-host.invalid", failed, io_context);
+	CHECK(wait(failed) and failed.ec);
+	lookup("no-such-host.invalid", negative, io_context);
+	CHECK(wait(negative) and negative.ec == failed.ec);
+	stats = cache->get_stats();
+	CHECK(stats.m_hits == 2 and stats.m_negative_hits == 1 and stats.m_misses == 3);
+
+	// a name used shortly before it expires is resolved again in the background
+	std::this_thread::sleep_for(200ms);
+	result refresh;
+	lookup("localhost", refresh, io_context);
+	CHECK(wait(refresh) and not refresh.ec);
+	CHECK(cache->get_stats().m_refreshes == 1);
+
+	// and is therefore still there after the original answer expired
+	std::this_thread::sleep_for(300ms);
+	result refreshed;
+	lookup("localhost", refreshed, io_context);
+	CHECK(wait(refreshed) and not refreshed.ec);
+	CHECK(cache->get_stats().m_hits == 4);
+
+	// the failure did expire
+	result expired;
+	lookup("no-such-host.invalid", expired, io_context);
+	CHECK(wait(expired) and expired.ec);
+	CHECK(cache->get_stats().m_misses == 4);
+}
+
+// --------------------------------------------------------------------
+
+void test_timer_wheel()
+{
+	using namespace std::chrono_literals;
+	using clock_type = pinch::timer_wheel::clock_type;
+
+	boost::asio::io_context io_context;
+	auto &wheel = boost::asio::use_service<pinch::timer_wheel>(io_context);
+
+	std::vector<std::string> fired;
+	auto start = clock_type::now();
+
+	// each timer records its name, and checks it did not fire early
+	auto make_handler = [&](const std::string &name, clock_type::duration after)
+	{
+		return [&fired, name, deadline = start + after]()
+		{
+			CHECK(clock_type::now() >= deadline);
+			fired.push_back(name);
+		};
+	};
+
+	pinch::timer_wheel::timer a(io_context), b(io_context), c(io_context), d(io_context), e(io_context);
+	pinch::timer_wheel::timer f(io_context), g(io_context), h(io_context), periodic(io_context);
+
+	// timers fire in order of their time, not in the order they were set
+	a.expires_at(start + 150ms, make_handler("a", 150ms));
+	b.expires_at(start + 450ms, make_handler("b", 450ms));
+	c.expires_at(start + 250ms, make_handler("c", 250ms));
+
+	// a cancelled timer does not fire
+	d.expires_at(start + 200ms, make_handler("d", 200ms));
+	d.cancel();
+	CHECK(not d.pending());
+
+	// setting a pending timer replaces its handler
+	e.expires_at(start + 100ms, make_handler("old e", 100ms));
+	e.expires_at(start + 350ms, make_handler("e", 350ms));
+
+	// more than 64 ticks away these start in the second level and cascade down
+	h.expires_at(start + 6450ms, make_handler("h", 6450ms));
+	g.expires_at(start + 6650ms, make_handler("g", 6650ms));
+	f.expires_at(start + 6550ms, make_handler("f", 6550ms));
+
+	// a handler may set its own timer again
+	int count = 0;
+	std::function<void()> tick = [&]()
+	{
+		if (++count < 3)
+			periodic.expires_after(100ms, tick);
+	};
+	periodic.expires_after(100ms, tick);
+
+	CHECK(wheel.size() == 8);
+
+	io_context.run();
+
+	CHECK((fired == std::vector<std::string>{ "a", "c", "e", "b", "h", "f", "g" }));
+	CHECK(count == 3);
+	CHECK(wheel.size() == 0);
+	CHECK(not a.pending() and not g.pending());
+
+	// timers may be set, cancelled and destroyed on another thread than the one running the wheel
+	io_context.restart();
+	auto work = boost::asio::make_work_guard(io_context);
+	std::thread runner([&io_context]() { io_context.run(); });
+
+	std::atomic<int> calls = 0;
+	for (int i = 0; i < 1000; ++i)
+	{
+		pinch::timer_wheel::timer t(io_context);
+		t.expires_after(std::chrono::milliseconds(i % 3), [&calls]() { ++calls; });
+		if (i % 2)
+			t.cancel();
+		else
+			std::this_thread::sleep_for(50us);
+	}
+
+	work.reset();
+	runner.join();
+
+	CHECK(wheel.size() == 0);
+	CHECK(calls <= 500);
+}
+
+// --------------------------------------------------------------------
+
+void test_key_exchange_guess()
+{
+	using namespace pinch;
+
+	crypto_profile profile;
+	profile.m_kex = "diffie-hellman-group-exchange-sha256,diffie-hellman-group14-sha256";
+	profile.m_server_host_key = "rsa-sha2-256";
+
+	// a kexinit as sent by the host
+	auto host_kexinit = [&profile](const std::string &kex, bool first_kex_packet_follows)
+	{
+		opacket out(msg_kexinit);
+		for (int i = 0; i < 16; ++i)
+			out << uint8_t(0);
+		out << kex << profile.m_server_host_key
+			<< profile.m_enc_s2c << profile.m_enc_c2s
+			<< profile.m_ver_s2c << profile.m_ver_c2s
+			<< profile.m_cmp_s2c << profile.m_cmp_c2s
+			<< "" << ""
+			<< first_kex_packet_follows << uint32_t(0);
+
+		blob b = out;
+		return ipacket(b.data(), b.size());
+	};
+
+	// the first_kex_packet_follows flag is the byte before the reserved uint32
+	auto follows = [](const opacket &kexinit)
+	{
+		blob b = kexinit;
+		return b[b.size() - 5] != 0;
+	};
+
+	const std::string host_version = "SSH-2.0-unit-test";
+
+	// a right guess, the first kex packet was sent with our kexinit already
+	{
+		key_exchange kex(host_version, profile);
+		CHECK(follows(kex.init(true)));
+
+		auto first = kex.first_kex_packet();
+		CHECK(first and first.data()[0] == msg_kex_dh_gex_request);
+
+		opacket out;
+		boost::system::error_code ec;
+		auto in = host_kexinit(profile.m_kex, false);
+		CHECK(kex.process(in, out, ec));
+		CHECK(not ec and out.empty());
+
+		// which makes guessing likely to pay off next time
+		kex.remember_server("unit-test-host:22");
+		CHECK(key_exchange::guess_likely("unit-test-host:22", profile));
+	}
+
+	// a wrong guess, the host prefers another kex algorithm and ignores our
+	// first kex packet, so it is sent again
+	{
+		key_exchange kex(host_version, profile);
+		kex.init(true);
+
+		opacket out;
+		boost::system::error_code ec;
+		auto in = host_kexinit("diffie-hellman-group14-sha256,diffie-hellman-group-exchange-sha256", false);
+		CHECK(kex.process(in, out, ec));
+		CHECK(not ec and out and out.data()[0] == msg_kex_dh_gex_request);
+
+		kex.remember_server("unit-test-host:22");
+		CHECK(not key_exchange::guess_likely("unit-test-host:22", profile));
+	}
+
+	// no guess at all
+	{
+		key_exchange kex(host_version, profile);
+		CHECK(not follows(kex.init(false)));
+		CHECK(kex.first_kex_packet().empty());
+	}
+
+	// a wrong guess by the host, its first kex packet is ignored but the
+	// messages that are not part of the key exchange are not
+	{
+		key_exchange kex(host_version, profile);
+		kex.init(false);
+
+		opacket out;
+		boost::system::error_code ec;
+		auto in = host_kexinit("diffie-hellman-group14-sha256,diffie-hellman-group-exchange-sha256", true);
+		CHECK(kex.process(in, out, ec));
+		CHECK(not ec and out and out.data()[0] == msg_kex_dh_gex_request);
+
+		ipacket ignore(msg_ignore, blob{});
+		out = {};
+		CHECK(not kex.process(ignore, out, ec));
+
+		ipacket debug(msg_debug, blob{});
+		CHECK(not kex.process(debug, out, ec));
+
+		ipacket guess(msg_kex_dh_init, blob{});
+		CHECK(kex.process(guess, out, ec));
+		CHECK(not ec and out.empty());
+
+		// the next kex packet is processed, a group of p = 23 and g = 5
+		opacket group(msg_kex_dh_gex_group);
+		group << std::string("\x17") << std::string("\x05");
+		blob b = group;
+		ipacket reply(b.data(), b.size());
+		CHECK(kex.process(reply, out, ec));
+		CHECK(not ec and out and out.data()[0] == msg_kex_dh_gex_init);
+	}
+
+	// the number of servers remembered is limited, the oldest is forgotten first
+	{
+		key_exchange kex(host_version, profile);
+		kex.init(false);
+
+		opacket out;
+		boost::system::error_code ec;
+		auto in = host_kexinit(profile.m_kex, false);
+		kex.process(in, out, ec);
+
+		kex.remember_server("oldest:22");
+		for (std::size_t i = 0; i < kMaxRememberedServers; ++i)
+			kex.remember_server("server-" + std::to_string(i) + ":22");
+
+		CHECK(not key_exchange::guess_likely("oldest:22", profile));
+		CHECK(key_exchange::guess_likely("server-0:22", profile));
+	}
+}
+
+// --------------------------------------------------------------------
+
+void test_keystream_cache()
+{
+	const pinch::blob key(64, 0x5a), iv(64, 0xa5);
+
+	pinch::blob data(8192);
+	for (std::size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<uint8_t>(i * 13);
+
+	for (auto &name : pinch::crypto_backend::available())
+	{
+		auto backend = pinch::crypto_backend::get(name);
+		if (backend == nullptr)
+			continue;
+
+		for (auto &cipher : backend->ciphers())
+		{
+			if (not cipher.m_random_access)
+				continue;
+
+			pinch::blob expected(data.size()), encrypted(data.size());
+			cipher.m_create(true, key.data(), iv.data())->process(data.data(), data.size(), expected.data());
+
+			pinch::TransformData transform;
+			transform.reset_encryptor(std::string(cipher.m_name), key.data(), iv.data(), *backend);
+			transform.set_keystream_cache(1024);
+
+			// small writes from the cache, with keystream left over
+			std::size_t offset = 0;
+			for (; offset < 1000; offset += 100)
+			{
+				transform.prefetch();
+				transform.process(data.data() + offset, 100, encrypted.data() + offset);
+			}
+
+			// turned off in mid-stream, the keystream already generated is used up first
+			CHECK(transform.get_keystream_available() > 0);
+			transform.set_keystream_cache(0);
+			transform.prefetch();
+			for (; offset < 4000; offset += 100)
+				transform.process(data.data() + offset, 100, encrypted.data() + offset);
+
+			// after which no keystream is generated ahead anymore
+			transform.prefetch();
+			CHECK(transform.get_keystream_available() == 0);
+
+			// and on again
+			transform.set_keystream_cache(512);
+			for (; offset < 6000; offset += 100)
+			{
+				transform.prefetch();
+				transform.process(data.data() + offset, 100, encrypted.data() + offset);
+			}
+
+			// off while the cache is full, followed by a single large write
+			transform.set_keystream_cache(0);
+			transform.process(data.data() + offset, data.size() - offset, encrypted.data() + offset);
+			CHECK(transform.get_keystream_available() == 0);
+
+			CHECK(encrypted == expected);
+		}
+	}
+}
+
+// --------------------------------------------------------------------
+
 int main()
 {
+	test_crypto_backends();
+	test_register_cipher();
+	test_keystream_cache();
+	test_receive_queue();
+	test_channel_table();
+	test_window_tuner();
+	test_outbound_scheduler();
+	test_rate_limiter();
+	test_tcp_connector();
+	test_resolver_cache();
+	test_timer_wheel();
+	test_key_exchange_guess();
+
+	if (g_failed_checks)
+	{
+		std::cerr << g_failed_checks << " checks failed" << std::endl;
+		return 1;
+	}
+
 
 	boost::asio::io_context io_context;
 